@@ -0,0 +1,398 @@
+/*
+ * End-to-end benchmarks of the shell binary.
+ *
+ * Each benchmark writes a generated script to a temporary file, runs bsh on
+ * it and times the whole run (the best of several), so everything from
+ * reading the input to reaping the last stage is included:
+ *
+ *   latency      `true | true | ...` pipelines of 1 to 16 stages, with the
+ *                builtin and with /bin/true; the time per pipeline
+ *   throughput   pipelines per second over a long script of short external
+ *                pipelines
+ *   parse        bsh -n over a script of long lines; MiB/s through the
+ *                reader, lexer and parser
+ *   image        bsh -n over the same script run from its compiled image,
+ *                once it has been saved
+ *   pipe         bytes per second through `cat` stages, for each pipesize
+ *
+ * Compiled scripts are kept in a temporary directory, and only the image
+ * benchmark uses them.  Prints one JSON object per measurement.
+ */
+#define _GNU_SOURCE
+
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mu.h"
+
+#define USAGE \
+    "Usage: bsh_bench [-h] [-b BSH] [-n ITERATIONS] [-q]\n" \
+    "\n" \
+    "optional arguments\n" \
+    "   -h, --help\n" \
+    "       Show usage statement and exit.\n" \
+    "\n" \
+    "   -b, --bsh BSH\n" \
+    "       The shell to benchmark (default: ./bsh).\n" \
+    "\n" \
+    "   -n, --iterations ITERATIONS\n" \
+    "       Number of timed runs per measurement; the best is reported\n" \
+    "       (default: 3).\n" \
+    "\n" \
+    "   -q, --quick\n" \
+    "       Use smaller inputs, for a smoke test."
+
+static const char *bsh_path = "./bsh";
+static unsigned int iterations = 3;
+static unsigned int scale = 1;  /* input sizes are divided by this */
+
+
+static void
+usage(int status)
+{
+    puts(USAGE);
+    exit(status);
+}
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/* a new temporary script, opened for writing; the caller unlinks it */
+static FILE *
+script_new(char *path, size_t size)
+{
+    FILE *fp;
+    int fd;
+
+    mu_strlcpy(path, "/tmp/bsh_bench.XXXXXX", size);
+    fd = mkstemp(path);
+    if (fd == -1)
+        mu_die_errno(errno, "mkstemp");
+    fp = fdopen(fd, "w");
+    if (fp == NULL)
+        mu_die_errno(errno, "fdopen");
+
+    return fp;
+}
+
+
+static void
+script_close(FILE *fp)
+{
+    if (fclose(fp) == EOF)
+        mu_die_errno(errno, "fclose");
+}
+
+
+/*
+ * Run `bsh [flag] [--no-cache] script` with stdout discarded; return the best
+ * wall time.
+ */
+static double
+run_bsh(const char *flag, bool cache, const char *script)
+{
+    posix_spawn_file_actions_t fa;
+    char *argv[5];
+    double t0, t, best = 0;
+    unsigned int it;
+    int wstatus;
+    pid_t pid;
+    int i = 0;
+    int err;
+
+    argv[i++] = (char *)bsh_path;
+    if (flag != NULL)
+        argv[i++] = (char *)flag;
+    if (!cache)
+        argv[i++] = "--no-cache";
+    argv[i++] = (char *)script;
+    argv[i] = NULL;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+            O_WRONLY, 0);
+
+    for (it = 0; it < iterations; it++) {
+        t0 = now();
+        err = posix_spawn(&pid, bsh_path, &fa, NULL, argv, environ);
+        if (err != 0)
+            mu_die_errno(err, "can't run %s", bsh_path);
+        if (waitpid(pid, &wstatus, 0) == -1)
+            mu_die_errno(errno, "waitpid");
+        t = now() - t0;
+
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            mu_die("%s %s failed (wait status %d)", bsh_path, script, wstatus);
+        if (best == 0 || t < best)
+            best = t;
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+    return best;
+}
+
+
+static void
+write_pipeline(FILE *fp, const char *stage, unsigned int num_stages)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_stages; i++)
+        fprintf(fp, "%s%s", i > 0 ? " | " : "", stage);
+    fputc('\n', fp);
+}
+
+
+static void
+bench_latency(void)
+{
+    static const unsigned int stages[] = { 1, 2, 4, 8, 16 };
+    /* the builtin, and the same through fork and exec */
+    static const char *commands[] = { "true", "/bin/true" };
+    unsigned int lines = 200 / scale, s, c, i;
+    char path[64];
+    double t;
+    FILE *fp;
+
+    for (c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+        for (s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+            fp = script_new(path, sizeof(path));
+            for (i = 0; i < lines; i++)
+                write_pipeline(fp, commands[c], stages[s]);
+            script_close(fp);
+
+            t = run_bsh(NULL, false, path);
+            unlink(path);
+
+            printf("{\"bench\": \"latency\", \"command\": \"%s\", "
+                    "\"stages\": %u, \"pipelines\": %u, \"seconds\": %.6f, "
+                    "\"us_per_pipeline\": %.1f}\n",
+                    commands[c], stages[s], lines, t, t / lines * 1e6);
+            fflush(stdout);
+        }
+    }
+}
+
+
+static void
+bench_throughput(void)
+{
+    unsigned int lines = 5000 / scale, i;
+    char path[64];
+    double t;
+    FILE *fp;
+
+    fp = script_new(path, sizeof(path));
+    for (i = 0; i < lines; i++)
+        fprintf(fp, "/bin/true %u | /bin/true\n", i);
+    script_close(fp);
+
+    t = run_bsh(NULL, false, path);
+    unlink(path);
+
+    printf("{\"bench\": \"throughput\", \"stages\": 2, \"pipelines\": %u, "
+            "\"seconds\": %.6f, \"pipelines_per_s\": %.1f}\n",
+            lines, t, lines / t);
+    fflush(stdout);
+}
+
+
+static void
+bench_parse(void)
+{
+    size_t size = ((size_t)32 << 20) / scale, line_len = 64 * 1024;
+    size_t len = 0, n;
+    uint32_t x = 2463534242u;   /* xorshift32 seed; fixed for repeatability */
+    char path[64];
+    double t;
+    FILE *fp;
+
+    fp = script_new(path, sizeof(path));
+    while (len < size) {
+        /* a long line of words, quoting, pipes and redirects */
+        n = (size_t)fprintf(fp, "cmd ");
+        while (n < line_len) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            switch (x % 16) {
+            case 0:
+                n += (size_t)fprintf(fp, "| cmd%u arg ", x % 100);
+                break;
+            case 1:
+                n += (size_t)fprintf(fp, ">out%u ", x % 10);
+                break;
+            case 2:
+                n += (size_t)fprintf(fp, "'quoted %u' ", x);
+                break;
+            case 3:
+                n += (size_t)fprintf(fp, "\"dq \\\"%u\\\"\" ", x);
+                break;
+            default:
+                n += (size_t)fprintf(fp, "word%u ", x);
+                break;
+            }
+        }
+        fprintf(fp, "last\n");
+        len += n + 5;
+    }
+    script_close(fp);
+
+    t = run_bsh("-n", false, path);
+    printf("{\"bench\": \"parse\", \"bytes\": %zu, \"line_bytes\": %zu, "
+            "\"seconds\": %.6f, \"mib_per_s\": %.1f}\n",
+            len, line_len, t, (double)len / (1 << 20) / t);
+    fflush(stdout);
+
+    /* the first run saves the image, and the best run loads it */
+    t = run_bsh("-n", true, path);
+    unlink(path);
+    printf("{\"bench\": \"image\", \"bytes\": %zu, \"line_bytes\": %zu, "
+            "\"seconds\": %.6f, \"mib_per_s\": %.1f}\n",
+            len, line_len, t, (double)len / (1 << 20) / t);
+    fflush(stdout);
+}
+
+
+/* a fresh directory for compiled scripts; cache_rm() removes it */
+static void
+cache_new(char *dir, size_t size)
+{
+    mu_strlcpy(dir, "/tmp/bsh_bench_cache.XXXXXX", size);
+    if (mkdtemp(dir) == NULL)
+        mu_die_errno(errno, "mkdtemp");
+    if (setenv("XDG_CACHE_HOME", dir, 1) == -1)
+        mu_die_errno(errno, "setenv");
+}
+
+
+static void
+cache_rm(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    DIR *d;
+
+    mu_snprintf(path, sizeof(path), "%s/bsh", dir);
+    d = opendir(path);
+    if (d != NULL) {
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            mu_snprintf(path, sizeof(path), "%s/bsh/%s", dir, ent->d_name);
+            unlink(path);
+        }
+        closedir(d);
+        mu_snprintf(path, sizeof(path), "%s/bsh", dir);
+        rmdir(path);
+    }
+    rmdir(dir);
+}
+
+
+static void
+bench_pipe(void)
+{
+    static const unsigned int stages[] = { 1, 4 };
+    static const char *sizes[] = { "default", "1M", "auto" };
+    unsigned long long bytes = (1ULL << 30) / scale;
+    char path[64];
+    unsigned int s, z, i;
+    double t;
+    FILE *fp;
+
+    for (z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        for (s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+            fp = script_new(path, sizeof(path));
+            fprintf(fp, "set -o pipesize=%s\n", sizes[z]);
+            fprintf(fp, "head -c %llu /dev/zero", bytes);
+            for (i = 0; i < stages[s]; i++)
+                fprintf(fp, " | cat");
+            fprintf(fp, " | wc -c\n");
+            script_close(fp);
+
+            t = run_bsh(NULL, false, path);
+            unlink(path);
+
+            printf("{\"bench\": \"pipe\", \"pipesize\": \"%s\", "
+                    "\"cat_stages\": %u, \"bytes\": %llu, \"seconds\": %.6f, "
+                    "\"mib_per_s\": %.1f}\n",
+                    sizes[z], stages[s], bytes, t, (double)bytes / (1 << 20) / t);
+            fflush(stdout);
+        }
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    char cache_dir[64];
+    int opt;
+
+    const char *short_opts = ":hb:n:q";
+    struct option long_opts[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"bsh", required_argument, NULL, 'b'},
+            {"iterations", required_argument, NULL, 'n'},
+            {"quick", no_argument, NULL, 'q'},
+            {NULL, 0, NULL, 0}
+    };
+    while (1) {
+        opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'h':
+            usage(0);
+            break;
+        case 'b':
+            bsh_path = optarg;
+            break;
+        case 'n':
+            if (mu_str_to_uint(optarg, 10, &iterations) < 0 || iterations == 0)
+                mu_die("invalid iteration count \"%s\"", optarg);
+            break;
+        case 'q':
+            scale = 10;
+            break;
+        case '?':
+            mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
+        case ':':
+            mu_die("missing option argument for option %c", optopt);
+        default:
+            mu_die("unexpected getopt_long return value: %c\n", (char)opt);
+        }
+    }
+
+    cache_new(cache_dir, sizeof(cache_dir));
+
+    bench_latency();
+    bench_throughput();
+    bench_parse();
+    bench_pipe();
+
+    cache_rm(cache_dir);
+    return 0;
+}
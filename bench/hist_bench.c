@@ -0,0 +1,221 @@
+/*
+ * History search benchmark.
+ *
+ * Writes a history file of generated command lines, then times opening it
+ * (mapping and indexing every entry), prefix searches as Up does them,
+ * substring searches as Ctrl-R does them, searches that find nothing and so
+ * go through every entry, and appends.  Prints one JSON object per test.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "mu.h"
+
+#define USAGE \
+    "Usage: hist_bench [-h] [-e ENTRIES] [-q QUERIES] [-d DIR]\n" \
+    "\n" \
+    "optional arguments\n" \
+    "   -h, --help\n" \
+    "       Show usage statement and exit.\n" \
+    "\n" \
+    "   -e, --entries ENTRIES\n" \
+    "       Number of entries in the history file (default: 1000000).\n" \
+    "\n" \
+    "   -q, --queries QUERIES\n" \
+    "       Number of searches of each kind (default: 1000).\n" \
+    "\n" \
+    "   -d, --dir DIR\n" \
+    "       Where to put the file (default: /tmp)."
+
+static const char *words[] = {
+    "git", "commit", "-m", "status", "log", "make", "-j8", "ls", "-l",
+    "grep", "-r", "TODO", "src", "cd", "..", "vim", "bsh.c", "cat",
+    "README", "ssh", "host", "tar", "xzf", "build", "sort", "uniq", "-c",
+    "head", "-n", "10", "echo", "$HOME", "find", ".", "-name", "*.h",
+};
+
+
+static void
+usage(int status)
+{
+    puts(USAGE);
+    exit(status);
+}
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static uint32_t
+xorshift(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+
+/* a file of `entries` lines, each a few words and a number */
+static void
+gen_file(int fd, size_t entries)
+{
+    FILE *f = fdopen(dup(fd), "w");
+    uint32_t x = 2463534242u;   /* fixed for repeatability */
+    size_t i, n, w;
+
+    if (f == NULL)
+        mu_die_errno(errno, "fdopen");
+    for (i = 0; i < entries; i++) {
+        n = 2 + xorshift(&x) % 5;
+        for (w = 0; w < n; w++) {
+            fputs(words[xorshift(&x) % (sizeof(words) / sizeof(words[0]))], f);
+            fputc(' ', f);
+        }
+        fprintf(f, "%u\n", xorshift(&x) % 100000);
+    }
+    if (fclose(f) == EOF)
+        mu_die_errno(errno, "write");
+}
+
+
+static void
+report(const char *test, size_t entries, unsigned int n, double seconds)
+{
+    printf("{\"bench\": \"hist\", \"test\": \"%s\", \"entries\": %zu, "
+            "\"count\": %u, \"seconds\": %.6f, \"us_each\": %.2f}\n",
+            test, entries, n, seconds, seconds / n * 1e6);
+}
+
+
+/*
+ * Search for `queries` pieces of random entries (their first bytes, or
+ * bytes from the middle), from the newest entry back.
+ */
+static void
+bench_search(struct hist *h, unsigned int queries, int flags, const char *test)
+{
+    uint32_t x = 88172645u;
+    const char *e;
+    size_t len, at, n;
+    unsigned int q, found = 0;
+    double t0, total = 0;
+
+    for (q = 0; q < queries; q++) {
+        e = hist_get(h, xorshift(&x) % h->num, &len);
+        n = 4 + xorshift(&x) % 8;
+        n = n < len ? n : len;
+        at = (flags & HIST_PREFIX) ? 0 : xorshift(&x) % (len - n + 1);
+
+        t0 = now();
+        found += hist_search(h, e + at, n, h->num, flags) != -1;
+        total += now() - t0;
+    }
+    if (found != queries)
+        mu_die("%s: %u of %u queries not found", test, queries - found,
+                queries);
+
+    report(test, h->num, queries, total);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const char *misses[] = { "zzqx", "git lg", "make -j9" };
+    const char *dir = "/tmp";
+    char path[4096], line[64];
+    unsigned int entries = 1000000, queries = 1000, q;
+    struct hist h;
+    double t0;
+    int fd, err, opt;
+
+    const char *short_opts = ":he:q:d:";
+    struct option long_opts[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"entries", required_argument, NULL, 'e'},
+            {"queries", required_argument, NULL, 'q'},
+            {"dir", required_argument, NULL, 'd'},
+            {NULL, 0, NULL, 0}
+    };
+    while (1) {
+        opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'h':
+            usage(0);
+            break;
+        case 'e':
+            if (mu_str_to_uint(optarg, 10, &entries) < 0 || entries == 0)
+                mu_die("invalid number of entries \"%s\"", optarg);
+            break;
+        case 'q':
+            if (mu_str_to_uint(optarg, 10, &queries) < 0 || queries == 0)
+                mu_die("invalid number of queries \"%s\"", optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case '?':
+            mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
+        case ':':
+            mu_die("missing option argument for option %c", optopt);
+        default:
+            mu_die("unexpected getopt_long return value: %c\n", (char)opt);
+        }
+    }
+
+    mu_snprintf(path, sizeof(path), "%s/hist_bench.XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd == -1)
+        mu_die_errno(errno, "mkstemp");
+    gen_file(fd, entries);
+    close(fd);
+
+    t0 = now();
+    err = hist_open(&h, path);
+    if (err < 0)
+        mu_die_errno(-err, "can't open %s", path);
+    report("open", h.num, 1, now() - t0);
+
+    bench_search(&h, queries, HIST_PREFIX, "prefix");
+    bench_search(&h, queries, 0, "substring");
+
+    t0 = now();
+    for (q = 0; q < queries; q++) {
+        if (hist_search(&h, misses[q % 3], strlen(misses[q % 3]), h.num,
+                    q % 2 == 0 ? HIST_PREFIX : 0) != -1)
+            mu_die("\"%s\" found", misses[q % 3]);
+    }
+    report("miss", h.num, queries, now() - t0);
+
+    t0 = now();
+    for (q = 0; q < queries; q++) {
+        mu_snprintf(line, sizeof(line), "echo appended %u", q);
+        err = hist_add(&h, line, strlen(line));
+        if (err < 0)
+            mu_die_errno(-err, "hist_add");
+    }
+    report("append", h.num, queries, now() - t0);
+
+    hist_close(&h);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Tokenizer throughput benchmark.
+ *
+ * Generates a multi-megabyte command line (plain words with the occasional
+ * quoted word, escape, pipe and redirect), then times lex_next() over it with
+ * each scanner the CPU supports.  Prints one JSON object per scanner.
+ */
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lex.h"
+#include "mu.h"
+
+#define USAGE \
+    "Usage: lex_bench [-h] [-s MIB] [-n ITERATIONS]\n" \
+    "\n" \
+    "optional arguments\n" \
+    "   -h, --help\n" \
+    "       Show usage statement and exit.\n" \
+    "\n" \
+    "   -s, --size MIB\n" \
+    "       Size of the generated command line (default: 8).\n" \
+    "\n" \
+    "   -n, --iterations ITERATIONS\n" \
+    "       Number of timed passes per scanner; the best is reported\n" \
+    "       (default: 5)."
+
+
+static void
+usage(int status)
+{
+    puts(USAGE);
+    exit(status);
+}
+
+
+static char *
+gen_line(size_t size)
+{
+    char *line = mu_mallocarray(size + 1, 1);
+    uint32_t x = 2463534242u;   /* xorshift32 seed; fixed for repeatability */
+    size_t i = 0, n;
+
+    while (i + 16 < size) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        switch (x % 32) {
+        case 0:
+            i += (size_t)sprintf(line + i, "| ");
+            break;
+        case 1:
+            i += (size_t)sprintf(line + i, ">out ");
+            break;
+        case 2:
+            i += (size_t)sprintf(line + i, "'a b' ");
+            break;
+        case 3:
+            i += (size_t)sprintf(line + i, "\"x\\\"y\" ");
+            break;
+        case 4:
+            i += (size_t)sprintf(line + i, "a\\ b ");
+            break;
+        default:
+            n = 2 + (x >> 8) % 12;
+            memset(line + i, 'a' + (char)(x % 26), n);
+            i += n;
+            line[i++] = ' ';
+            break;
+        }
+    }
+    line[i] = '\0';
+
+    return line;
+}
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const enum lex_scanner scanners[] = {
+        LEX_SCAN_SCALAR, LEX_SCAN_SSE2, LEX_SCAN_AVX2,
+    };
+    struct lexer lx;
+    struct lex_token tok;
+    char *line, *work;
+    size_t len, ntokens, s;
+    unsigned int size_mib = 8, iterations = 5, it;
+    double t0, best;
+    int opt;
+
+    const char *short_opts = ":hs:n:";
+    struct option long_opts[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"size", required_argument, NULL, 's'},
+            {"iterations", required_argument, NULL, 'n'},
+            {NULL, 0, NULL, 0}
+    };
+    while (1) {
+        opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'h':
+            usage(0);
+            break;
+        case 's':
+            if (mu_str_to_uint(optarg, 10, &size_mib) < 0 || size_mib == 0)
+                mu_die("invalid size \"%s\"", optarg);
+            break;
+        case 'n':
+            if (mu_str_to_uint(optarg, 10, &iterations) < 0 || iterations == 0)
+                mu_die("invalid iteration count \"%s\"", optarg);
+            break;
+        case '?':
+            mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
+        case ':':
+            mu_die("missing option argument for option %c", optopt);
+        default:
+            mu_die("unexpected getopt_long return value: %c\n", (char)opt);
+        }
+    }
+
+    line = gen_line((size_t)size_mib << 20);
+    len = strlen(line);
+    work = mu_mallocarray(len + 1, 1);
+
+    for (s = 0; s < sizeof(scanners) / sizeof(scanners[0]); s++) {
+        if (lex_set_scanner(scanners[s]) < 0)
+            continue;
+
+        best = 0;
+        ntokens = 0;
+        for (it = 0; it < iterations; it++) {
+            /* the lexer rewrites the line, so each pass gets a fresh copy */
+            memcpy(work, line, len + 1);
+            ntokens = 0;
+
+            t0 = now();
+            lex_init(&lx, work);
+            while (lex_next(&lx, &tok) != LEX_END) {
+                if (tok.type == LEX_ERROR)
+                    mu_die("lex error: %s", lx.err);
+                ntokens++;
+            }
+            t0 = now() - t0;
+
+            if (best == 0 || t0 < best)
+                best = t0;
+        }
+
+        printf("{\"bench\": \"lex\", \"scanner\": \"%s\", \"bytes\": %zu, "
+                "\"tokens\": %zu, \"seconds\": %.6f, \"mib_per_s\": %.1f}\n",
+                lex_scanner_name(), len, ntokens, best,
+                (double)len / (1 << 20) / best);
+    }
+
+    free(work);
+    free(line);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Client for `bsh --serve SOCKET`: sends COMMAND, with this process's stdin,
+ * stdout and stderr, and exits with the commands' exit status.  See serve.h
+ * for the protocol.
+ */
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mu.h"
+#include "serve.h"
+
+#define USAGE \
+    "Usage: bsh-client [-h] [-n REPEAT] SOCKET COMMAND\n" \
+    "\n" \
+    "positional arguments\n" \
+    "   SOCKET\n" \
+    "       The socket that `bsh --serve` listens on.\n" \
+    "\n" \
+    "   COMMAND\n" \
+    "       The commands to run; they get this process's stdin, stdout and\n" \
+    "       stderr.\n" \
+    "\n" \
+    "optional arguments\n" \
+    "   -h, --help\n" \
+    "       Show usage statement and exit.\n" \
+    "\n" \
+    "   -n, --repeat REPEAT\n" \
+    "       Send COMMAND REPEAT times over the one connection, one after\n" \
+    "       the other, and print the mean time per request on stderr\n" \
+    "       (default: 1)."
+
+
+static void
+usage(int status)
+{
+    puts(USAGE);
+    exit(status);
+}
+
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static int
+serve_connect(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        mu_die("socket path too long: %s", path);
+    mu_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        mu_die_errno(errno, "socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        mu_die_errno(errno, "can't connect to %s", path);
+
+    return fd;
+}
+
+
+/* send one request and return its exit status */
+static int
+request(int fd, const char *command)
+{
+    static const int fds[SERVE_NUM_FDS] = {
+        STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+    };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SERVE_NUM_FDS * sizeof(int))];
+    } ctl;
+    struct iovec iov = {
+        .iov_base = (void *)command,
+        .iov_len = strlen(command),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    struct serve_reply reply;
+    ssize_t n;
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+        mu_die_errno(errno, "sendmsg");
+
+    do {
+        n = recv(fd, &reply, sizeof(reply), 0);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        mu_die_errno(errno, "recv");
+    if (n != sizeof(reply))
+        mu_die("the server hung up");
+
+    return reply.status;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int repeat = 1, i;
+    int fd, status = 0;
+    double t0;
+    int opt;
+
+    const char *short_opts = ":hn:";
+    struct option long_opts[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"repeat", required_argument, NULL, 'n'},
+            {NULL, 0, NULL, 0}
+    };
+    while (1) {
+        opt = getopt_long(argc, argv, short_opts, long_opts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'h':
+            usage(0);
+            break;
+        case 'n':
+            if (mu_str_to_uint(optarg, 10, &repeat) < 0 || repeat == 0)
+                mu_die("invalid repeat count \"%s\"", optarg);
+            break;
+        case '?':
+            mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
+        case ':':
+            mu_die("missing option argument for option %c", optopt);
+        default:
+            mu_die("unexpected getopt_long return value: %c\n", (char)opt);
+        }
+    }
+
+    if (argc - optind != 2)
+        usage(2);
+    if (strlen(argv[optind + 1]) > SERVE_MAX_TEXT)
+        mu_die("command too long (the limit is %d bytes)", SERVE_MAX_TEXT);
+
+    fd = serve_connect(argv[optind]);
+
+    t0 = now();
+    for (i = 0; i < repeat; i++)
+        status = request(fd, argv[optind + 1]);
+    if (repeat > 1)
+        fprintf(stderr, "%u requests, %.1f us per request\n", repeat,
+                (now() - t0) / repeat * 1e6);
+
+    close(fd);
+    return status;
+}
@@ -1,339 +1,7558 @@
 #define _GNU_SOURCE 
 
-#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
-#include <assert.h>
-#include <errno.h>
-#include <getopt.h>
-#include <fcntl.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
+
+#include "hist.h"
+#include "lex.h"
+#include "list.h"
+#include "mu.h"
+#include "serve.h"
+
+
+#define CMD_INITIAL_CAP_ARGS 8
+
+#define USAGE \
+    "Usage: bsh [-h] [-d] [-n] [-l LAUNCHER] [-o OPTION[=VALUE]] [--colocate]\n" \
+    "           [--hash-fds] [--no-cache] [--trace FILE] [SCRIPT [ARG ...]]\n" \
+    "       bsh [options] -c COMMAND [NAME [ARG ...]]\n" \
+    "       bsh [options] --serve SOCKET\n" \
+    "\n" \
+    "Without a SCRIPT or COMMAND, read commands from stdin.  A script or\n" \
+    "COMMAND string execs its final command in place of the shell.\n" \
+    "On a terminal, lines are edited and kept in the history file,\n" \
+    "$HISTFILE or ~/.bsh_history.\n" \
+    "\n" \
+    "optional arguments\n" \
+    "   -h, --help\n" \
+    "       Show usage statement and exit.\n" \
+    "\n" \
+    "   -c, --command COMMAND\n" \
+    "       Run the commands in the COMMAND string.\n" \
+    "\n" \
+    "   -d, --debug\n" \
+    "       Print each parsed pipeline before running it.\n" \
+    "\n" \
+    "   -n, --noexec\n" \
+    "       Parse the commands but don't run them.\n" \
+    "\n" \
+    "   -l, --launcher LAUNCHER\n" \
+    "       How pipeline stages are started: 'spawn' (posix_spawn, the\n" \
+    "       default) or 'fork'.\n" \
+    "\n" \
+    "   -o, --option OPTION[=VALUE]\n" \
+    "       Set a shell option, as with `set -o`: colocate (see\n" \
+    "       --colocate), launcher=spawn|fork,\n" \
+    "       parsecache=default|SIZE for the memory kept by the cache of\n" \
+    "       parsed command lines (0 turns it off), pipefail (a pipeline\n" \
+    "       fails if any stage does), pipesize=default|auto|SIZE for the\n" \
+    "       pipes between stages (a single pipe can be sized with\n" \
+    "       `|[SIZE]`), or teardown (signal the stages upstream of one\n" \
+    "       that exits, and all of them once one fails).\n" \
+    "\n" \
+    "   --colocate\n" \
+    "       Pin each stage of a pipeline to a CPU of its own, with adjacent\n" \
+    "       stages on sibling cores.  A stage can be placed by hand with\n" \
+    "       @cpu=LIST, @node=N, @nice=N, @ionice=CLASS[:LEVEL] and\n" \
+    "       @sched=other|batch|idle words before its command.\n" \
+    "\n" \
+    "   --hash-fds\n" \
+    "       Keep an O_PATH fd for each command in the hash table, and exec\n" \
+    "       through it (fork launcher only).\n" \
+    "\n" \
+    "   --no-cache\n" \
+    "       Run SCRIPT from its text, without loading or saving the\n" \
+    "       compiled form kept in $XDG_CACHE_HOME/bsh (or ~/.cache/bsh).\n" \
+    "\n" \
+    "   --serve SOCKET\n" \
+    "       Listen on the UNIX socket SOCKET and run the commands sent to\n" \
+    "       it (see serve.h, and bsh-client), each in its own process.\n" \
+    "\n" \
+    "   --trace FILE\n" \
+    "       Write a Chrome trace-event timeline (parse, pipe creation,\n" \
+    "       spawn/fork, exec, and each stage's lifetime) to FILE, for\n" \
+    "       loading in Perfetto or chrome://tracing."
+
+enum launcher {
+    LAUNCHER_SPAWN,
+    LAUNCHER_FORK,
+};
+
+static enum launcher launcher = LAUNCHER_SPAWN;
+
+/* the pipesize option, and a `|[SIZE]` override of it */
+#define PIPE_SIZE_UNSET 0       /* `|`: follow the option */
+#define PIPE_SIZE_DEFAULT (-1)  /* the kernel's default */
+#define PIPE_SIZE_AUTO (-2)     /* grow while the writer is blocked */
+
+static long pipe_size = PIPE_SIZE_DEFAULT;
+
+/* the parsecache option: how much memory parsed lines may keep */
+#define PARSE_CACHE_SIZE_DEFAULT (1L << 20)
+
+static long parse_cache_max = PARSE_CACHE_SIZE_DEFAULT;
+
+/* print each parsed pipeline before running it */
+static bool debug;
+
+/* parse only (-n) */
+static bool noexec;
+
+/* exit status of the last pipeline, for $? and the shell's own exit */
+static int last_status;
+
+/* positional parameters: $0 is the script (or shell) name */
+static struct {
+    int argc;
+    char **argv;
+} params;
+
+/*
+ * --trace FILE: a Chrome trace-event (JSON array) timeline that Perfetto and
+ * chrome://tracing can load.  Each event goes out in a single write() to an
+ * O_APPEND fd, so the events forked children write (exec) don't interleave
+ * with the shell's.  Timestamps are CLOCK_MONOTONIC, in microseconds.
+ *
+ * Every event after the first is written as ",\n{...}", so the file is valid
+ * at any point once the closing ']' is added; the format allows leaving it
+ * off, which is what happens when the shell execs its last command.
+ *
+ * All events carry the shell's pid; the shell's own work is on its own tid
+ * and each stage gets a track (tid) of its own.  Only the fork launcher
+ * sees the child side, so only it logs an "exec" event; posix_spawn()
+ * returns once the exec has happened, which closes the "spawn" span.
+ */
+#define TRACE_EVENT_SIZE 1024
+#define TRACE_STR_MAX 200
+
+/*
+ * An event is its fixed fields (well under TRACE_EVENT_SIZE - TRACE_NAME_SIZE
+ * - TRACE_ARGS_SIZE bytes), an escaped name and its args, so with the name
+ * and args kept to these sizes every event fits; a long name or args string
+ * is cut short rather than the event lost.
+ */
+#define TRACE_NAME_SIZE 128
+#define TRACE_ARGS_SIZE 704
+
+static int trace_fd = -1;
+static pid_t trace_pid;
+
+
+/*
+ * Copy at most TRACE_STR_MAX bytes of `s` into `dst`, escaped for JSON, and
+ * as many as fit in `size` bytes; an escape is never cut in two.
+ */
+static void
+trace_json_str(char *dst, size_t size, const char *s)
+{
+    size_t n = 0;
+    size_t i;
+
+    assert(size > 8);
+
+    for (i = 0; s[i] != '\0' && i < TRACE_STR_MAX && n + 7 < size; i++) {
+        unsigned char c = (unsigned char)s[i];
+
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = (char)c;
+        } else if (c < 0x20) {
+            n += (size_t)mu_snprintf(dst + n, size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = (char)c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+
+static void
+trace_write(const char *fmt, ...)
+{
+    char buf[TRACE_EVENT_SIZE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    /* can't happen with the name and args sizes above */
+    if (n < 0 || (size_t)n >= sizeof(buf))
+        return;
+
+    (void)mu_write_n(trace_fd, buf, (size_t)n, NULL);
+}
+
+
+/*
+ * A complete ("X") event from `start_ns` to `end_ns`.  `args` is either NULL
+ * or the inside of a JSON object.
+ */
+static void
+trace_span(const char *name, pid_t tid, uint64_t start_ns, uint64_t end_ns,
+        const char *args)
+{
+    char ename[TRACE_NAME_SIZE];
+
+    if (trace_fd == -1)
+        return;
+
+    trace_json_str(ename, sizeof(ename), name);
+    trace_write(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%" MU_PRI_pid
+            ",\"tid\":%" MU_PRI_pid ",\"ts\":%" PRIu64 ".%03" PRIu64
+            ",\"dur\":%" PRIu64 ".%03" PRIu64 ",\"args\":{%s}}",
+            ename, trace_pid, tid, start_ns / 1000, start_ns % 1000,
+            (end_ns - start_ns) / 1000, (end_ns - start_ns) % 1000,
+            args != NULL ? args : "");
+}
+
+
+/* a thread-scoped instant ("i") event at `ts_ns` */
+static void
+trace_instant(const char *name, pid_t tid, uint64_t ts_ns, const char *args)
+{
+    char ename[TRACE_NAME_SIZE];
+
+    if (trace_fd == -1)
+        return;
+
+    trace_json_str(ename, sizeof(ename), name);
+    trace_write(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%"
+            MU_PRI_pid ",\"tid\":%" MU_PRI_pid ",\"ts\":%" PRIu64 ".%03" PRIu64
+            ",\"args\":{%s}}",
+            ename, trace_pid, tid, ts_ns / 1000, ts_ns % 1000,
+            args != NULL ? args : "");
+}
+
+
+/* name a track in the viewer */
+static void
+trace_thread_name(pid_t tid, const char *name)
+{
+    char ename[TRACE_NAME_SIZE];
+
+    if (trace_fd == -1)
+        return;
+
+    trace_json_str(ename, sizeof(ename), name);
+    trace_write(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%" MU_PRI_pid
+            ",\"tid\":%" MU_PRI_pid ",\"args\":{\"name\":\"%s\"}}",
+            trace_pid, tid, ename);
+}
+
+
+static void
+trace_open(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            0664);
+    if (trace_fd == -1)
+        mu_die_errno(errno, "can't open %s", path);
+    trace_pid = getpid();
+
+    trace_write("[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" MU_PRI_pid
+            ",\"tid\":%" MU_PRI_pid ",\"args\":{\"name\":\"bsh\"}}",
+            trace_pid, trace_pid);
+    trace_thread_name(trace_pid, "shell");
+}
+
+
+static void
+trace_close(void)
+{
+    if (trace_fd == -1)
+        return;
+
+    trace_write("\n]\n");
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+
+/*
+ * Pipe sizes.  The pipes between stages start at the kernel's default size
+ * (64 KiB) unless the pipesize option or a `|[SIZE]` says otherwise; sizes
+ * are capped at /proc/sys/fs/pipe-max-size.
+ */
+static long
+pipe_max_size(void)
+{
+    static long max_size;
+    FILE *fp;
+
+    if (max_size != 0)
+        return max_size;
+
+    max_size = 1024 * 1024;
+    fp = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (fp != NULL) {
+        if (fscanf(fp, "%ld", &max_size) != 1 || max_size <= 0)
+            max_size = 1024 * 1024;
+        fclose(fp);
+    }
+
+    return max_size;
+}
+
+
+/* "default", "auto", or a byte count with an optional K, M or G suffix */
+static int
+pipe_size_parse(const char *s, long *size)
+{
+    unsigned int shift = 0;
+    char *end;
+    long n;
+
+    if (strcmp(s, "default") == 0) {
+        *size = PIPE_SIZE_DEFAULT;
+        return 0;
+    }
+    if (strcmp(s, "auto") == 0) {
+        *size = PIPE_SIZE_AUTO;
+        return 0;
+    }
+
+    errno = 0;
+    n = strtol(s, &end, 10);
+    if (errno != 0 || end == s || n <= 0)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || n > LONG_MAX >> shift)
+        return -1;
+    n <<= shift;
+
+    *size = n;
+    return 0;
+}
+
+
+static void
+pipe_size_format(long size, char *buf, size_t buf_size)
+{
+    if (size == PIPE_SIZE_AUTO)
+        mu_strlcpy(buf, "auto", buf_size);
+    else if (size <= 0)
+        mu_strlcpy(buf, "default", buf_size);
+    else
+        mu_snprintf(buf, buf_size, "%ld", size);
+}
+
+
+/*
+ * `timeout DURATION` and `@timeout=DURATION`: SIGTERM once the deadline has
+ * passed, then SIGKILL if it is still running TIMEOUT_KILL_AFTER later.  As
+ * with timeout(1), what timed out exits with TIMEOUT_STATUS, or 128+9 if it
+ * had to be killed.
+ */
+#define TIMEOUT_KILL_AFTER_DEFAULT (5 * 1000000000ULL)
+#define TIMEOUT_STATUS 124
+
+
+/* seconds, with an optional s, m, h or d suffix, as timeout(1) takes them */
+static int
+duration_parse(const char *s, uint64_t *ns)
+{
+    double secs;
+    char *end;
+
+    errno = 0;
+    secs = strtod(s, &end);
+    if (errno != 0 || end == s || !(secs >= 0))
+        return -1;
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': secs *= 60; end++; break;
+    case 'h': secs *= 60 * 60; end++; break;
+    case 'd': secs *= 24 * 60 * 60; end++; break;
+    }
+    /* a century will do */
+    if (*end != '\0' || secs > 100 * 365 * 24 * 60 * 60.0)
+        return -1;
+
+    *ns = (uint64_t)(secs * 1e9);
+    return 0;
+}
+
+
+/* resize a pipe, capped at the maximum; return the new size, or -1 */
+static int
+pipe_resize(int fd, long size)
+{
+    int ret;
+
+    if (size > pipe_max_size())
+        size = pipe_max_size();
+
+    ret = fcntl(fd, F_SETPIPE_SZ, (int)size);
+    if (ret == -1)
+        mu_stderr_errno(errno, "can't resize pipe to %ld bytes", size);
+
+    return ret;
+}
+
+
+/*
+ * A parsed pipeline, and everything hanging off it, lives in a single arena
+ * that the REPL resets after each line.
+ */
+struct procsub;
+struct stage_place;
+
+struct cmd {
+    struct list_head list;
+    struct mu_arena *arena;
+
+    char **args;
+    size_t num_args;
+    size_t cap_args;
+
+    char *in_file;
+    struct lex_heredoc *in_doc; /* `<<` or `<<<`: stdin reads this text */
+    char *out_file;
+    bool append;
+    long pipe_size;         /* of the pipe to the next stage: `|[SIZE]` */
+    struct procsub *procsubs;
+    struct stage_place *place;  /* `@KEY=VALUE` words, or NULL */
+
+    /* from the parse cache: where args[0] was found, if still valid */
+    struct path_entry *path;
+    unsigned long path_gen;
+
+    pid_t pid;
+};
+
+struct job;
+struct limit_spec;
+
+struct pipeline {
+    struct list_head head;  /* cmds */
+    size_t num_cmds;
+    bool background;        /* ends with & */
+    bool timed;             /* prefixed with `time` */
+    struct limit_spec *limit;   /* prefixed with `limit`, or NULL */
+    uint64_t timeout_ns;        /* prefixed with `timeout`, or 0 */
+    uint64_t kill_after_ns;     /* ... and SIGKILL this long after SIGTERM */
+    int out_fd;             /* stdout of the last stage, or -1 to inherit */
+
+    struct mu_arena *arena;
+    struct cmd *parse_cmd;  /* the stage being parsed */
+
+    /*
+     * The stages of a long pipeline can be started while the rest of it is
+     * still being read.
+     */
+    struct job *job;        /* NULL until the first stage starts */
+    size_t num_launched;
+    int launch_rfd;         /* read end of the pipe to the next stage, or -1 */
+    bool launch_watch;      /* ... which gets an auto size */
+};
+
+/*
+ * A process substitution, `<(...)` or `>(...)`.  Its pipeline runs as part of
+ * the job of the cmd whose arg it is, connected to the cmd by a pipe, and the
+ * arg becomes the /dev/fd path of the cmd's end.
+ */
+struct procsub {
+    struct procsub *next;
+    struct pipeline *pipeline;
+    bool out;               /* >(...): the cmd writes to it */
+    size_t arg_idx;
+    int fd;                 /* the cmd's end of the pipe, once started */
+};
+
+
+static struct cmd *
+cmd_new(struct mu_arena *arena)
+{
+    MU_ARENA_NEW(arena, cmd, cmd);
+
+    cmd->arena = arena;
+    cmd->cap_args = CMD_INITIAL_CAP_ARGS;
+    cmd->args = mu_arena_mallocarray(arena, cmd->cap_args, sizeof(char *));
+    cmd->args[0] = NULL;
+
+    return cmd;
+}
+
+
+/* args are not copied: `arg` must live as long as the cmd */
+static void
+cmd_push_arg(struct cmd *cmd, char *arg)
+{
+    /* keep room for the terminating NULL that exec expects */
+    if (cmd->num_args + 1 == cmd->cap_args) {
+        cmd->args = mu_arena_reallocarray(cmd->arena, cmd->args,
+                cmd->cap_args, cmd->cap_args * 2, sizeof(char *));
+        cmd->cap_args *= 2;
+    }
+
+    cmd->args[cmd->num_args] = arg;
+    cmd->num_args += 1;
+    cmd->args[cmd->num_args] = NULL;
+}
+
+
+/*
+ * Stage placement.  `@KEY=VALUE` words before a stage's command say where
+ * and how it runs:
+ *
+ *   @cpu=LIST              the CPUs it may run on, like "0-3,8"
+ *   @node=N                NUMA node N: its memory, and its CPUs
+ *   @nice=N                its nice value, -20 to 19
+ *   @ionice=CLASS[:LEVEL]  its I/O class (rt, be or idle) and level (0-7)
+ *   @sched=POLICY          its scheduling policy: other, batch or idle
+ *   @timeout=DURATION      it gets SIGTERM once it has run that long
+ *
+ * They are checked (and a node's CPUs looked up) when the stage is parsed,
+ * and applied by the stage itself before it execs, so a placed stage is
+ * always forked.  An explicit @cpu wins over the CPUs of @node.
+ */
+#define PLACE_UNSET INT_MIN
+
+struct stage_place {
+    bool has_cpus;
+    bool cpus_given;        /* by @cpu, rather than by @node */
+    cpu_set_t cpus;
+    int node;               /* memory is bound to it, or -1 */
+    int nice;               /* or PLACE_UNSET */
+    int ioprio;             /* ditto */
+    int policy;             /* ditto */
+    uint64_t timeout_ns;    /* or 0 */
+};
+
+
+static void
+stage_place_init(struct stage_place *place)
+{
+    mu_memzero_p(place);
+    place->node = -1;
+    place->nice = place->ioprio = place->policy = PLACE_UNSET;
+}
+
+
+/* a CPU list like "0-3,8"; return -1 if it is malformed or out of range */
+static int
+cpu_list_parse(const char *s, cpu_set_t *set)
+{
+    unsigned long lo, hi;
+    char *end;
+
+    CPU_ZERO(set);
+    for (;;) {
+        if (!isdigit((unsigned char)*s))
+            return -1;
+        lo = hi = strtoul(s, &end, 10);
+        if (*end == '-') {
+            s = end + 1;
+            if (!isdigit((unsigned char)*s))
+                return -1;
+            hi = strtoul(s, &end, 10);
+        }
+        if (lo > hi || hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        if (*end != ',')
+            break;
+        s = end + 1;
+    }
+
+    return *end == '\0' ? 0 : -1;
+}
+
+
+static void
+cpu_list_print(const cpu_set_t *set)
+{
+    const char *sep = "";
+    int lo, hi;
+
+    for (lo = 0; lo < CPU_SETSIZE; lo = hi + 1) {
+        if (!CPU_ISSET(lo, set)) {
+            hi = lo;
+            continue;
+        }
+        for (hi = lo; hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set); hi++)
+            ;
+        if (hi == lo)
+            printf("%s%d", sep, lo);
+        else
+            printf("%s%d-%d", sep, lo, hi);
+        sep = ",";
+    }
+}
+
+
+/* look up the CPUs of NUMA node `node`; return -1 if there is no such node */
+static int
+numa_node_cpus(int node, cpu_set_t *set, bool *has_cpus)
+{
+    char path[64], buf[4096];
+    size_t n;
+    FILE *fp;
+
+    mu_snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+            node);
+    fp = fopen(path, "re");
+    if (fp == NULL)
+        return -1;
+    n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+
+    /* a node with memory but no CPUs leaves the stage's CPUs alone */
+    *has_cpus = (buf[0] != '\0');
+    if (*has_cpus && cpu_list_parse(buf, set) == -1)
+        return -1;
+
+    return 0;
+}
+
+
+static const char *const ionice_classes[] = {
+    [IOPRIO_CLASS_RT] = "rt",
+    [IOPRIO_CLASS_BE] = "be",
+    [IOPRIO_CLASS_IDLE] = "idle",
+};
+
+
+static int
+ionice_parse(const char *s, int *ioprio)
+{
+    const char *colon = strchr(s, ':');
+    size_t len = colon != NULL ? (size_t)(colon - s) : strlen(s);
+    int class, level = 4;
+
+    for (class = IOPRIO_CLASS_RT; class <= IOPRIO_CLASS_IDLE; class++) {
+        if (strlen(ionice_classes[class]) == len &&
+                strncmp(s, ionice_classes[class], len) == 0)
+            break;
+    }
+    if (class > IOPRIO_CLASS_IDLE)
+        return -1;
+
+    if (colon != NULL) {
+        if (class == IOPRIO_CLASS_IDLE ||
+                mu_str_to_int(colon + 1, 10, &level) < 0 ||
+                level < 0 || level >= IOPRIO_NR_LEVELS)
+            return -1;
+    } else if (class == IOPRIO_CLASS_IDLE) {
+        level = 0;
+    }
+
+    *ioprio = IOPRIO_PRIO_VALUE(class, level);
+    return 0;
+}
+
+
+/* add the `@KEY=VALUE` word `word` to the placement of `cmd` */
+static int
+stage_place_parse(struct cmd *cmd, const char *word)
+{
+    const char *key = word + 1;
+    const char *value = strchr(word, '=') + 1;
+    size_t key_len = (size_t)(value - 1 - key);
+    struct stage_place *place = cmd->place;
+    cpu_set_t node_cpus;
+    bool has_cpus;
+
+    if (place == NULL) {
+        place = cmd->place = mu_arena_alloc(cmd->arena, sizeof(*place));
+        stage_place_init(place);
+    }
+
+#define KEY_IS(name) \
+    (key_len == sizeof(name) - 1 && strncmp(key, name, key_len) == 0)
+    if (KEY_IS("cpu")) {
+        if (cpu_list_parse(value, &place->cpus) == -1 ||
+                CPU_COUNT(&place->cpus) == 0)
+            goto invalid;
+        place->has_cpus = place->cpus_given = true;
+    } else if (KEY_IS("node")) {
+        if (mu_str_to_int(value, 10, &place->node) < 0 ||
+                place->node < 0 || place->node >= CPU_SETSIZE)
+            goto invalid;
+        if (numa_node_cpus(place->node, &node_cpus, &has_cpus) == -1) {
+            mu_stderr("syntax error: no NUMA node %d", place->node);
+            return -1;
+        }
+        /* an @cpu that came first wins, too */
+        if (has_cpus && !place->cpus_given) {
+            place->cpus = node_cpus;
+            place->has_cpus = true;
+        }
+    } else if (KEY_IS("nice")) {
+        if (mu_str_to_int(value, 10, &place->nice) < 0 ||
+                place->nice < -20 || place->nice > 19)
+            goto invalid;
+    } else if (KEY_IS("ionice")) {
+        if (ionice_parse(value, &place->ioprio) == -1)
+            goto invalid;
+    } else if (KEY_IS("timeout")) {
+        if (duration_parse(value, &place->timeout_ns) == -1)
+            goto invalid;
+    } else if (KEY_IS("sched")) {
+        if (strcmp(value, "other") == 0)
+            place->policy = SCHED_OTHER;
+        else if (strcmp(value, "batch") == 0)
+            place->policy = SCHED_BATCH;
+        else if (strcmp(value, "idle") == 0)
+            place->policy = SCHED_IDLE;
+        else
+            goto invalid;
+    } else {
+        mu_stderr("syntax error: unknown stage attribute \"@%.*s\"",
+                (int)key_len, key);
+        return -1;
+    }
+#undef KEY_IS
+
+    return 0;
+
+invalid:
+    mu_stderr("syntax error: invalid \"%s\"", word);
+    return -1;
+}
+
+
+static void
+stage_place_print(const struct stage_place *place)
+{
+    if (place->has_cpus) {
+        printf("\t@cpu=");
+        cpu_list_print(&place->cpus);
+        printf("\n");
+    }
+    if (place->node != -1)
+        printf("\t@node=%d\n", place->node);
+    if (place->nice != PLACE_UNSET)
+        printf("\t@nice=%d\n", place->nice);
+    if (place->ioprio != PLACE_UNSET)
+        printf("\t@ionice=%s:%d\n",
+                ionice_classes[IOPRIO_PRIO_CLASS(place->ioprio)],
+                (int)IOPRIO_PRIO_DATA(place->ioprio));
+    if (place->policy != PLACE_UNSET)
+        printf("\t@sched=%s\n", place->policy == SCHED_BATCH ? "batch" :
+                place->policy == SCHED_IDLE ? "idle" : "other");
+    if (place->timeout_ns > 0)
+        printf("\t@timeout=%.3fs\n", (double)place->timeout_ns / 1e9);
+}
+
+
+/* whether `place` has anything for stage_place_apply() to do */
+static bool
+stage_place_applies(const struct stage_place *place)
+{
+    return place->has_cpus || place->node != -1 ||
+            place->nice != PLACE_UNSET || place->ioprio != PLACE_UNSET ||
+            place->policy != PLACE_UNSET;
+}
+
+
+/*
+ * Apply `place` to the calling process, a stage about to exec, so that
+ * whatever threads or children the program starts are placed along with it.
+ * Failures are reported, but the stage runs regardless.
+ */
+static void
+stage_place_apply(const struct stage_place *place)
+{
+    unsigned long nodes[CPU_SETSIZE / (CHAR_BIT * sizeof(unsigned long))];
+    const size_t node_bits = CHAR_BIT * sizeof(nodes[0]);
+    struct sched_param param = { .sched_priority = 0 };
+
+    if (place->has_cpus &&
+            sched_setaffinity(0, sizeof(place->cpus), &place->cpus) == -1)
+        mu_stderr_errno(errno, "can't set CPU affinity");
+
+    if (place->node != -1) {
+        memset(nodes, 0, sizeof(nodes));
+        nodes[place->node / node_bits] |= 1UL << (place->node % node_bits);
+        /* the kernel counts one bit short of maxnode */
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, nodes,
+                    sizeof(nodes) * CHAR_BIT + 1) == -1)
+            mu_stderr_errno(errno, "can't bind memory to NUMA node %d",
+                    place->node);
+    }
+
+    if (place->policy != PLACE_UNSET &&
+            sched_setscheduler(0, place->policy, &param) == -1)
+        mu_stderr_errno(errno, "can't set scheduling policy");
+
+    if (place->nice != PLACE_UNSET &&
+            setpriority(PRIO_PROCESS, 0, place->nice) == -1)
+        mu_stderr_errno(errno, "can't set nice value %d", place->nice);
+
+    if (place->ioprio != PLACE_UNSET &&
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                place->ioprio) == -1)
+        mu_stderr_errno(errno, "can't set I/O priority");
+}
+
+
+/*
+ * The colocate option.  The stages of a pipeline that have no CPUs of their
+ * own are each pinned to one CPU, dealt out in turn from the CPUs the shell
+ * may run on, ordered by package and core.  Adjacent stages so land on SMT
+ * siblings, or neighbouring cores of one package, and the data in the pipe
+ * between them stays in a cache they share.  A command on its own is never
+ * pinned: it may well have threads of its own.
+ */
+static bool colocate;
+
+struct colocate_cpu {
+    int cpu;
+    int package;
+    int core;
+};
+
+static struct {
+    bool loaded;
+    int *cpus;
+    size_t num_cpus;
+    size_t next;
+} colocate_order;
+
+
+static int
+sysfs_cpu_topology(int cpu, const char *name)
+{
+    char path[96];
+    FILE *fp;
+    int val = -1;
+
+    mu_snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    fp = fopen(path, "re");
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &val) != 1)
+            val = -1;
+        fclose(fp);
+    }
+
+    return val;
+}
+
+
+static int
+colocate_cpu_cmp(const void *a, const void *b)
+{
+    const struct colocate_cpu *x = a, *y = b;
+
+    if (x->package != y->package)
+        return x->package < y->package ? -1 : 1;
+    if (x->core != y->core)
+        return x->core < y->core ? -1 : 1;
+    return x->cpu < y->cpu ? -1 : (x->cpu > y->cpu);
+}
+
+
+static void
+colocate_load(void)
+{
+    struct colocate_cpu *cpus;
+    cpu_set_t allowed;
+    size_t n = 0, i;
+    int cpu;
+
+    colocate_order.loaded = true;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        mu_stderr_errno(errno, "sched_getaffinity");
+        return;
+    }
+
+    cpus = mu_mallocarray(CPU_COUNT(&allowed), sizeof(*cpus));
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        cpus[n].cpu = cpu;
+        cpus[n].package = sysfs_cpu_topology(cpu, "physical_package_id");
+        cpus[n].core = sysfs_cpu_topology(cpu, "core_id");
+        n++;
+    }
+    qsort(cpus, n, sizeof(*cpus), colocate_cpu_cmp);
+
+    colocate_order.cpus = mu_mallocarray(n, sizeof(int));
+    for (i = 0; i < n; i++)
+        colocate_order.cpus[i] = cpus[i].cpu;
+    colocate_order.num_cpus = n;
+    free(cpus);
+}
+
+
+/*
+ * Where a stage of `pipeline` runs: its own placement, if any, and under the
+ * colocate option the next CPU in turn.  `buf` may hold the result.
+ */
+static const struct stage_place *
+stage_place_get(const struct pipeline *pipeline, const struct cmd *cmd,
+        bool complete, struct stage_place *buf)
+{
+    int cpu;
+
+    if (!colocate || (cmd->place != NULL && cmd->place->has_cpus) ||
+            (complete && pipeline->num_cmds == 1))
+        return cmd->place;
+
+    if (!colocate_order.loaded)
+        colocate_load();
+    if (colocate_order.num_cpus < 2)
+        return cmd->place;
+    cpu = colocate_order.cpus[colocate_order.next++ % colocate_order.num_cpus];
+
+    if (cmd->place != NULL)
+        *buf = *cmd->place;
+    else
+        stage_place_init(buf);
+    buf->has_cpus = true;
+    CPU_ZERO(&buf->cpus);
+    CPU_SET(cpu, &buf->cpus);
+
+    return buf;
+}
+
+
+/*
+ * `limit [cpu=N] [mem=SIZE] [pids=N] PIPELINE` caps what the pipeline as a
+ * whole may use: N CPUs' worth of time (like 0.5, or 50%), SIZE bytes of
+ * memory, and N processes.  When it is done, what it did use is reported.
+ * The jobs code below enforces the caps.
+ */
+#define LIMIT_CPU_PERIOD 100000     /* us, for cpu.max */
+#define LIMIT_CPU_MIN_QUOTA 1000    /* us, the least cpu.max takes */
+
+struct limit_spec {
+    long cpu_quota;         /* us per LIMIT_CPU_PERIOD, or 0 for no cap */
+    long mem;               /* bytes, or 0 */
+    long pids;              /* or 0 */
+};
+
+
+/* add the KEY=VALUE word `word` to `spec` */
+static int
+limit_parse(struct limit_spec *spec, const char *word)
+{
+    const char *value = strchr(word, '=') + 1;
+    size_t key_len = (size_t)(value - 1 - word);
+    double cpus;
+    char *end;
+
+    if (key_len == 3 && strncmp(word, "cpu", 3) == 0) {
+        errno = 0;
+        cpus = strtod(value, &end);
+        if (*end == '%') {
+            cpus /= 100;
+            end++;
+        }
+        if (errno != 0 || end == value || *end != '\0' || !(cpus > 0) ||
+                cpus > CPU_SETSIZE)
+            goto invalid;
+        spec->cpu_quota = (long)(cpus * LIMIT_CPU_PERIOD);
+        if (spec->cpu_quota < LIMIT_CPU_MIN_QUOTA)
+            spec->cpu_quota = LIMIT_CPU_MIN_QUOTA;
+    } else if (key_len == 3 && strncmp(word, "mem", 3) == 0) {
+        if (pipe_size_parse(value, &spec->mem) == -1 || spec->mem <= 0)
+            goto invalid;
+    } else if (key_len == 4 && strncmp(word, "pids", 4) == 0) {
+        if (mu_str_to_long(value, 10, &spec->pids) < 0 || spec->pids <= 0)
+            goto invalid;
+    } else {
+        mu_stderr("syntax error: unknown limit \"%.*s\"", (int)key_len, word);
+        return -1;
+    }
+
+    return 0;
+
+invalid:
+    mu_stderr("syntax error: invalid limit \"%s\"", word);
+    return -1;
+}
+
+
+/* no args, redirects or placement yet */
+static bool
+cmd_is_blank(const struct cmd *cmd)
+{
+    return cmd->num_args == 0 && cmd->in_file == NULL &&
+            cmd->in_doc == NULL && cmd->out_file == NULL && cmd->place == NULL;
+}
+
+
+static void
+cmd_print(const struct cmd *cmd)
+{
+    size_t i;
+
+    printf("cmd {num_args:%zu, cap_args:%zu}:\n",
+            cmd->num_args, cmd->cap_args);
+    for (i = 0; i < cmd->num_args; i++)
+        printf("\t[%zu] = \"%s\"\n", i, cmd->args[i]);
+    if (cmd->in_file != NULL)
+        printf("\t< \"%s\"\n", cmd->in_file);
+    if (cmd->in_doc != NULL)
+        printf("\t<< %zu bytes\n", cmd->in_doc->len);
+    if (cmd->out_file != NULL)
+        printf("\t%s \"%s\"\n", cmd->append ? ">>" : ">", cmd->out_file);
+    if (cmd->place != NULL)
+        stage_place_print(cmd->place);
+}
+
+
+static void
+params_set(int argc, char **argv)
+{
+    params.argc = argc;
+    params.argv = argv;
+}
+
+
+static pid_t last_bg_pid;
+
+
+/*
+ * Variable lookup for the lexer: $0-$9 and $# are the positional
+ * parameters, $? the last exit status, $$ the shell's pid, and anything else
+ * is taken from the environment.  $! is the pid of the last stage of the
+ * most recent background job.  Returned strings only need to live until
+ * the lexer has copied them.
+ */
+static const char *
+shell_var(void *ctx, const char *name, size_t len)
+{
+    static char buf[32];
+    struct mu_arena *arena = ctx;
+    int n;
+
+    if (len == 1 && name[0] >= '0' && name[0] <= '9') {
+        n = name[0] - '0';
+        return n < params.argc ? params.argv[n] : NULL;
+    }
+
+    if (len == 1 && name[0] == '#') {
+        mu_snprintf(buf, sizeof(buf), "%d", params.argc - 1);
+        return buf;
+    }
+
+    if (len == 1 && name[0] == '?') {
+        mu_snprintf(buf, sizeof(buf), "%d", last_status);
+        return buf;
+    }
+
+    if (len == 1 && name[0] == '$') {
+        mu_snprintf(buf, sizeof(buf), "%" MU_PRI_pid, getpid());
+        return buf;
+    }
+
+    if (len == 1 && name[0] == '!') {
+        if (last_bg_pid == 0)
+            return NULL;
+        mu_snprintf(buf, sizeof(buf), "%" MU_PRI_pid, last_bg_pid);
+        return buf;
+    }
+
+    return getenv(mu_arena_strndup(arena, name, len));
+}
+
+
+static void
+pipeline_add_cmd(struct pipeline *pipeline, struct cmd *cmd)
+{
+    list_add_tail(&cmd->list, &pipeline->head);
+    pipeline->num_cmds += 1;
+}
+
+
+static struct pipeline *
+pipeline_begin(struct mu_arena *arena)
+{
+    MU_ARENA_NEW(arena, pipeline, pipeline);
+
+    INIT_LIST_HEAD(&pipeline->head);
+    pipeline->arena = arena;
+    pipeline->parse_cmd = cmd_new(arena);
+    pipeline->out_fd = -1;
+    pipeline->launch_rfd = -1;
+
+    return pipeline;
+}
+
+
+static const char *cmdsub_run(void *ctx, char *text, size_t *len);
+
+
+/*
+ * Whether what follows `timeout` reads `[-k KILL_AFTER] DURATION`.  Anything
+ * else -- timeout(1)'s -s or --preserve-status, say -- leaves `timeout` an
+ * ordinary command, as in existing scripts.  Durations are plain words, so
+ * the raw text is checked, before the lexer unquotes any of it.
+ */
+static bool
+timeout_is_prefix(const struct lexer *lx)
+{
+    const char *p = lx->p;
+    char word[32];
+    size_t n, i, num_words = 1;
+    uint64_t ns;
+
+    if (lx->pending != LEX_NONE || lx->fields != NULL)
+        return false;
+
+    for (i = 0; i < num_words; i++) {
+        p += strspn(p, " \t");
+        n = strcspn(p, " \t\n");
+        if (n == 0 || n >= sizeof(word))
+            return false;
+        memcpy(word, p, n);
+        word[n] = '\0';
+        p += n;
+
+        if (i == 0 && strcmp(word, "-k") == 0)
+            num_words = 3;
+        else if (duration_parse(word, &ns) == -1)
+            return false;
+    }
+
+    return true;
+}
+
+
+/* `timeout [-k KILL_AFTER] DURATION`, once `timeout` has been read */
+static int
+timeout_parse(struct lexer *lx, struct pipeline *pipeline)
+{
+    struct lex_token tok;
+
+    pipeline->kill_after_ns = TIMEOUT_KILL_AFTER_DEFAULT;
+    if (lex_next(lx, &tok) != LEX_WORD)
+        goto missing;
+    if (strcmp(tok.s, "-k") == 0) {
+        if (lex_next(lx, &tok) != LEX_WORD)
+            goto missing;
+        if (duration_parse(tok.s, &pipeline->kill_after_ns) == -1)
+            goto invalid;
+        if (lex_next(lx, &tok) != LEX_WORD)
+            goto missing;
+    }
+    if (duration_parse(tok.s, &pipeline->timeout_ns) == -1)
+        goto invalid;
+
+    return 0;
+
+missing:
+    mu_stderr("syntax error: timeout: duration expected");
+    return -1;
+
+invalid:
+    mu_stderr("syntax error: invalid duration \"%s\"", tok.s);
+    return -1;
+}
+
+
+/*
+ * Parse the next part of a pipeline.  Unless it is the `final` part, `text`
+ * must end just after a pipe operator, so that it holds whole stages.  The
+ * args point into `text`, which is unquoted in place, so it must outlive the
+ * pipeline.
+ *
+ * Return -1 (after printing a message) on a syntax error.  Empty text gives a
+ * pipeline with no cmds.
+ */
+static int
+pipeline_parse(struct pipeline *pipeline, char *text, bool final)
+{
+    struct mu_arena *arena = pipeline->arena;
+    struct cmd *cmd = pipeline->parse_cmd;
+    struct lexer lx;
+    struct lex_token tok;
+    struct lex_heredoc *hd;
+    struct procsub *ps, **psp;
+    enum lex_type redir;
+
+    lex_init(&lx, text);
+    lex_set_expand(&lx, arena, shell_var, arena);
+    lex_set_cmdsub(&lx, cmdsub_run);
+
+    for (;;) {
+        switch (lex_next(&lx, &tok)) {
+        case LEX_WORD:
+            /*
+             * `time`, `limit` (with the KEY=VALUE words after it) and
+             * `timeout` (with its duration) are prefixes of the whole
+             * pipeline, not commands.
+             */
+            if (pipeline->num_cmds == 0 && cmd_is_blank(cmd)) {
+                if (!pipeline->timed && !tok.quoted &&
+                        strcmp(tok.s, "time") == 0) {
+                    pipeline->timed = true;
+                    break;
+                }
+                if (pipeline->limit == NULL && !tok.quoted &&
+                        strcmp(tok.s, "limit") == 0) {
+                    pipeline->limit = mu_arena_zalloc(arena,
+                            sizeof(*pipeline->limit));
+                    break;
+                }
+                if (pipeline->limit != NULL && !tok.quoted &&
+                        strchr(tok.s, '=') != NULL) {
+                    if (limit_parse(pipeline->limit, tok.s) == -1)
+                        return -1;
+                    break;
+                }
+                if (pipeline->timeout_ns == 0 && !tok.quoted &&
+                        strcmp(tok.s, "timeout") == 0 &&
+                        timeout_is_prefix(&lx)) {
+                    if (timeout_parse(&lx, pipeline) == -1)
+                        return -1;
+                    break;
+                }
+            }
+            if (cmd->num_args == 0 && !tok.quoted && tok.s[0] == '@' &&
+                    strchr(tok.s, '=') != NULL) {
+                if (stage_place_parse(cmd, tok.s) == -1)
+                    return -1;
+                break;
+            }
+            cmd_push_arg(cmd, tok.s);
+            break;
+
+        case LEX_REDIR_IN:
+        case LEX_REDIR_OUT:
+        case LEX_REDIR_APPEND:
+            redir = tok.type;
+            if (lex_next(&lx, &tok) != LEX_WORD)
+                goto syntax_error;
+            if (redir == LEX_REDIR_IN) {
+                cmd->in_file = tok.s;
+                cmd->in_doc = NULL;
+            } else {
+                cmd->out_file = tok.s;
+                cmd->append = (redir == LEX_REDIR_APPEND);
+            }
+            break;
+
+        case LEX_HEREDOC:
+        case LEX_HEREDOC_STRIP:
+        case LEX_HERESTRING:
+            redir = tok.type;
+            if (lex_next(&lx, &tok) != LEX_WORD)
+                goto syntax_error;
+            hd = mu_arena_zalloc(arena, sizeof(*hd));
+            if (redir == LEX_HERESTRING) {
+                /* like bash, a here-string gets a newline */
+                hd->len = tok.len + 1;
+                hd->body = mu_arena_alloc(arena, hd->len + 1);
+                memcpy(hd->body, tok.s, tok.len);
+                memcpy(hd->body + tok.len, "\n", 2);
+            } else {
+                hd->delim = tok.s;
+                hd->strip_tabs = (redir == LEX_HEREDOC_STRIP);
+                hd->expand = !tok.quoted;
+                lex_heredoc(&lx, hd);
+            }
+            cmd->in_doc = hd;
+            cmd->in_file = NULL;
+            break;
+
+        case LEX_PROCSUB_IN:
+        case LEX_PROCSUB_OUT:
+            ps = mu_arena_zalloc(arena, sizeof(*ps));
+            ps->pipeline = pipeline_begin(arena);
+            if (pipeline_parse(ps->pipeline, tok.s, true) == -1)
+                return -1;
+            if (ps->pipeline->num_cmds == 0 || ps->pipeline->background) {
+                mu_stderr("syntax error: bad process substitution");
+                return -1;
+            }
+            ps->out = (tok.type == LEX_PROCSUB_OUT);
+            ps->arg_idx = cmd->num_args;
+            ps->fd = -1;
+            for (psp = &cmd->procsubs; *psp != NULL; psp = &(*psp)->next)
+                ;
+            *psp = ps;
+            cmd_push_arg(cmd, mu_arena_strdup(arena,
+                        ps->out ? ">(...)" : "<(...)"));
+            break;
+
+        case LEX_PIPE:
+            if (cmd->num_args == 0)
+                goto syntax_error;
+            if (tok.s != NULL && pipe_size_parse(tok.s, &cmd->pipe_size) == -1) {
+                mu_stderr("syntax error: invalid pipe size \"%s\"", tok.s);
+                return -1;
+            }
+            pipeline_add_cmd(pipeline, cmd);
+            cmd = pipeline->parse_cmd = cmd_new(arena);
+            break;
+
+        case LEX_AMP:
+            if (lex_next(&lx, &tok) != LEX_END || !final)
+                goto syntax_error;
+            if (cmd->num_args == 0)
+                goto syntax_error;
+            pipeline->background = true;
+            pipeline_add_cmd(pipeline, cmd);
+            pipeline->parse_cmd = NULL;
+            return 0;
+
+        case LEX_END:
+            if (!final)
+                return 0;
+            if (cmd->num_args == 0) {
+                if (pipeline->num_cmds > 0 || !cmd_is_blank(cmd))
+                    goto syntax_error;
+                return 0;
+            }
+            pipeline_add_cmd(pipeline, cmd);
+            pipeline->parse_cmd = NULL;
+            return 0;
+
+        case LEX_ERROR:
+            mu_stderr("syntax error: %s", lx.err);
+            return -1;
+
+        default:
+            mu_panic("unexpected token type %d", (int)tok.type);
+        }
+    }
+
+syntax_error:
+    mu_stderr("syntax error near unexpected token `%s'", lex_type_str(tok.type));
+    return -1;
+}
+
+
+/* parse a whole command line; return NULL on a syntax error */
+static struct pipeline *
+pipeline_new(struct mu_arena *arena, char *line)
+{
+    struct pipeline *pipeline = pipeline_begin(arena);
+
+    if (pipeline_parse(pipeline, line, true) == -1)
+        return NULL;
+
+    return pipeline;
+}
+
+
+static void
+pipeline_print(const struct pipeline *pipeline)
+{
+    struct cmd *cmd;
+
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        cmd_print(cmd);
+    }
+}
+
+/* a line with nothing to run: empty, blanks only, or a comment */
+static bool
+line_is_blank(const char *line)
+{
+    line += strspn(line, " \t\n");
+    return *line == '\0' || *line == '#';
+}
+
+
+/*
+ * PATH lookup cache, in the spirit of bash's `hash`.  Command names are
+ * resolved against $PATH once and remembered, so launching a stage does not
+ * walk $PATH with a failed execve per directory.  The whole cache is dropped
+ * when $PATH changes or when the mtime of any $PATH directory changes (a
+ * command was added, removed or replaced).
+ *
+ * With --hash-fds, each entry also holds an O_PATH fd for the executable, and
+ * the fork launcher execs through it with fexecve() so that no path walk
+ * happens at all.
+ */
+#define PATH_CACHE_NUM_BUCKETS 64
+
+struct path_entry {
+    struct list_head list;  /* bucket chain */
+    char *name;
+    char *path;
+    int fd;                 /* O_PATH fd for path, or -1 */
+    unsigned long hits;
+};
+
+struct path_dir {
+    char *dir;
+    struct timespec mtime;
+};
+
+struct path_cache {
+    struct list_head buckets[PATH_CACHE_NUM_BUCKETS];
+    size_t num_entries;
+    char *path_env;         /* the $PATH the dirs were taken from */
+    struct path_dir *dirs;
+    size_t num_dirs;
+    bool use_fds;
+    unsigned long generation;   /* bumped when entries are dropped */
+};
+
+static struct path_cache path_cache;
+
+
+static void
+path_entry_free(struct path_entry *ent)
+{
+    if (ent->fd != -1)
+        close(ent->fd);
+    free(ent->name);
+    free(ent->path);
+    free(ent);
+}
+
+
+static void
+path_cache_clear(void)
+{
+    struct path_entry *ent, *tmp;
+    size_t i;
+
+    for (i = 0; i < PATH_CACHE_NUM_BUCKETS; i++) {
+        list_for_each_entry_safe(ent, tmp, &path_cache.buckets[i], list) {
+            list_del(&ent->list);
+            path_entry_free(ent);
+        }
+    }
+    path_cache.num_entries = 0;
+    path_cache.generation++;
+}
+
+
+static void
+path_cache_init(bool use_fds)
+{
+    size_t i;
+
+    for (i = 0; i < PATH_CACHE_NUM_BUCKETS; i++)
+        INIT_LIST_HEAD(&path_cache.buckets[i]);
+    path_cache.use_fds = use_fds;
+}
+
+
+static void
+path_cache_free_dirs(void)
+{
+    size_t i;
+
+    for (i = 0; i < path_cache.num_dirs; i++)
+        free(path_cache.dirs[i].dir);
+    free(path_cache.dirs);
+    free(path_cache.path_env);
+
+    path_cache.dirs = NULL;
+    path_cache.num_dirs = 0;
+    path_cache.path_env = NULL;
+}
+
+
+static void
+path_cache_load_dirs(const char *path_env)
+{
+    char *copy, *dir, *saveptr;
+    struct path_dir *pd;
+    struct stat st;
+    size_t cap = 8;
+
+    path_cache.path_env = mu_strdup(path_env);
+    path_cache.dirs = mu_mallocarray(cap, sizeof(struct path_dir));
+
+    copy = mu_strdup(path_env);
+    for (dir = strtok_r(copy, ":", &saveptr); dir != NULL;
+            dir = strtok_r(NULL, ":", &saveptr)) {
+        if (path_cache.num_dirs == cap) {
+            cap *= 2;
+            path_cache.dirs = mu_reallocarray(path_cache.dirs, cap,
+                    sizeof(struct path_dir));
+        }
+        pd = &path_cache.dirs[path_cache.num_dirs++];
+        pd->dir = mu_strdup(dir);
+        if (stat(dir, &st) == 0)
+            pd->mtime = st.st_mtim;
+        else
+            mu_memzero_p(&pd->mtime);
+    }
+    free(copy);
+}
+
+
+/*
+ * Drop every cached entry if $PATH, or any directory on it, has changed
+ * since the entries were resolved.  Called once per pipeline.
+ */
+static void
+path_cache_validate(void)
+{
+    const char *path_env = getenv("PATH");
+    struct timespec mtime;
+    struct stat st;
+    size_t i;
+
+    if (path_env == NULL)
+        path_env = "";
+
+    if (path_cache.path_env == NULL || strcmp(path_cache.path_env, path_env)) {
+        path_cache_clear();
+        path_cache_free_dirs();
+        path_cache_load_dirs(path_env);
+        return;
+    }
+
+    for (i = 0; i < path_cache.num_dirs; i++) {
+        if (stat(path_cache.dirs[i].dir, &st) == 0)
+            mtime = st.st_mtim;
+        else
+            mu_memzero_p(&mtime);
+
+        if (mtime.tv_sec != path_cache.dirs[i].mtime.tv_sec ||
+                mtime.tv_nsec != path_cache.dirs[i].mtime.tv_nsec) {
+            path_cache.dirs[i].mtime = mtime;
+            path_cache_clear();
+        }
+    }
+}
+
+
+static bool
+is_executable_file(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+
+    return faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0;
+}
+
+
+/*
+ * Return the cache entry for the command `name`, resolving it against $PATH
+ * on a miss.  Return NULL if `name` contains a slash (it is used as is) or
+ * is not found on $PATH.
+ */
+static struct path_entry *
+path_cache_lookup(const char *name)
+{
+    struct list_head *bucket;
+    struct path_entry *ent;
+    char path[PATH_MAX];
+    size_t i;
+
+    if (strchr(name, '/') != NULL || name[0] == '\0')
+        return NULL;
+
+    bucket = &path_cache.buckets[mu_hash_str(name) % PATH_CACHE_NUM_BUCKETS];
+    list_for_each_entry(ent, bucket, list) {
+        if (strcmp(ent->name, name) == 0) {
+            ent->hits++;
+            return ent;
+        }
+    }
+
+    for (i = 0; i < path_cache.num_dirs; i++) {
+        /* an empty PATH element means the current directory */
+        if (snprintf(path, sizeof(path), "%s/%s",
+                    path_cache.dirs[i].dir[0] ? path_cache.dirs[i].dir : ".",
+                    name) >= (int)sizeof(path))
+            continue;
+        if (is_executable_file(path))
+            goto found;
+    }
+    return NULL;
+
+found:
+    ent = mu_zalloc(sizeof(*ent));
+    ent->name = mu_strdup(name);
+    ent->path = mu_strdup(path);
+    ent->fd = -1;
+    ent->hits = 1;
+    if (path_cache.use_fds)
+        ent->fd = open(path, O_PATH | O_CLOEXEC);
+
+    list_add_tail(&ent->list, bucket);
+    path_cache.num_entries++;
+
+    return ent;
+}
+
+
+/* path_cache_lookup() for args[0], skipped if the parse cache knows it */
+static struct path_entry *
+cmd_path_lookup(const struct cmd *cmd)
+{
+    if (cmd->path != NULL && cmd->path_gen == path_cache.generation) {
+        cmd->path->hits++;
+        return cmd->path;
+    }
+
+    return path_cache_lookup(cmd->args[0]);
+}
+
+
+/*
+ * Flat pipelines.  A parsed pipeline can be laid out without pointers: a
+ * header, its stages, a table of arg offsets and a blob holding every string
+ * it uses.  The parse cache keeps pipelines in this form, and so do compiled
+ * scripts on disk, and getting a pipeline back takes one copy of the blob
+ * into the arena.
+ */
+#define FLAT_NONE UINT32_MAX
+
+struct flat_pipeline {
+    uint32_t num_stages;
+    uint32_t num_args;
+    uint32_t blob_len;
+    uint8_t background;
+    uint8_t timed;
+    uint8_t pad[2];
+};
+
+struct flat_stage {
+    uint32_t num_args;
+    uint32_t args;          /* index of the first in the arg offsets */
+    uint32_t in_file;       /* blob offset, or FLAT_NONE */
+    uint32_t out_file;      /* ditto */
+    uint32_t doc;           /* ditto, for the body of a here-document */
+    uint32_t doc_len;
+    int64_t pipe_size;
+    uint8_t append;
+    uint8_t pad[7];
+};
+
+
+static struct flat_stage *
+flat_stages(const struct flat_pipeline *fp)
+{
+    return (struct flat_stage *)(fp + 1);
+}
+
+
+static uint32_t *
+flat_args(const struct flat_pipeline *fp)
+{
+    return (uint32_t *)(flat_stages(fp) + fp->num_stages);
+}
+
+
+static char *
+flat_blob(const struct flat_pipeline *fp)
+{
+    return (char *)(flat_args(fp) + fp->num_args);
+}
+
+
+/*
+ * The size of `pipeline` laid out flat, or 0 if it can't be: it is empty or
+ * too big, it has a `limit` or `timeout` prefix, or some stage has process
+ * substitutions (which are started along with it) or placement (which
+ * depends on the machine it was parsed on).
+ */
+static size_t
+flat_size(const struct pipeline *pipeline)
+{
+    const struct cmd *cmd;
+    size_t num_args = 0, blob_len = 0, i;
+
+    if (pipeline->num_cmds == 0 || pipeline->limit != NULL ||
+            pipeline->timeout_ns > 0)
+        return 0;
+
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        if (cmd->procsubs != NULL || cmd->place != NULL)
+            return 0;
+        num_args += cmd->num_args;
+        for (i = 0; i < cmd->num_args; i++)
+            blob_len += strlen(cmd->args[i]) + 1;
+        if (cmd->in_file != NULL)
+            blob_len += strlen(cmd->in_file) + 1;
+        if (cmd->out_file != NULL)
+            blob_len += strlen(cmd->out_file) + 1;
+        if (cmd->in_doc != NULL)
+            blob_len += cmd->in_doc->len + 1;
+    }
+    if (blob_len >= FLAT_NONE)
+        return 0;
+
+    return sizeof(struct flat_pipeline) +
+            pipeline->num_cmds * sizeof(struct flat_stage) +
+            num_args * sizeof(uint32_t) + blob_len;
+}
+
+
+/* add `n` bytes (+ nul) from `s` to the blob; return their offset */
+static uint32_t
+flat_put(char *blob, uint32_t *len, const char *s, size_t n)
+{
+    uint32_t off = *len;
+
+    memcpy(blob + off, s, n);
+    blob[off + n] = '\0';
+    *len += (uint32_t)n + 1;
+
+    return off;
+}
+
+
+/* lay out `pipeline` in `fp`, which has room for flat_size() bytes */
+static void
+flat_write(const struct pipeline *pipeline, struct flat_pipeline *fp)
+{
+    const struct cmd *cmd;
+    struct flat_stage *st;
+    uint32_t *args;
+    char *blob;
+    size_t i;
+
+    mu_memzero_p(fp);
+    fp->num_stages = (uint32_t)pipeline->num_cmds;
+    list_for_each_entry(cmd, &pipeline->head, list)
+        fp->num_args += (uint32_t)cmd->num_args;
+    fp->background = pipeline->background;
+    fp->timed = pipeline->timed;
+
+    st = flat_stages(fp);
+    args = flat_args(fp);
+    blob = flat_blob(fp);
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        mu_memzero_p(st);
+        st->num_args = (uint32_t)cmd->num_args;
+        st->args = (uint32_t)(args - flat_args(fp));
+        for (i = 0; i < cmd->num_args; i++)
+            *args++ = flat_put(blob, &fp->blob_len, cmd->args[i],
+                    strlen(cmd->args[i]));
+        st->in_file = st->out_file = st->doc = FLAT_NONE;
+        if (cmd->in_file != NULL)
+            st->in_file = flat_put(blob, &fp->blob_len, cmd->in_file,
+                    strlen(cmd->in_file));
+        if (cmd->out_file != NULL)
+            st->out_file = flat_put(blob, &fp->blob_len, cmd->out_file,
+                    strlen(cmd->out_file));
+        if (cmd->in_doc != NULL) {
+            st->doc = flat_put(blob, &fp->blob_len, cmd->in_doc->body,
+                    cmd->in_doc->len);
+            st->doc_len = (uint32_t)cmd->in_doc->len;
+        }
+        st->pipe_size = cmd->pipe_size;
+        st->append = cmd->append;
+        st++;
+    }
+}
+
+
+/* fill the empty `pipeline` from `fp` */
+static void
+flat_read(const struct flat_pipeline *fp, struct pipeline *pipeline)
+{
+    struct mu_arena *arena = pipeline->arena;
+    const struct flat_stage *st = flat_stages(fp);
+    const uint32_t *args;
+    struct cmd *cmd;
+    char *blob;
+    uint32_t i, j;
+
+    blob = memcpy(mu_arena_alloc(arena, fp->blob_len), flat_blob(fp),
+            fp->blob_len);
+    for (i = 0; i < fp->num_stages; i++, st++) {
+        cmd = cmd_new(arena);
+        if (st->num_args + 1 > cmd->cap_args) {
+            cmd->cap_args = st->num_args + 1;
+            cmd->args = mu_arena_mallocarray(arena, cmd->cap_args,
+                    sizeof(char *));
+        }
+        args = flat_args(fp) + st->args;
+        for (j = 0; j < st->num_args; j++)
+            cmd->args[j] = blob + args[j];
+        cmd->args[st->num_args] = NULL;
+        cmd->num_args = st->num_args;
+
+        if (st->in_file != FLAT_NONE)
+            cmd->in_file = blob + st->in_file;
+        if (st->out_file != FLAT_NONE)
+            cmd->out_file = blob + st->out_file;
+        if (st->doc != FLAT_NONE) {
+            cmd->in_doc = mu_arena_zalloc(arena, sizeof(*cmd->in_doc));
+            cmd->in_doc->body = blob + st->doc;
+            cmd->in_doc->len = st->doc_len;
+        }
+        cmd->append = st->append;
+        cmd->pipe_size = (long)st->pipe_size;
+        pipeline_add_cmd(pipeline, cmd);
+    }
+    pipeline->background = fp->background;
+    pipeline->timed = fp->timed;
+    pipeline->parse_cmd = NULL;
+}
+
+
+/*
+ * Parse cache.  Scripts often run the same command line many times, so a
+ * line that parses the same way every time -- one with no expansions and no
+ * process substitutions -- is kept flat, keyed by its text, and when the
+ * line comes again its pipeline is copied out instead of being lexed and
+ * parsed.  Entries are dropped in LRU order to keep their total size within
+ * `set -o parsecache=SIZE` (0 turns the cache off).
+ *
+ * An entry is a single allocation: the entry, where each stage's command was
+ * found on $PATH (for as long as the path cache keeps it), the flat
+ * pipeline, and the text.
+ */
+#define PARSE_CACHE_NUM_BUCKETS 256
+
+struct parse_path {
+    struct path_entry *ent;
+    unsigned long gen;
+};
+
+struct parse_entry {
+    struct list_head list;  /* bucket chain */
+    struct list_head lru;   /* most recently used first */
+    uint64_t hash;
+    size_t size;            /* of the allocation */
+    char *text;
+    size_t text_len;
+    struct parse_path *paths;
+    struct flat_pipeline *flat;
+};
+
+struct parse_cache {
+    struct list_head buckets[PARSE_CACHE_NUM_BUCKETS];
+    struct list_head lru;
+    size_t num_entries;
+    size_t size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static struct parse_cache parse_cache;
+
+
+static void
+parse_cache_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < PARSE_CACHE_NUM_BUCKETS; i++)
+        INIT_LIST_HEAD(&parse_cache.buckets[i]);
+    INIT_LIST_HEAD(&parse_cache.lru);
+}
+
+
+static void
+parse_cache_drop(struct parse_entry *ent)
+{
+    list_del(&ent->list);
+    list_del(&ent->lru);
+    parse_cache.num_entries--;
+    parse_cache.size -= ent->size;
+    free(ent);
+}
+
+
+/* drop least recently used entries until `size` more bytes fit */
+static void
+parse_cache_trim(size_t size)
+{
+    struct parse_entry *ent;
+
+    while (parse_cache.num_entries > 0 &&
+            parse_cache.size + size > (size_t)parse_cache_max) {
+        ent = list_last_entry(&parse_cache.lru, struct parse_entry, lru);
+        parse_cache_drop(ent);
+        parse_cache.evictions++;
+    }
+}
+
+
+/* whether a line can be kept: without a '$', it parses the same every time */
+static bool
+parse_cache_text_ok(const char *text, size_t len)
+{
+    return parse_cache_max > 0 && memchr(text, '$', len) == NULL;
+}
+
+
+/*
+ * Event loop.  Everything the shell waits on -- child exits (one pidfd per
+ * process) and stops (SIGCHLD, through a signalfd) -- is an fd in a single
+ * epoll set, so any number of jobs can be in flight and the shell only ever
+ * blocks when it has nothing else to do.
+ */
+struct ev_source {
+    int fd;
+    void (*cb)(struct ev_source *src, uint32_t events);
+};
+
+#define EV_MAX_EVENTS 32
+
+static int ev_epfd = -1;
+
+
+static void
+ev_add(struct ev_source *src, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+
+    if (epoll_ctl(ev_epfd, EPOLL_CTL_ADD, src->fd, &ev) == -1)
+        mu_die_errno(errno, "epoll_ctl");
+}
+
+
+/* after a source has moved */
+static void
+ev_mod(struct ev_source *src, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+
+    if (epoll_ctl(ev_epfd, EPOLL_CTL_MOD, src->fd, &ev) == -1)
+        mu_die_errno(errno, "epoll_ctl");
+}
+
+
+/* stop watching a source that stays open */
+static void
+ev_del(struct ev_source *src)
+{
+    if (epoll_ctl(ev_epfd, EPOLL_CTL_DEL, src->fd, NULL) == -1)
+        mu_die_errno(errno, "epoll_ctl");
+}
+
+
+/*
+ * Wait up to `timeout_ms` (-1: forever) for events and dispatch them.  A
+ * callback may close another source that has an event pending in the same
+ * batch; closed sources have fd -1 and are skipped.
+ */
+static void
+ev_run_once(int timeout_ms)
+{
+    struct epoll_event evs[EV_MAX_EVENTS];
+    struct ev_source *src;
+    int i, n;
+
+    n = epoll_wait(ev_epfd, evs, EV_MAX_EVENTS, timeout_ms);
+    if (n == -1) {
+        if (errno == EINTR)
+            return;
+        mu_die_errno(errno, "epoll_wait");
+    }
+
+    for (i = 0; i < n; i++) {
+        src = evs[i].data.ptr;
+        if (src->fd != -1)
+            src->cb(src, evs[i].events);
+    }
+}
+
+
+/*
+ * Timers: a binary min-heap of deadlines, and one timerfd in the event loop,
+ * armed for the earliest.  Adding or cancelling a timer is O(log n), so any
+ * number of concurrent deadlines costs a single fd.  A timer knows its slot
+ * in the heap (1-based, 0 when it isn't queued), so a zeroed timer is idle,
+ * and whatever holds it must call timer_moved() if it moves.
+ */
+struct timer {
+    uint64_t deadline_ns;   /* CLOCK_MONOTONIC, as mu_now_ns() */
+    size_t idx;
+    void (*cb)(struct timer *timer);
+};
+
+static struct {
+    struct timer **heap;    /* heap[1..num] */
+    size_t num;
+    size_t cap;
+} timers;
+
+static struct ev_source timer_src = { .fd = -1 };
+
+
+static void
+timer_place(size_t i, struct timer *timer)
+{
+    timers.heap[i] = timer;
+    timer->idx = i;
+}
+
+
+static void
+timer_sift_up(size_t i)
+{
+    struct timer *timer = timers.heap[i];
+
+    while (i > 1 && timers.heap[i / 2]->deadline_ns > timer->deadline_ns) {
+        timer_place(i, timers.heap[i / 2]);
+        i /= 2;
+    }
+    timer_place(i, timer);
+}
+
+
+static void
+timer_sift_down(size_t i)
+{
+    struct timer *timer = timers.heap[i];
+    size_t child;
+
+    while ((child = 2 * i) <= timers.num) {
+        if (child < timers.num && timers.heap[child + 1]->deadline_ns <
+                timers.heap[child]->deadline_ns)
+            child++;
+        if (timers.heap[child]->deadline_ns >= timer->deadline_ns)
+            break;
+        timer_place(i, timers.heap[child]);
+        i = child;
+    }
+    timer_place(i, timer);
+}
+
+
+/* arm the timerfd for the earliest deadline, or disarm it */
+static void
+timer_arm(void)
+{
+    struct itimerspec its;
+    uint64_t ns;
+
+    mu_memzero_p(&its);
+    if (timers.num > 0) {
+        /* an all-zero time would disarm it */
+        ns = timers.heap[1]->deadline_ns > 0 ? timers.heap[1]->deadline_ns : 1;
+        its.it_value.tv_sec = (time_t)(ns / 1000000000);
+        its.it_value.tv_nsec = (long)(ns % 1000000000);
+    }
+    if (timerfd_settime(timer_src.fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        mu_die_errno(errno, "timerfd_settime");
+}
+
+
+static void
+timer_cancel(struct timer *timer)
+{
+    size_t i = timer->idx;
+    struct timer *last;
+
+    if (i == 0)
+        return;
+    timer->idx = 0;
+
+    last = timers.heap[timers.num--];
+    if (last != timer) {
+        timer_place(i, last);
+        timer_sift_up(i);
+        timer_sift_down(last->idx);
+    }
+    if (i == 1)
+        timer_arm();
+}
+
+
+/* the timers that are due go off */
+static void
+timer_cb(struct ev_source *src, uint32_t events)
+{
+    struct timer *timer;
+    uint64_t expirations, now = mu_now_ns();
+
+    MU_UNUSED(events);
+
+    /* just to clear it; it is non-blocking, and may have been re-armed */
+    if (read(src->fd, &expirations, sizeof(expirations)) == -1 &&
+            errno != EAGAIN)
+        mu_die_errno(errno, "read");
+
+    while (timers.num > 0 && timers.heap[1]->deadline_ns <= now) {
+        timer = timers.heap[1];
+        timer_cancel(timer);
+        timer->cb(timer);
+    }
+    timer_arm();
+}
+
+
+/* queue `timer`, which must be idle, to go off at `deadline_ns` */
+static void
+timer_add(struct timer *timer, uint64_t deadline_ns)
+{
+    if (timer_src.fd == -1) {
+        timer_src.fd = timerfd_create(CLOCK_MONOTONIC,
+                TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_src.fd == -1)
+            mu_die_errno(errno, "timerfd_create");
+        timer_src.cb = timer_cb;
+        ev_add(&timer_src, EPOLLIN);
+    }
+
+    if (timers.num + 1 >= timers.cap) {
+        timers.cap = timers.cap > 0 ? 2 * timers.cap : 16;
+        timers.heap = mu_reallocarray(timers.heap, timers.cap,
+                sizeof(*timers.heap));
+    }
+
+    timer->deadline_ns = deadline_ns;
+    timers.heap[++timers.num] = timer;
+    timer_sift_up(timers.num);
+    if (timer->idx == 1)
+        timer_arm();
+}
+
+
+/* `timer` has been moved (its struct reallocated) while queued */
+static void
+timer_moved(struct timer *timer)
+{
+    if (timer->idx != 0)
+        timers.heap[timer->idx] = timer;
+}
+
+
+/*
+ * Wait until `fd` is readable, meanwhile letting timers go off: the shell
+ * waits for input outside the event loop, and a background job's timeout
+ * must not wait for the next command line.
+ */
+static void
+timer_wait_readable(int fd)
+{
+    struct pollfd pfds[2];
+
+    while (timers.num > 0) {
+        pfds[0].fd = fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = timer_src.fd;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            mu_die_errno(errno, "poll");
+        }
+        if (pfds[1].revents & POLLIN)
+            timer_cb(&timer_src, EPOLLIN);
+        if (pfds[0].revents != 0)
+            return;
+    }
+}
+
+
+/*
+ * Enforcing `limit`.  Where the shell may make cgroups (cgroup v2, with the
+ * shell's own cgroup delegated to it), a limited job gets a transient cgroup
+ * of its own, made next to the shell, with cpu.max, memory.max and pids.max
+ * set; its stages join it before they exec, and its cpu.stat and peaks make
+ * the report.  A cap whose controller isn't there falls back to an rlimit
+ * set in each stage: RLIMIT_AS for mem, and RLIMIT_NPROC for pids (which,
+ * as with `ulimit -u`, counts all of the user's processes).  cpu has no such
+ * fallback.
+ *
+ * A cgroup with processes in it can't hand controllers down, so if the
+ * shell is in the cgroup it was given, it first moves into a leaf,
+ * bsh.shell, of its own.
+ */
+#define LIMIT_CPU 1u
+#define LIMIT_MEM 2u
+#define LIMIT_PIDS 4u
+
+struct job_limit {
+    struct limit_spec spec;
+    int cg_fd;              /* the job's cgroup, or -1 */
+    unsigned int cg_caps;   /* the LIMIT_* that the cgroup enforces */
+    char cg_name[48];
+};
+
+static struct {
+    bool loaded;
+    int fd;                 /* where jobs' cgroups are made, or -1 */
+    unsigned int caps;      /* the controllers they get */
+    unsigned long seq;
+} limit_cg = { .fd = -1 };
+
+
+/* write `s` to the file `name` in `dirfd`; return -1, with errno, on error */
+static int
+cg_write(int dirfd, const char *name, const char *s)
+{
+    size_t len = strlen(s);
+    ssize_t n;
+    int fd, err;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    n = write(fd, s, len);
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+
+static int
+cg_read(int dirfd, const char *name, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n == -1)
+        return -1;
+    buf[n] = '\0';
+
+    return 0;
+}
+
+
+/* the value of `key` in a flat-keyed file like cpu.stat, or -1 */
+static long long
+cg_stat(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+    const char *p = buf;
+
+    while (*p != '\0') {
+        if (strncmp(p, key, len) == 0 && p[len] == ' ')
+            return strtoll(p + len + 1, NULL, 10);
+        p = strchrnul(p, '\n');
+        if (*p == '\n')
+            p++;
+    }
+
+    return -1;
+}
+
+
+/* the LIMIT_* in a list of controllers, like cgroup.controllers */
+static unsigned int
+cg_controllers(char *buf)
+{
+    unsigned int caps = 0;
+    char *word, *save;
+
+    for (word = strtok_r(buf, " \n", &save); word != NULL;
+            word = strtok_r(NULL, " \n", &save)) {
+        if (strcmp(word, "cpu") == 0)
+            caps |= LIMIT_CPU;
+        else if (strcmp(word, "memory") == 0)
+            caps |= LIMIT_MEM;
+        else if (strcmp(word, "pids") == 0)
+            caps |= LIMIT_PIDS;
+    }
+
+    return caps;
+}
+
+
+/* the cgroup v2 mount point and the shell's cgroup, joined; or -1 */
+static int
+cg_self_path(char *path, size_t size)
+{
+    char mnt[PATH_MAX] = "", cg[PATH_MAX] = "";
+    char *line = NULL;
+    size_t cap = 0;
+    FILE *fp;
+
+    fp = fopen("/proc/self/mountinfo", "re");
+    if (fp == NULL)
+        return -1;
+    while (getline(&line, &cap, fp) != -1) {
+        if (strstr(line, " - cgroup2 ") != NULL &&
+                sscanf(line, "%*s %*s %*s %*s %4095s", mnt) == 1)
+            break;
+    }
+    fclose(fp);
+
+    fp = fopen("/proc/self/cgroup", "re");
+    if (fp != NULL) {
+        while (getline(&line, &cap, fp) != -1) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                mu_strlcpy(cg, line + 3, sizeof(cg));
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    free(line);
+
+    if (mnt[0] == '\0' || cg[0] == '\0')
+        return -1;
+    if (snprintf(path, size, "%s%s", mnt, cg) >= (int)size)
+        return -1;
+
+    return 0;
+}
+
+
+static void
+limit_cg_load(void)
+{
+    char path[2 * PATH_MAX], buf[256], ctl[64] = "";
+    unsigned int want = 0;
+    int fd, leaf;
+
+    limit_cg.loaded = true;
+    if (cg_self_path(path, sizeof(path)) == -1)
+        return;
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    if (cg_read(fd, "cgroup.controllers", buf, sizeof(buf)) == 0)
+        want = cg_controllers(buf);
+    if (cg_read(fd, "cgroup.subtree_control", buf, sizeof(buf)) == 0)
+        limit_cg.caps = cg_controllers(buf);
+
+    want &= ~limit_cg.caps;
+    if (want != 0) {
+        if (want & LIMIT_CPU)
+            mu_strlcat(ctl, " +cpu", sizeof(ctl));
+        if (want & LIMIT_MEM)
+            mu_strlcat(ctl, " +memory", sizeof(ctl));
+        if (want & LIMIT_PIDS)
+            mu_strlcat(ctl, " +pids", sizeof(ctl));
+
+        if (cg_write(fd, "cgroup.subtree_control", ctl + 1) == -1 &&
+                errno == EBUSY &&
+                (mkdirat(fd, "bsh.shell", 0755) == 0 || errno == EEXIST)) {
+            leaf = openat(fd, "bsh.shell", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (leaf != -1 && cg_write(leaf, "cgroup.procs", "0") == 0 &&
+                    cg_write(fd, "cgroup.subtree_control", ctl + 1) == -1) {
+                /* others are in the cgroup, too: step back */
+                cg_write(fd, "cgroup.procs", "0");
+                unlinkat(fd, "bsh.shell", AT_REMOVEDIR);
+            }
+            if (leaf != -1)
+                close(leaf);
+        }
+
+        if (cg_read(fd, "cgroup.subtree_control", buf, sizeof(buf)) == 0)
+            limit_cg.caps = cg_controllers(buf);
+    }
+
+    limit_cg.fd = fd;
+}
+
+
+/* set a job's cgroup file `name` to `value`, and note that it enforces `cap` */
+static void
+job_limit_set(struct job_limit *jl, unsigned int cap, const char *name,
+        const char *value)
+{
+    if (!(limit_cg.caps & cap))
+        return;
+    if (cg_write(jl->cg_fd, name, value) == 0)
+        jl->cg_caps |= cap;
+    else
+        mu_stderr_errno(errno, "limit: can't write %s", name);
+}
+
+
+/* get a limited job's cgroup ready, before its first stage starts */
+static void
+job_limit_start(struct job_limit *jl, const struct limit_spec *spec)
+{
+    char value[64];
+
+    jl->spec = *spec;
+    jl->cg_fd = -1;
+    jl->cg_caps = 0;
+
+    if (!limit_cg.loaded)
+        limit_cg_load();
+    if (limit_cg.fd != -1) {
+        mu_snprintf(jl->cg_name, sizeof(jl->cg_name), "bsh.job.%" MU_PRI_pid
+                ".%lu", getpid(), ++limit_cg.seq);
+        if (mkdirat(limit_cg.fd, jl->cg_name, 0755) == 0) {
+            jl->cg_fd = openat(limit_cg.fd, jl->cg_name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (jl->cg_fd == -1)
+                unlinkat(limit_cg.fd, jl->cg_name, AT_REMOVEDIR);
+        }
+    }
+
+    if (jl->cg_fd != -1) {
+        if (spec->cpu_quota > 0) {
+            mu_snprintf(value, sizeof(value), "%ld %d", spec->cpu_quota,
+                    LIMIT_CPU_PERIOD);
+            job_limit_set(jl, LIMIT_CPU, "cpu.max", value);
+        }
+        if (spec->mem > 0) {
+            mu_snprintf(value, sizeof(value), "%ld", spec->mem);
+            job_limit_set(jl, LIMIT_MEM, "memory.max", value);
+        }
+        if (spec->pids > 0) {
+            mu_snprintf(value, sizeof(value), "%ld", spec->pids);
+            job_limit_set(jl, LIMIT_PIDS, "pids.max", value);
+        }
+    }
+
+    if (spec->cpu_quota > 0 && !(jl->cg_caps & LIMIT_CPU))
+        mu_stderr("limit: no cgroup cpu controller: cpu is not capped");
+}
+
+
+/* join a job's cgroup, or set its rlimits; this runs in the stage */
+static void
+job_limit_enter(const struct job_limit *jl)
+{
+    struct rlimit rl;
+
+    if (jl->cg_fd != -1 && cg_write(jl->cg_fd, "cgroup.procs", "0") == -1)
+        mu_stderr_errno(errno, "limit: can't join cgroup %s", jl->cg_name);
+
+    if (jl->spec.mem > 0 && !(jl->cg_caps & LIMIT_MEM)) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t)jl->spec.mem;
+        if (setrlimit(RLIMIT_AS, &rl) == -1)
+            mu_stderr_errno(errno, "limit: setrlimit");
+    }
+    if (jl->spec.pids > 0 && !(jl->cg_caps & LIMIT_PIDS)) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t)jl->spec.pids;
+        if (setrlimit(RLIMIT_NPROC, &rl) == -1)
+            mu_stderr_errno(errno, "limit: setrlimit");
+    }
+}
+
+
+/* the job is gone: so is its cgroup, unless something it left is still in it */
+static void
+job_limit_end(struct job_limit *jl)
+{
+    if (jl->cg_fd == -1)
+        return;
+
+    close(jl->cg_fd);
+    jl->cg_fd = -1;
+    unlinkat(limit_cg.fd, jl->cg_name, AT_REMOVEDIR);
+}
+
+
+/*
+ * Jobs.  Every pipeline that launches processes is a job; a foreground job
+ * is waited for right away and a background one (`&`) is left in the job
+ * table until it finishes and has been reported.  Finished job structs are
+ * kept on a free list and reused, so running pipelines does not allocate.
+ */
+enum job_state {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+};
+
+/* where a proc is in the job's flow of data */
+enum proc_flow {
+    PROC_STAGE,             /* a stage of the job's pipeline */
+    PROC_PSUB_IN,           /* in a <(...) of one: it feeds the stage */
+    PROC_PSUB_OUT,          /* in a >(...) of one: the stage feeds it */
+};
+
+struct proc;
+
+static void pipe_unwatch(struct proc *proc);
+
+struct proc {
+    struct ev_source ev;    /* pidfd; fd -1 once reaped */
+    struct job *job;
+    pid_t pid;              /* -1 if the stage could not be started */
+    int wstatus;
+    bool done;
+    bool stopped;
+    bool torn_down;         /* signalled by the teardown option */
+    size_t stage;           /* the stage it is, or is a process
+                               substitution of */
+    enum proc_flow flow;
+    struct timer timeout;   /* @timeout */
+    int timeout_sig;        /* the last signal it sent, or 0 */
+    int pipe_rfd;           /* auto pipe size: its stdin pipe, or -1 */
+    int pipe_size;
+    char name[32];          /* command name, for `time` */
+    uint64_t start_ns;
+    uint64_t end_ns;        /* when it was reaped */
+    struct rusage rusage;   /* from wait4() */
+};
+
+struct job {
+    struct list_head list;
+    int id;                 /* %n */
+    unsigned long seq;      /* when it last went to the background or stopped */
+    pid_t pgid;             /* 0 until the first stage starts */
+    enum job_state state;
+    bool background;
+    bool notified;          /* the user has been told about its state */
+    int status;             /* exit status, once done */
+    int fail_status;        /* of the stage whose failure tore it down, or 0 */
+    size_t num_live;        /* live stages, +1 until it is sealed */
+    bool timed;             /* report resource usage when it is released */
+    bool limited;           /* prefixed with `limit`, likewise */
+    struct job_limit limit;
+    struct timer timeout;   /* `timeout` */
+    uint64_t kill_after_ns;
+    int timeout_sig;        /* the last signal it sent, or 0 */
+    uint64_t start_ns;
+    uint64_t end_ns;        /* when its last stage was reaped */
+
+    struct proc *procs;
+    size_t num_procs;
+    size_t cap_procs;
+    size_t launch_stage;    /* of the procs being started */
+    enum proc_flow launch_flow;
+
+    char *text;             /* command line, for `jobs` */
+    size_t cap_text;
+
+    struct termios tmodes;  /* terminal modes, saved when it stops */
+};
+
+static LIST_HEAD(jobs);
+static LIST_HEAD(job_pool);
+static unsigned long job_seq;
+
+/*
+ * Job control (process groups and the terminal) is only enabled for an
+ * interactive shell.
+ */
+static bool job_control;
+static int tty_fd = -1;
+
+/*
+ * The pipefail option: a pipeline's status is that of its last stage to
+ * fail, rather than of its last stage.  The teardown option: see
+ * job_teardown().
+ */
+static bool pipefail;
+static bool teardown;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+
+static struct ev_source sigchld_src = { .fd = -1 };
+
+/* signals the shell changes and children must get back at their defaults */
+static sigset_t child_sigdefault;
+
+
+static void
+job_text_append(struct job *job, size_t *len, const char *s)
+{
+    size_t n = strlen(s);
+
+    if (*len + n + 1 > job->cap_text) {
+        job->cap_text = 2 * (*len + n + 1);
+        job->text = mu_realloc(job->text, job->cap_text);
+    }
+    memcpy(job->text + *len, s, n + 1);
+    *len += n;
+}
+
+
+/* the job's command line, rebuilt from the parsed (unquoted) args */
+static void
+job_set_text(struct job *job, const struct pipeline *pipeline)
+{
+    const struct cmd *cmd;
+    size_t len = 0;
+    size_t i;
+
+    job_text_append(job, &len, "");
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        if (len > 0)
+            job_text_append(job, &len, " | ");
+        for (i = 0; i < cmd->num_args; i++) {
+            if (i > 0)
+                job_text_append(job, &len, " ");
+            job_text_append(job, &len, cmd->args[i]);
+        }
+    }
+}
+
+
+static void job_timeout_cb(struct timer *timer);
+
+
+static struct job *
+job_new(const struct pipeline *pipeline)
+{
+    struct job *job, *j;
+    int id = 0;
+
+    if (!list_empty(&job_pool)) {
+        job = list_first_entry(&job_pool, struct job, list);
+        list_del(&job->list);
+    } else {
+        job = mu_zalloc(sizeof(*job));
+    }
+
+    if (job->cap_procs < pipeline->num_cmds) {
+        job->cap_procs = pipeline->num_cmds;
+        job->procs = mu_reallocarray(job->procs, job->cap_procs,
+                sizeof(struct proc));
+    }
+    job->num_procs = 0;
+    job->launch_stage = 0;
+    job->launch_flow = PROC_STAGE;
+    /* held until job_seal(), so the job can't finish while being started */
+    job->num_live = 1;
+    job->pgid = 0;
+    job->state = JOB_RUNNING;
+    job->background = false;
+    job->notified = false;
+    job->status = 0;
+    job->fail_status = 0;
+    job->seq = 0;
+    job->timed = pipeline->timed;
+    job->limited = (pipeline->limit != NULL);
+    if (job->limited)
+        job_limit_start(&job->limit, pipeline->limit);
+    job->timeout_sig = 0;
+    job->start_ns = mu_now_ns();
+    if (pipeline->timeout_ns > 0) {
+        job->kill_after_ns = pipeline->kill_after_ns;
+        job->timeout.cb = job_timeout_cb;
+        timer_add(&job->timeout, job->start_ns + pipeline->timeout_ns);
+    }
+    job->end_ns = 0;
+    job_set_text(job, pipeline);
+
+    list_for_each_entry(j, &jobs, list)
+        id = j->id > id ? j->id : id;
+    job->id = id + 1;
+    list_add_tail(&job->list, &jobs);
+
+    return job;
+}
+
+
+static double
+timeval_to_sec(const struct timeval *tv)
+{
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+
+/*
+ * `time`: the pipeline's wall-clock time, then one line per stage with its
+ * resource usage as reported by wait4() (so a stage's figures include the
+ * children it waited for), then the CPU totals.
+ */
+static void
+time_report(uint64_t real_ns, const struct proc *procs, size_t num_procs)
+{
+    const struct proc *proc;
+    const struct rusage *ru;
+    double user = 0, sys = 0;
+    char pid[16];
+    size_t i;
+
+    fprintf(stderr, "%-5s %7s %9s %9s %9s %10s %7s %7s %8s %7s  %s\n",
+            "stage", "pid", "real", "user", "sys", "maxrss", "vcsw", "ivcsw",
+            "minflt", "majflt", "command");
+    for (i = 0; i < num_procs; i++) {
+        proc = &procs[i];
+        ru = &proc->rusage;
+        if (proc->pid == -1)
+            mu_strlcpy(pid, "-", sizeof(pid));
+        else
+            mu_snprintf(pid, sizeof(pid), "%" MU_PRI_pid, proc->pid);
+
+        fprintf(stderr, "%-5zu %7s %8.3fs %8.3fs %8.3fs %7ldKiB %7ld %7ld "
+                "%8ld %7ld  %s\n",
+                i + 1, pid, (double)(proc->end_ns - proc->start_ns) / 1e9,
+                timeval_to_sec(&ru->ru_utime), timeval_to_sec(&ru->ru_stime),
+                ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt,
+                ru->ru_majflt, proc->name);
+        user += timeval_to_sec(&ru->ru_utime);
+        sys += timeval_to_sec(&ru->ru_stime);
+    }
+    fprintf(stderr, "%-13s %8.3fs %8.3fs %8.3fs\n", "total",
+            (double)real_ns / 1e9, user, sys);
+}
+
+
+/*
+ * `limit`: what the whole job used, from its cgroup where it had one, or
+ * else summed from its stages' rusage (when only the biggest stage's peak
+ * memory is known).
+ */
+static void
+limit_report(const struct job_limit *jl, const struct proc *procs,
+        size_t num_procs)
+{
+    char buf[512];
+    double user = 0, sys = 0;
+    long long mem = -1, pids = -1, ooms = -1, v;
+    long maxrss = 0;
+    size_t i;
+
+    for (i = 0; i < num_procs; i++) {
+        user += timeval_to_sec(&procs[i].rusage.ru_utime);
+        sys += timeval_to_sec(&procs[i].rusage.ru_stime);
+        if (procs[i].rusage.ru_maxrss > maxrss)
+            maxrss = procs[i].rusage.ru_maxrss;
+    }
+
+    if (jl->cg_fd != -1) {
+        if (cg_read(jl->cg_fd, "cpu.stat", buf, sizeof(buf)) == 0) {
+            if ((v = cg_stat(buf, "user_usec")) != -1)
+                user = (double)v / 1e6;
+            if ((v = cg_stat(buf, "system_usec")) != -1)
+                sys = (double)v / 1e6;
+        }
+        if (cg_read(jl->cg_fd, "memory.peak", buf, sizeof(buf)) == 0)
+            mem = strtoll(buf, NULL, 10);
+        if (cg_read(jl->cg_fd, "pids.peak", buf, sizeof(buf)) == 0)
+            pids = strtoll(buf, NULL, 10);
+        if (cg_read(jl->cg_fd, "memory.events", buf, sizeof(buf)) == 0)
+            ooms = cg_stat(buf, "oom_kill");
+    }
+
+    fprintf(stderr, "limit: cpu %.3fs (user %.3fs, sys %.3fs)",
+            user + sys, user, sys);
+    if (mem != -1)
+        fprintf(stderr, ", memory peak %.1fMiB", (double)mem / (1 << 20));
+    else
+        fprintf(stderr, ", max stage RSS %.1fMiB", (double)maxrss / 1024);
+    if (pids != -1)
+        fprintf(stderr, ", pids peak %lld", pids);
+    if (ooms > 0)
+        fprintf(stderr, ", %lld OOM kill%s", ooms, ooms == 1 ? "" : "s");
+    fputc('\n', stderr);
+}
+
+
+/* drop a job that is done (or forgotten) from the table */
+static void
+job_release(struct job *job)
+{
+    size_t i;
+
+    timer_cancel(&job->timeout);
+    for (i = 0; i < job->num_procs; i++)
+        timer_cancel(&job->procs[i].timeout);
+
+    if (job->timed && job->state == JOB_DONE)
+        time_report(job->end_ns - job->start_ns, job->procs, job->num_procs);
+    if (job->limited) {
+        if (job->state == JOB_DONE)
+            limit_report(&job->limit, job->procs, job->num_procs);
+        job_limit_end(&job->limit);
+    }
+
+    list_del(&job->list);
+    list_add(&job->list, &job_pool);
+}
+
+
+static int
+wstatus_to_exit_status(int wstatus)
+{
+    if (WIFEXITED(wstatus))
+        return WEXITSTATUS(wstatus);
+    if (WIFSIGNALED(wstatus))
+        return 128 + WTERMSIG(wstatus);
+    return 0;
+}
+
+
+/* what timed out reports TIMEOUT_STATUS, or 128+9 if it had to be killed */
+static int
+timeout_exit_status(int sig)
+{
+    return sig == SIGKILL ? 128 + SIGKILL : TIMEOUT_STATUS;
+}
+
+
+static int
+proc_exit_status(const struct proc *proc)
+{
+    if (proc->timeout_sig != 0)
+        return timeout_exit_status(proc->timeout_sig);
+    return wstatus_to_exit_status(proc->wstatus);
+}
+
+
+/*
+ * A pipeline's status is that of its last stage, or with pipefail, of its
+ * last stage that failed.  Stages that were torn down don't count, and the
+ * failure that tore the pipeline down wins, as does its timeout.
+ */
+static int
+job_exit_status(const struct job *job)
+{
+    const struct proc *proc;
+    size_t i;
+    int status;
+
+    if (job->timeout_sig != 0)
+        return timeout_exit_status(job->timeout_sig);
+    if (job->fail_status != 0)
+        return job->fail_status;
+    if (!pipefail)
+        return proc_exit_status(&job->procs[job->num_procs - 1]);
+
+    for (i = job->num_procs; i > 0; i--) {
+        proc = &job->procs[i - 1];
+        status = proc_exit_status(proc);
+        if (status != 0 && !proc->torn_down)
+            return status;
+    }
+    return 0;
+}
+
+
+static void
+job_put(struct job *job)
+{
+    job->num_live--;
+    if (job->num_live == 0) {
+        timer_cancel(&job->timeout);
+        job->end_ns = mu_now_ns();
+        job->status = job_exit_status(job);
+        job->state = JOB_DONE;
+    }
+}
+
+
+static void
+proc_signal(struct proc *proc, int sig)
+{
+    if (proc->ev.fd != -1)
+        syscall(SYS_pidfd_send_signal, proc->ev.fd, sig, NULL, 0);
+    else
+        kill(proc->pid, sig);
+}
+
+
+/* SIGTERM at the deadline, then SIGKILL */
+static int
+timeout_next_sig(int sig)
+{
+    return sig == 0 ? SIGTERM : SIGKILL;
+}
+
+
+/* @timeout: the stage's deadline has passed */
+static void
+proc_timeout_cb(struct timer *timer)
+{
+    struct proc *proc = container_of(timer, struct proc, timeout);
+
+    if (proc->done)
+        return;
+
+    proc->timeout_sig = timeout_next_sig(proc->timeout_sig);
+    proc_signal(proc, proc->timeout_sig);
+    if (proc->stopped)
+        proc_signal(proc, SIGCONT);
+    if (proc->timeout_sig == SIGTERM)
+        timer_add(timer, mu_now_ns() + TIMEOUT_KILL_AFTER_DEFAULT);
+}
+
+
+static void
+proc_timeout_start(struct proc *proc, uint64_t timeout_ns)
+{
+    if (proc->done)
+        return;
+
+    proc->timeout.cb = proc_timeout_cb;
+    timer_add(&proc->timeout, proc->start_ns + timeout_ns);
+}
+
+
+/*
+ * `timeout`: the pipeline's deadline has passed, and every stage still
+ * running gets the signal -- through the job's process group, under job
+ * control, so that their children get it too.
+ */
+static void
+job_timeout_cb(struct timer *timer)
+{
+    struct job *job = container_of(timer, struct job, timeout);
+    struct proc *proc;
+    size_t i;
+
+    job->timeout_sig = timeout_next_sig(job->timeout_sig);
+    if (job_control && job->pgid > 0) {
+        kill(-job->pgid, job->timeout_sig);
+        if (job->state == JOB_STOPPED)
+            kill(-job->pgid, SIGCONT);
+    } else {
+        for (i = 0; i < job->num_procs; i++) {
+            proc = &job->procs[i];
+            if (proc->done || proc->pid <= 0)
+                continue;
+            proc_signal(proc, job->timeout_sig);
+            if (proc->stopped)
+                proc_signal(proc, SIGCONT);
+        }
+    }
+    if (job->timeout_sig == SIGTERM)
+        timer_add(timer, mu_now_ns() + job->kill_after_ns);
+}
+
+
+/*
+ * Whether `proc` writes, directly or through other stages, to the stage
+ * `of`.  The <(...)s of a stage feed it; a >(...) is fed by its stage and
+ * feeds nothing, and what runs inside one is left to its own pipes.
+ */
+static bool
+proc_upstream(const struct proc *proc, const struct proc *of)
+{
+    if (of->flow != PROC_STAGE || proc->flow == PROC_PSUB_OUT)
+        return false;
+    return proc->stage < of->stage ||
+            (proc->stage == of->stage && proc->flow == PROC_PSUB_IN);
+}
+
+
+/*
+ * The teardown option.  Stages are reaped as they exit, in any order; when
+ * one does, the stages upstream of it that are still running have no one
+ * left to write to, and get the SIGPIPE that their next write would bring.
+ * When one fails -- exits non-zero, or dies of a signal other than
+ * SIGPIPE -- all the others get SIGTERM.  So the wasted work stops now,
+ * rather than at the next write, or never.
+ */
+static void
+job_teardown(struct job *job, const struct proc *exited)
+{
+    size_t i;
+    struct proc *proc;
+    bool failed;
+    int status;
+
+    status = proc_exit_status(exited);
+    failed = (status != 0 && !exited->torn_down &&
+            !(WIFSIGNALED(exited->wstatus) &&
+                WTERMSIG(exited->wstatus) == SIGPIPE));
+    if (failed && job->fail_status == 0)
+        job->fail_status = status;
+
+    for (i = 0; i < job->num_procs; i++) {
+        proc = &job->procs[i];
+        if (proc->done || proc->pid <= 0 || proc->torn_down)
+            continue;
+        if (failed)
+            proc_signal(proc, SIGTERM);
+        else if (proc_upstream(proc, exited))
+            proc_signal(proc, SIGPIPE);
+        else
+            continue;
+        if (proc->stopped)
+            proc_signal(proc, SIGCONT);
+        proc->torn_down = true;
+    }
+}
+
+
+static void
+proc_exited(struct proc *proc, int wstatus)
+{
+    struct job *job = proc->job;
+    char args[64];
+
+    if (proc->ev.fd != -1) {
+        close(proc->ev.fd);     /* also drops it from the epoll set */
+        proc->ev.fd = -1;
+    }
+    pipe_unwatch(proc);
+    timer_cancel(&proc->timeout);
+    proc->done = true;
+    proc->stopped = false;
+    proc->wstatus = wstatus;
+    proc->end_ns = mu_now_ns();
+
+    if (trace_fd != -1 && proc->pid > 0) {
+        mu_snprintf(args, sizeof(args), "\"pid\":%" MU_PRI_pid ",\"status\":%d",
+                proc->pid, wstatus_to_exit_status(wstatus));
+        trace_span(proc->name, proc->pid, proc->start_ns, proc->end_ns, args);
+    }
+
+    if (teardown)
+        job_teardown(job, proc);
+    job_put(job);
+}
+
+
+/* all of a job's stages have been started */
+static void
+job_seal(struct job *job)
+{
+    job_put(job);
+}
+
+
+static void
+job_update_state(struct job *job)
+{
+    size_t i;
+
+    if (job->state == JOB_DONE)
+        return;
+
+    for (i = 0; i < job->num_procs; i++) {
+        if (!job->procs[i].done && !job->procs[i].stopped) {
+            job->state = JOB_RUNNING;
+            return;
+        }
+    }
+
+    if (job->state != JOB_STOPPED) {
+        job->state = JOB_STOPPED;
+        job->seq = ++job_seq;
+        job->notified = false;
+    }
+}
+
+
+static void
+proc_pidfd_cb(struct ev_source *src, uint32_t events)
+{
+    struct proc *proc = container_of(src, struct proc, ev);
+    int wstatus;
+    pid_t pid;
+
+    MU_UNUSED(events);
+
+    pid = wait4(proc->pid, &wstatus, WNOHANG, &proc->rusage);
+    if (pid == -1)
+        mu_die_errno(errno, "wait4");
+    if (pid == 0)
+        return;
+
+    proc_exited(proc, wstatus);
+}
+
+
+/*
+ * SIGCHLD arrived: look for stopped and continued processes (exits come in
+ * through the pidfds).  Processes without a pidfd, on kernels that lack
+ * pidfd_open(), are reaped here too.
+ */
+static void
+sigchld_cb(struct ev_source *src, uint32_t events)
+{
+    struct signalfd_siginfo ssi;
+    struct job *job;
+    struct proc *proc;
+    siginfo_t info;
+    int wstatus;
+    size_t i;
+
+    MU_UNUSED(events);
+
+    while (read(src->fd, &ssi, sizeof(ssi)) == sizeof(ssi))
+        ;
+
+    list_for_each_entry(job, &jobs, list) {
+        for (i = 0; i < job->num_procs; i++) {
+            proc = &job->procs[i];
+            if (proc->done)
+                continue;
+
+            if (proc->ev.fd == -1) {
+                if (wait4(proc->pid, &wstatus, WNOHANG | WUNTRACED | WCONTINUED,
+                            &proc->rusage) != proc->pid)
+                    continue;
+                if (WIFSTOPPED(wstatus))
+                    proc->stopped = true;
+                else if (WIFCONTINUED(wstatus))
+                    proc->stopped = false;
+                else
+                    proc_exited(proc, wstatus);
+                continue;
+            }
+
+            if (!job_control)
+                continue;
+
+            info.si_pid = 0;
+            if (waitid(P_PID, (id_t)proc->pid, &info,
+                        WSTOPPED | WCONTINUED | WNOHANG) == -1 ||
+                    info.si_pid == 0)
+                continue;
+
+            if (info.si_code == CLD_STOPPED) {
+                /*
+                 * A foreground stage launched by posix_spawn() can touch the
+                 * terminal before the shell has handed it over; once it
+                 * owns the terminal, just let it carry on.
+                 */
+                if (!job->background &&
+                        (info.si_status == SIGTTIN || info.si_status == SIGTTOU) &&
+                        tcgetpgrp(tty_fd) == job->pgid) {
+                    kill(proc->pid, SIGCONT);
+                    continue;
+                }
+                proc->stopped = true;
+            } else if (info.si_code == CLD_CONTINUED) {
+                proc->stopped = false;
+            }
+        }
+        job_update_state(job);
+    }
+}
+
+
+static void
+job_add_proc(struct job *job, pid_t pid, const char *name, uint64_t start_ns)
+{
+    struct proc *proc;
+    const char *slash;
+    size_t i;
+
+    if (job->num_procs == job->cap_procs) {
+        /* stages of a pipeline that is still being read; re-point the pidfds */
+        job->cap_procs = job->cap_procs > 0 ? 2 * job->cap_procs : 4;
+        job->procs = mu_reallocarray(job->procs, job->cap_procs,
+                sizeof(struct proc));
+        for (i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].ev.fd != -1)
+                ev_mod(&job->procs[i].ev, EPOLLIN);
+            timer_moved(&job->procs[i].timeout);
+        }
+    }
+
+    proc = &job->procs[job->num_procs++];
+    mu_memzero_p(proc);
+    proc->job = job;
+    proc->pid = pid;
+    proc->stage = job->launch_stage;
+    proc->flow = job->launch_flow;
+    proc->start_ns = start_ns;
+    slash = strrchr(name, '/');
+    mu_strlcpy(proc->name, slash != NULL ? slash + 1 : name, sizeof(proc->name));
+    proc->ev.fd = -1;
+    proc->ev.cb = proc_pidfd_cb;
+    proc->pipe_rfd = -1;
+
+    job->num_live++;
+    if (pid == -1) {
+        proc_exited(proc, W_EXITCODE(127, 0));
+        return;
+    }
+
+    /* a stage that starts after the pipeline failed is torn down at once */
+    if (teardown && job->fail_status != 0) {
+        proc_signal(proc, SIGTERM);
+        proc->torn_down = true;
+    }
+
+    proc->ev.fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (proc->ev.fd == -1) {
+        if (errno != ENOSYS)
+            mu_die_errno(errno, "pidfd_open");
+        return;
+    }
+    if (fcntl(proc->ev.fd, F_SETFD, FD_CLOEXEC) == -1)
+        mu_die_errno(errno, "fcntl");
+    ev_add(&proc->ev, EPOLLIN);
+}
+
+
+/*
+ * Auto pipe sizes: the shell keeps the read end of each pipe of a foreground
+ * job and, every PIPE_WATCH_INTERVAL_MS, checks how full it is.  A pipe with
+ * no room for a PIPE_BUF write has a blocked writer, so it is doubled.  The
+ * read end is closed as soon as the stage reading it is reaped, so a writer
+ * still gets SIGPIPE.
+ */
+#define PIPE_WATCH_INTERVAL_MS 10
+
+static struct ev_source pipe_watch_src = { .fd = -1 };
+static size_t pipe_num_watched;
+
+
+static void
+pipe_watch_cb(struct ev_source *src, uint32_t events)
+{
+    uint64_t expirations;
+    struct job *job;
+    struct proc *proc;
+    char args[32];
+    int queued;
+    int size;
+    size_t i;
+
+    MU_UNUSED(events);
+
+    if (read(src->fd, &expirations, sizeof(expirations)) == -1)
+        return;
+
+    list_for_each_entry(job, &jobs, list) {
+        for (i = 0; i < job->num_procs; i++) {
+            proc = &job->procs[i];
+            if (proc->pipe_rfd == -1 || proc->pipe_size >= pipe_max_size())
+                continue;
+            if (ioctl(proc->pipe_rfd, FIONREAD, &queued) == -1)
+                continue;
+            if (queued + PIPE_BUF <= proc->pipe_size)
+                continue;
+
+            size = pipe_resize(proc->pipe_rfd, 2 * (long)proc->pipe_size);
+            if (size == -1) {
+                /* don't try again */
+                proc->pipe_size = (int)pipe_max_size();
+                continue;
+            }
+            proc->pipe_size = size;
+            if (trace_fd != -1) {
+                mu_snprintf(args, sizeof(args), "\"size\":%d", size);
+                trace_instant("pipe grow", proc->pid, mu_now_ns(), args);
+            }
+        }
+    }
+}
+
+
+static void
+pipe_watch_arm(bool on)
+{
+    struct itimerspec its = { 0 };
+
+    if (on) {
+        its.it_value.tv_nsec = PIPE_WATCH_INTERVAL_MS * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    if (timerfd_settime(pipe_watch_src.fd, 0, &its, NULL) == -1)
+        mu_die_errno(errno, "timerfd_settime");
+}
+
+
+/* watch the pipe `rfd`, which feeds `proc`; the watch now owns the fd */
+static void
+pipe_watch(struct proc *proc, int rfd)
+{
+    if (pipe_watch_src.fd == -1) {
+        pipe_watch_src.fd = timerfd_create(CLOCK_MONOTONIC,
+                TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pipe_watch_src.fd == -1)
+            mu_die_errno(errno, "timerfd_create");
+        pipe_watch_src.cb = pipe_watch_cb;
+        ev_add(&pipe_watch_src, EPOLLIN);
+    }
+
+    proc->pipe_size = fcntl(rfd, F_GETPIPE_SZ);
+    if (proc->done || proc->pipe_size == -1) {
+        close(rfd);
+        return;
+    }
+
+    proc->pipe_rfd = rfd;
+    if (pipe_num_watched++ == 0)
+        pipe_watch_arm(true);
+}
+
+
+static void
+pipe_unwatch(struct proc *proc)
+{
+    if (proc->pipe_rfd == -1)
+        return;
+
+    close(proc->pipe_rfd);
+    proc->pipe_rfd = -1;
+    if (--pipe_num_watched == 0)
+        pipe_watch_arm(false);
+}
+
+
+/* stop watching a job's pipes, before it goes to the background */
+static void
+job_unwatch_pipes(struct job *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->num_procs; i++)
+        pipe_unwatch(&job->procs[i]);
+}
+
+
+static const char *
+job_state_str(const struct job *job)
+{
+    switch (job->state) {
+    case JOB_RUNNING:   return "Running";
+    case JOB_STOPPED:   return "Stopped";
+    case JOB_DONE:      return job->status ? "Exit" : "Done";
+    default:            return "?";
+    }
+}
+
+
+/* the current (+) and previous (-) jobs, by when they were last touched */
+static void
+jobs_current(struct job **cur, struct job **prev)
+{
+    struct job *job;
+
+    *cur = NULL;
+    *prev = NULL;
+    list_for_each_entry(job, &jobs, list) {
+        if (!job->background)
+            continue;
+        if (*cur == NULL || job->seq > (*cur)->seq) {
+            *prev = *cur;
+            *cur = job;
+        } else if (*prev == NULL || job->seq > (*prev)->seq) {
+            *prev = job;
+        }
+    }
+}
+
+
+static void
+job_print(const struct job *job)
+{
+    struct job *cur, *prev;
+    char state[32];
+
+    jobs_current(&cur, &prev);
+
+    if (job->state == JOB_DONE && job->status != 0)
+        mu_snprintf(state, sizeof(state), "Exit %d", job->status);
+    else
+        mu_strlcpy(state, job_state_str(job), sizeof(state));
+
+    printf("[%d]%c  %-24s%s%s\n", job->id,
+            job == cur ? '+' : (job == prev ? '-' : ' '),
+            state, job->text, job->state == JOB_RUNNING ? " &" : "");
+}
+
+
+/*
+ * Report background jobs that finished or stopped since the last prompt,
+ * and drop the finished ones from the table.  A script isn't told, so its
+ * finished jobs are kept for `wait` to collect their status, up to
+ * JOBS_MAX_DONE of them; beyond that, the oldest are dropped.
+ */
+#define JOBS_MAX_DONE 1024
+
+static void
+jobs_notify(bool verbose)
+{
+    struct job *job, *tmp;
+    size_t num_done = 0;
+
+    ev_run_once(0);
+
+    list_for_each_entry_safe(job, tmp, &jobs, list) {
+        if (!job->background || job->state == JOB_RUNNING)
+            continue;
+        if (verbose && !job->notified)
+            job_print(job);
+        job->notified = true;
+        if (job->state == JOB_DONE) {
+            if (verbose)
+                job_release(job);
+            else
+                num_done++;
+        }
+    }
+
+    list_for_each_entry_safe(job, tmp, &jobs, list) {
+        if (num_done <= JOBS_MAX_DONE)
+            break;
+        if (job->background && job->state == JOB_DONE) {
+            job_release(job);
+            num_done--;
+        }
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Wait for a foreground job to finish or stop.  Return its exit status, or
+ * 128+SIGTSTP if it stopped (it then stays in the job table).
+ */
+static int
+job_wait_fg(struct job *job)
+{
+    int status;
+
+    job->background = false;
+    if (job_control && job->pgid > 0)
+        tcsetpgrp(tty_fd, job->pgid);
+
+    while (job->state == JOB_RUNNING)
+        ev_run_once(-1);
+
+    if (job_control) {
+        tcsetpgrp(tty_fd, shell_pgid);
+        if (job->state == JOB_STOPPED)
+            tcgetattr(tty_fd, &job->tmodes);
+        tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (job->state == JOB_STOPPED) {
+        job_unwatch_pipes(job);
+        job->background = true;
+        job->notified = true;
+        putchar('\n');
+        job_print(job);
+        fflush(stdout);
+        return 128 + SIGTSTP;
+    }
+
+    status = job->status;
+    job_release(job);
+    return status;
+}
+
+
+/* wait for a background job without handing it the terminal */
+static int
+job_wait_bg(struct job *job)
+{
+    int status;
+
+    while (job->state == JOB_RUNNING)
+        ev_run_once(-1);
+
+    if (job->state == JOB_STOPPED)
+        return 128 + SIGTSTP;
+
+    status = job->status;
+    job_release(job);
+    return status;
+}
+
+
+static void
+job_continue(struct job *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->num_procs; i++)
+        job->procs[i].stopped = false;
+    job->state = JOB_RUNNING;
+
+    if (job->pgid > 0)
+        kill(-job->pgid, SIGCONT);
+}
+
+
+/*
+ * Set up SIGCHLD delivery through a signalfd and, for an interactive shell,
+ * take control of the terminal.
+ */
+static void
+jobs_init(bool interactive)
+{
+    sigset_t mask;
+
+    ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_epfd == -1)
+        mu_die_errno(errno, "epoll_create1");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        mu_die_errno(errno, "sigprocmask");
+
+    sigchld_src.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_src.fd == -1)
+        mu_die_errno(errno, "signalfd");
+    sigchld_src.cb = sigchld_cb;
+    ev_add(&sigchld_src, EPOLLIN);
+
+    sigemptyset(&child_sigdefault);
+    sigaddset(&child_sigdefault, SIGCHLD);
+
+    if (!interactive)
+        return;
+
+    tty_fd = STDIN_FILENO;
+
+    /* wait until we are in the foreground */
+    while (tcgetpgrp(tty_fd) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    sigaddset(&child_sigdefault, SIGINT);
+    sigaddset(&child_sigdefault, SIGQUIT);
+    sigaddset(&child_sigdefault, SIGTSTP);
+    sigaddset(&child_sigdefault, SIGTTIN);
+    sigaddset(&child_sigdefault, SIGTTOU);
+
+    /* a session leader is already its own group */
+    shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) == -1 && errno != EPERM)
+        mu_die_errno(errno, "setpgid");
+    shell_pgid = getpgrp();
+    tcsetpgrp(tty_fd, shell_pgid);
+    tcgetattr(tty_fd, &shell_tmodes);
+
+    job_control = true;
+}
+
+
+/*
+ * In a forked child that runs a builtin: forget the shell's jobs, and get an
+ * epoll instance of its own (the inherited one is shared with the shell).
+ */
+static void
+jobs_reset(void)
+{
+    struct job *job, *tmp;
+    size_t i;
+
+    list_for_each_entry_safe(job, tmp, &jobs, list) {
+        for (i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].ev.fd != -1)
+                close(job->procs[i].ev.fd);
+            if (job->procs[i].pipe_rfd != -1)
+                close(job->procs[i].pipe_rfd);
+        }
+        job->num_procs = 0;
+        job->timeout.idx = 0;
+        list_del(&job->list);
+        list_add(&job->list, &job_pool);
+    }
+
+    /* the timers were all the parent's jobs' */
+    if (timer_src.fd != -1) {
+        close(timer_src.fd);
+        timer_src.fd = -1;
+    }
+    timers.num = 0;
+
+    if (pipe_watch_src.fd != -1) {
+        close(pipe_watch_src.fd);
+        pipe_watch_src.fd = -1;
+    }
+    pipe_num_watched = 0;
+
+    close(ev_epfd);
+    ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_epfd == -1)
+        mu_die_errno(errno, "epoll_create1");
+    ev_add(&sigchld_src, EPOLLIN);
+
+    job_control = false;
+}
+
+
+/*
+ * Parse a job spec: %n, %% or %+ (the current job), or %- (the previous
+ * one).  With no spec, the current job.
+ */
+static struct job *
+job_find(const char *spec)
+{
+    struct job *job, *cur, *prev;
+    int id;
+
+    jobs_current(&cur, &prev);
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        return cur;
+    if (strcmp(spec, "%-") == 0)
+        return prev;
+
+    if (spec[0] != '%' || mu_str_to_int(spec + 1, 10, &id) < 0)
+        return NULL;
+
+    list_for_each_entry(job, &jobs, list) {
+        if (job->id == id && job->background)
+            return job;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Shell options: `set -o NAME[=VALUE]` (or -o on the command line) turns one
+ * on or sets it, `set +o NAME` puts it back to its default.
+ */
+struct shell_option {
+    const char *name;
+    /* `value` is NULL if none was given; print an error and return -1 */
+    int (*set)(const char *value, bool on);
+    void (*get)(char *buf, size_t size);
+};
+
+
+static int
+option_launcher_set(const char *value, bool on)
+{
+    if (!on) {
+        launcher = LAUNCHER_SPAWN;
+    } else if (value == NULL) {
+        mu_stderr("set: launcher: value expected (spawn or fork)");
+        return -1;
+    } else if (strcmp(value, "spawn") == 0) {
+        launcher = LAUNCHER_SPAWN;
+    } else if (strcmp(value, "fork") == 0) {
+        launcher = LAUNCHER_FORK;
+    } else {
+        mu_stderr("set: unknown launcher \"%s\"", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+option_launcher_get(char *buf, size_t size)
+{
+    mu_strlcpy(buf, launcher == LAUNCHER_FORK ? "fork" : "spawn", size);
+}
+
+
+/* `set -o pipesize` on its own means auto */
+static int
+option_pipesize_set(const char *value, bool on)
+{
+    if (!on) {
+        pipe_size = PIPE_SIZE_DEFAULT;
+    } else if (value == NULL) {
+        pipe_size = PIPE_SIZE_AUTO;
+    } else if (pipe_size_parse(value, &pipe_size) == -1) {
+        mu_stderr("set: invalid pipe size \"%s\"", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+option_pipesize_get(char *buf, size_t size)
+{
+    pipe_size_format(pipe_size, buf, size);
+}
+
+
+/* `set -o parsecache=0` turns the cache off */
+static int
+option_parsecache_set(const char *value, bool on)
+{
+    long size;
+
+    if (!on || (value != NULL && strcmp(value, "default") == 0)) {
+        size = PARSE_CACHE_SIZE_DEFAULT;
+    } else if (value == NULL) {
+        mu_stderr("set: parsecache: size expected");
+        return -1;
+    } else if (strcmp(value, "0") == 0) {
+        size = 0;
+    } else if (pipe_size_parse(value, &size) == -1 || size <= 0) {
+        mu_stderr("set: invalid parse cache size \"%s\"", value);
+        return -1;
+    }
+
+    parse_cache_max = size;
+    parse_cache_trim(0);
+    return 0;
+}
+
+
+static void
+option_parsecache_get(char *buf, size_t size)
+{
+    mu_snprintf(buf, size, "%ld", parse_cache_max);
+}
+
+
+/* an option that is just on (`set -o NAME`) or off (`set +o NAME`) */
+static int
+option_flag_set(const char *name, bool *flag, const char *value, bool on)
+{
+    if (value != NULL) {
+        mu_stderr("set: %s: no value expected", name);
+        return -1;
+    }
+
+    *flag = on;
+    return 0;
+}
+
+
+static int
+option_colocate_set(const char *value, bool on)
+{
+    return option_flag_set("colocate", &colocate, value, on);
+}
+
+
+static void
+option_colocate_get(char *buf, size_t size)
+{
+    mu_strlcpy(buf, colocate ? "on" : "off", size);
+}
+
+
+static int
+option_pipefail_set(const char *value, bool on)
+{
+    return option_flag_set("pipefail", &pipefail, value, on);
+}
+
+
+static void
+option_pipefail_get(char *buf, size_t size)
+{
+    mu_strlcpy(buf, pipefail ? "on" : "off", size);
+}
+
+
+static int
+option_teardown_set(const char *value, bool on)
+{
+    return option_flag_set("teardown", &teardown, value, on);
+}
+
+
+static void
+option_teardown_get(char *buf, size_t size)
+{
+    mu_strlcpy(buf, teardown ? "on" : "off", size);
+}
+
+
+static const struct shell_option shell_options[] = {
+    {"colocate", option_colocate_set, option_colocate_get},
+    {"launcher", option_launcher_set, option_launcher_get},
+    {"parsecache", option_parsecache_set, option_parsecache_get},
+    {"pipefail", option_pipefail_set, option_pipefail_get},
+    {"pipesize", option_pipesize_set, option_pipesize_get},
+    {"teardown", option_teardown_set, option_teardown_get},
+};
+
+
+/* NAME or NAME=VALUE */
+static int
+shell_option_set(const char *spec, bool on)
+{
+    const char *eq = strchr(spec, '=');
+    size_t len = eq != NULL ? (size_t)(eq - spec) : strlen(spec);
+    size_t i;
+
+    for (i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++) {
+        if (strncmp(shell_options[i].name, spec, len) == 0 &&
+                shell_options[i].name[len] == '\0')
+            return shell_options[i].set(eq != NULL ? eq + 1 : NULL, on);
+    }
+
+    mu_stderr("set: %.*s: invalid option name", (int)len, spec);
+    return -1;
+}
+
+
+/*
+ * Line editor, for an interactive shell on a terminal.  Lines are read in
+ * raw mode with the usual Emacs-style keys.  Up and Down recall the history
+ * entries that start with the text before the cursor, and Ctrl-R searches
+ * back through the entries that contain what is typed.  Every line entered
+ * is appended to the history file (see hist.h), $HISTFILE or ~/.bsh_history,
+ * which other shells may be appending to at the same time.
+ */
+#define EDIT_HISTFILE ".bsh_history"
+#define EDIT_ESC_TIMEOUT_MS 50     /* for the rest of an escape sequence */
+#define EDIT_QUERY_MAX 256
+
+enum edit_key {
+    EDIT_KEY_EOF = -1,
+    EDIT_KEY_NONE = 256,    /* nothing to do, e.g. an unknown sequence */
+    EDIT_KEY_UP,
+    EDIT_KEY_DOWN,
+    EDIT_KEY_LEFT,
+    EDIT_KEY_RIGHT,
+    EDIT_KEY_HOME,
+    EDIT_KEY_END,
+    EDIT_KEY_DELETE,
+};
+
+struct editor {
+    char *buf;              /* the line, not nul-terminated */
+    size_t len;
+    size_t cap;
+    size_t pos;             /* of the cursor */
+    const char *prompt;
+
+    size_t hist_idx;        /* entry shown, or history.num for the line
+                               being edited */
+    char *saved;            /* the line being edited, while entries are shown */
+    size_t saved_len;
+    size_t prefix_len;      /* shown entries start with this much of it */
+
+    unsigned char in[256];  /* read from the terminal, not yet used */
+    size_t in_pos;
+    size_t in_len;
+};
+
+static struct hist history = { .fd = -1 };
+static struct editor editor;
+
+
+/* open the history file, if there is one */
+static void
+history_open(void)
+{
+    const char *file = getenv("HISTFILE");
+    const char *home = getenv("HOME");
+    char path[PATH_MAX];
+    int err, n;
+
+    if (file == NULL) {
+        if (home == NULL || home[0] != '/')
+            return;
+        n = snprintf(path, sizeof(path), "%s/%s", home, EDIT_HISTFILE);
+        if (n < 0 || (size_t)n >= sizeof(path))
+            return;
+        file = path;
+    }
+    if (file[0] == '\0')
+        return;
+
+    err = hist_open(&history, file);
+    if (err < 0)
+        mu_stderr_errno(-err, "can't open history file %s", file);
+}
+
+
+static void
+edit_reserve(struct editor *ed, size_t len)
+{
+    if (len <= ed->cap)
+        return;
+    ed->cap = 2 * ed->cap > len ? 2 * ed->cap : len + 64;
+    ed->buf = mu_realloc(ed->buf, ed->cap);
+}
+
+
+/* replace the line; the cursor goes to its end */
+static void
+edit_set(struct editor *ed, const char *s, size_t len)
+{
+    edit_reserve(ed, len);
+    memcpy(ed->buf, s, len);
+    ed->len = ed->pos = len;
+}
+
+
+static void
+edit_insert(struct editor *ed, const char *s, size_t len)
+{
+    edit_reserve(ed, ed->len + len);
+    memmove(ed->buf + ed->pos + len, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, s, len);
+    ed->len += len;
+    ed->pos += len;
+}
+
+
+/* delete from `from` up to `to`; the cursor goes to `from` */
+static void
+edit_delete(struct editor *ed, size_t from, size_t to)
+{
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->pos = from;
+}
+
+
+/* the cursor moves over a UTF-8 character as a whole */
+static inline bool
+edit_is_cont(char c)
+{
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+
+static size_t
+edit_prev(const struct editor *ed, size_t pos)
+{
+    while (pos > 0 && edit_is_cont(ed->buf[--pos]))
+        ;
+    return pos;
+}
+
+
+static size_t
+edit_next(const struct editor *ed, size_t pos)
+{
+    while (pos < ed->len && edit_is_cont(ed->buf[++pos]))
+        ;
+    return pos < ed->len ? pos : ed->len;
+}
+
+
+/* redraw the prompt and the line, and put the cursor back */
+static void
+edit_refresh(const struct editor *ed)
+{
+    size_t back = 0, i;
+
+    for (i = ed->pos; i < ed->len; i++)
+        back += !edit_is_cont(ed->buf[i]);
+
+    fputs("\r", stdout);
+    fputs(ed->prompt, stdout);
+    fwrite(ed->buf, 1, ed->len, stdout);
+    fputs("\x1b[K", stdout);
+    if (back > 0)
+        printf("\x1b[%zuD", back);
+    fflush(stdout);
+}
+
+
+/* the next byte from the terminal; wait no more than timeout_ms if >= 0 */
+static int
+edit_byte(struct editor *ed, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    ssize_t n;
+
+    if (ed->in_pos == ed->in_len) {
+        if (timeout_ms < 0)
+            timer_wait_readable(STDIN_FILENO);
+        else if (poll(&pfd, 1, timeout_ms) <= 0)
+            return EDIT_KEY_NONE;
+        do {
+            n = read(STDIN_FILENO, ed->in, sizeof(ed->in));
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0)
+            return EDIT_KEY_EOF;
+        ed->in_pos = 0;
+        ed->in_len = (size_t)n;
+    }
+
+    return ed->in[ed->in_pos++];
+}
+
+
+/* the next key: a byte, or an enum edit_key for an escape sequence */
+static int
+edit_key(struct editor *ed)
+{
+    int c, num = 0;
+
+    c = edit_byte(ed, -1);
+    if (c != 0x1b)
+        return c;
+
+    /* ESC [ or ESC O, then parameters, then the final byte */
+    c = edit_byte(ed, EDIT_ESC_TIMEOUT_MS);
+    if (c != '[' && c != 'O')
+        return EDIT_KEY_NONE;
+    for (;;) {
+        c = edit_byte(ed, EDIT_ESC_TIMEOUT_MS);
+        if (c == EDIT_KEY_EOF || c == EDIT_KEY_NONE)
+            return EDIT_KEY_NONE;
+        if (c >= '0' && c <= '9' && num < 1000)
+            num = num * 10 + (c - '0');
+        else if (c >= 0x40 && c <= 0x7e)
+            break;
+        else if (c == ';')
+            /* modifiers: Ctrl-Up is still Up */
+            num = num > 0 ? num : 1000;
+    }
+
+    switch (c) {
+    case 'A':
+        return EDIT_KEY_UP;
+    case 'B':
+        return EDIT_KEY_DOWN;
+    case 'C':
+        return EDIT_KEY_RIGHT;
+    case 'D':
+        return EDIT_KEY_LEFT;
+    case 'H':
+        return EDIT_KEY_HOME;
+    case 'F':
+        return EDIT_KEY_END;
+    case '~':
+        if (num == 1 || num == 7)
+            return EDIT_KEY_HOME;
+        if (num == 4 || num == 8)
+            return EDIT_KEY_END;
+        if (num == 3)
+            return EDIT_KEY_DELETE;
+        return EDIT_KEY_NONE;
+    default:
+        return EDIT_KEY_NONE;
+    }
+}
+
+
+/*
+ * Up and Down: show the next older or newer entry that starts with what was
+ * before the cursor when the first of them was pressed, skipping those that
+ * look just like the one shown.  Down past the newest brings back the line
+ * being edited.
+ */
+static void
+edit_history(struct editor *ed, int flags)
+{
+    const char *e = NULL;
+    size_t n = 0;
+    long i;
+
+    if (ed->hist_idx == history.num) {
+        ed->saved = mu_realloc(ed->saved, ed->len + 1);
+        memcpy(ed->saved, ed->buf, ed->len);
+        ed->saved_len = ed->len;
+        ed->prefix_len = ed->pos;
+    }
+
+    i = (long)ed->hist_idx;
+    do {
+        i = hist_search(&history, ed->saved, ed->prefix_len, (size_t)i,
+                flags | HIST_PREFIX);
+        if (i != -1)
+            e = hist_get(&history, (size_t)i, &n);
+    } while (i != -1 && n == ed->len && memcmp(e, ed->buf, n) == 0);
+
+    if (i != -1) {
+        edit_set(ed, e, n);
+        ed->hist_idx = (size_t)i;
+    } else if ((flags & HIST_FORWARD) && ed->hist_idx != history.num) {
+        edit_set(ed, ed->saved, ed->saved_len);
+        ed->hist_idx = history.num;
+    }
+}
+
+
+/*
+ * Ctrl-R: search back for entries that contain the query as it is typed.
+ * Ctrl-R again goes on to an older one; Ctrl-G brings back the line as it
+ * was.  Any other key leaves the entry found on the line, and is returned
+ * for the caller to act on.
+ */
+static int
+edit_search(struct editor *ed)
+{
+    char prompt[EDIT_QUERY_MAX + 64];
+    char query[EDIT_QUERY_MAX];
+    const char *saved_prompt = ed->prompt;
+    const char *e;
+    size_t qlen = 0, from = history.num, n;
+    long match = -1, i;
+    bool failed = false;
+    int c;
+
+    ed->saved = mu_realloc(ed->saved, ed->len + 1);
+    memcpy(ed->saved, ed->buf, ed->len);
+    ed->saved_len = ed->len;
+
+    for (;;) {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+                failed ? "failed " : "", (int)qlen, query);
+        ed->prompt = prompt;
+        edit_refresh(ed);
+
+        c = edit_key(ed);
+        if (c == CTRL('R')) {
+            if (match == -1)
+                continue;
+            from = (size_t)match;
+        } else if (c == 0x7f || c == CTRL('H')) {
+            if (qlen == 0)
+                continue;
+            while (qlen > 0 && edit_is_cont(query[--qlen]))
+                ;
+            from = history.num;
+            match = -1;
+            if (qlen == 0) {
+                edit_set(ed, ed->saved, ed->saved_len);
+                failed = false;
+                continue;
+            }
+        } else if ((c >= 0x20 && c < 0x7f) || (c >= 0x80 && c < 0x100)) {
+            if (qlen == sizeof(query))
+                continue;
+            query[qlen++] = (char)c;
+            /* the entry found may still do */
+            from = match != -1 ? (size_t)match + 1 : history.num;
+        } else if (c == CTRL('G') || c == CTRL('C')) {
+            edit_set(ed, ed->saved, ed->saved_len);
+            c = EDIT_KEY_NONE;
+            break;
+        } else {
+            break;
+        }
+
+        i = hist_search(&history, query, qlen, from, 0);
+        failed = i == -1;
+        if (!failed) {
+            match = i;
+            e = hist_get(&history, (size_t)match, &n);
+            edit_set(ed, e, n);
+        }
+    }
+
+    ed->prompt = saved_prompt;
+    return c;
+}
+
+
+/*
+ * Read a line from the terminal; it ends up in editor.buf, with its newline.
+ * Return its length, or -1 at the end of input.
+ */
+static ssize_t
+edit_line(struct editor *ed, const char *prompt)
+{
+    struct termios tmodes, raw;
+    bool raw_mode;
+    char ch;
+    size_t i;
+    int c;
+
+    raw_mode = tcgetattr(STDIN_FILENO, &tmodes) == 0;
+    if (raw_mode) {
+        raw = tmodes;
+        raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ISIG | IEXTEN);
+        raw.c_iflag &= ~(tcflag_t)(IXON | ICRNL | INLCR);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    }
+
+    hist_sync(&history);
+    ed->prompt = prompt;
+    ed->len = ed->pos = 0;
+    ed->hist_idx = history.num;
+    edit_refresh(ed);
+
+    for (;;) {
+        c = edit_key(ed);
+        if (c == CTRL('R'))
+            c = edit_search(ed);
+        if (c != EDIT_KEY_UP && c != EDIT_KEY_DOWN && c != CTRL('P') &&
+                c != CTRL('N'))
+            ed->hist_idx = history.num;
+
+        switch (c) {
+        case EDIT_KEY_EOF:
+            goto eof;
+        case '\r':
+        case '\n':
+            goto done;
+        case CTRL('D'):
+            if (ed->len == 0)
+                goto eof;
+            /* fall through */
+        case EDIT_KEY_DELETE:
+            if (ed->pos < ed->len)
+                edit_delete(ed, ed->pos, edit_next(ed, ed->pos));
+            break;
+        case 0x7f:
+        case CTRL('H'):
+            if (ed->pos > 0)
+                edit_delete(ed, edit_prev(ed, ed->pos), ed->pos);
+            break;
+        case CTRL('C'):
+            /* drop the line and start another */
+            ed->pos = ed->len;
+            edit_refresh(ed);
+            fputs("^C\n", stdout);
+            ed->len = ed->pos = 0;
+            break;
+        case CTRL('A'):
+        case EDIT_KEY_HOME:
+            ed->pos = 0;
+            break;
+        case CTRL('E'):
+        case EDIT_KEY_END:
+            ed->pos = ed->len;
+            break;
+        case CTRL('B'):
+        case EDIT_KEY_LEFT:
+            ed->pos = edit_prev(ed, ed->pos);
+            break;
+        case CTRL('F'):
+        case EDIT_KEY_RIGHT:
+            ed->pos = edit_next(ed, ed->pos);
+            break;
+        case CTRL('U'):
+            edit_delete(ed, 0, ed->pos);
+            break;
+        case CTRL('K'):
+            ed->len = ed->pos;
+            break;
+        case CTRL('W'):
+            i = ed->pos;
+            while (i > 0 && ed->buf[i - 1] == ' ')
+                i--;
+            while (i > 0 && ed->buf[i - 1] != ' ')
+                i--;
+            edit_delete(ed, i, ed->pos);
+            break;
+        case CTRL('L'):
+            fputs("\x1b[H\x1b[2J", stdout);
+            break;
+        case CTRL('P'):
+        case EDIT_KEY_UP:
+            edit_history(ed, 0);
+            break;
+        case CTRL('N'):
+        case EDIT_KEY_DOWN:
+            edit_history(ed, HIST_FORWARD);
+            break;
+        default:
+            if (c == '\t' || (c >= 0x20 && c < 0x100 && c != 0x7f)) {
+                ch = (char)c;
+                edit_insert(ed, &ch, 1);
+            }
+            break;
+        }
+        edit_refresh(ed);
+    }
+
+done:
+    ed->pos = ed->len;
+    edit_refresh(ed);
+    fputs("\n", stdout);
+    fflush(stdout);
+    if (raw_mode)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &tmodes);
+
+    for (i = 0; i < ed->len && (ed->buf[i] == ' ' || ed->buf[i] == '\t'); i++)
+        ;
+    if (i < ed->len)
+        (void)hist_add(&history, ed->buf, ed->len);
+
+    edit_reserve(ed, ed->len + 1);
+    ed->buf[ed->len] = '\n';
+    return (ssize_t)ed->len + 1;
+
+eof:
+    fputs("\n", stdout);
+    fflush(stdout);
+    if (raw_mode)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &tmodes);
+    return -1;
+}
+
+
+/*
+ * Builtins run in the shell process itself.  Each returns the command's exit
+ * status.
+ */
+struct builtin {
+    const char *name;
+    int (*fn)(struct cmd *cmd);
+    bool pure;          /* only writes to stdout; $(...) runs it in place */
+};
+
+
+/*
+ * Set in a forked child that runs a builtin as a pipeline stage: its `exit`
+ * leaves only that child, and must not finish the shell's trace.
+ */
+static bool subshell;
+
+
+static void __attribute__((noreturn))
+shell_exit(int status)
+{
+    fflush(NULL);
+    if (subshell)
+        _exit(status);
+    trace_close();
+    exit(status);
+}
+
+
+/* true: do nothing, successfully */
+static int
+builtin_true(struct cmd *cmd)
+{
+    MU_UNUSED(cmd);
+    return 0;
+}
+
+
+/* false: do nothing, unsuccessfully */
+static int
+builtin_false(struct cmd *cmd)
+{
+    MU_UNUSED(cmd);
+    return 1;
+}
+
+
+/* echo [-n] [ARG...] */
+static int
+builtin_echo(struct cmd *cmd)
+{
+    bool newline = true;
+    size_t i = 1;
+
+    if (cmd->num_args > 1 && strcmp(cmd->args[1], "-n") == 0) {
+        newline = false;
+        i++;
+    }
+
+    for (; i < cmd->num_args; i++) {
+        fputs(cmd->args[i], stdout);
+        if (i + 1 < cmd->num_args)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+
+    if (ferror(stdout)) {
+        clearerr(stdout);
+        mu_stderr_errno(errno, "echo: write error");
+        return 1;
+    }
+    return 0;
+}
+
+
+/* pwd: print the shell's working directory */
+static int
+builtin_pwd(struct cmd *cmd)
+{
+    char *cwd;
+
+    MU_UNUSED(cmd);
+
+    cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        mu_stderr_errno(errno, "pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+
+    return 0;
+}
+
+
+/* cd [DIR|-]: change the shell's working directory (default: $HOME) */
+static int
+builtin_cd(struct cmd *cmd)
+{
+    const char *dir;
+    char *old, *cwd;
+    bool print = false;
+    size_t i;
+
+    if (cmd->num_args > 2) {
+        mu_stderr("cd: too many arguments");
+        return 1;
+    }
+
+    if (cmd->num_args == 1) {
+        dir = getenv("HOME");
+        if (dir == NULL) {
+            mu_stderr("cd: HOME not set");
+            return 1;
+        }
+    } else if (strcmp(cmd->args[1], "-") == 0) {
+        dir = getenv("OLDPWD");
+        if (dir == NULL) {
+            mu_stderr("cd: OLDPWD not set");
+            return 1;
+        }
+        print = true;
+    } else {
+        dir = cmd->args[1];
+    }
+
+    old = getcwd(NULL, 0);
+    if (chdir(dir) == -1) {
+        mu_stderr_errno(errno, "cd: %s", dir);
+        free(old);
+        return 1;
+    }
+
+    if (old != NULL)
+        setenv("OLDPWD", old, 1);
+    free(old);
+    cwd = getcwd(NULL, 0);
+    if (cwd != NULL) {
+        setenv("PWD", cwd, 1);
+        if (print)
+            puts(cwd);
+        free(cwd);
+    }
+
+    /* relative $PATH entries now name other directories */
+    for (i = 0; i < path_cache.num_dirs; i++) {
+        if (path_cache.dirs[i].dir[0] != '/') {
+            path_cache_clear();
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+/* exit [N]: exit the shell with status N (default: that of the last command) */
+static int
+builtin_exit(struct cmd *cmd)
+{
+    int status = last_status;
+
+    if (cmd->num_args > 2) {
+        mu_stderr("exit: too many arguments");
+        return 1;
+    }
+    if (cmd->num_args == 2 && mu_str_to_int(cmd->args[1], 10, &status) < 0) {
+        mu_stderr("exit: %s: numeric argument required", cmd->args[1]);
+        status = 2;
+    }
+
+    shell_exit(status & 0xff);
+}
+
+
+static bool
+is_var_name(const char *s, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || !(s[0] == '_' || isalpha((unsigned char)s[0])))
+        return false;
+    for (i = 1; i < len; i++) {
+        if (!(s[i] == '_' || isalnum((unsigned char)s[i])))
+            return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * export [NAME[=VALUE]...]: set environment variables, or list them.  All
+ * of the shell's variables are environment variables, so NAME alone only
+ * checks the name.
+ */
+static int
+builtin_export(struct cmd *cmd)
+{
+    const char *arg, *eq;
+    char **env;
+    char *name;
+    int status = 0;
+    size_t i, len;
+
+    if (cmd->num_args == 1) {
+        for (env = environ; *env != NULL; env++)
+            printf("export %s\n", *env);
+        return 0;
+    }
+
+    for (i = 1; i < cmd->num_args; i++) {
+        arg = cmd->args[i];
+        eq = strchr(arg, '=');
+        len = eq != NULL ? (size_t)(eq - arg) : strlen(arg);
+        if (!is_var_name(arg, len)) {
+            mu_stderr("export: `%s': not a valid identifier", arg);
+            status = 1;
+            continue;
+        }
+        if (eq == NULL)
+            continue;
+
+        name = mu_arena_strndup(cmd->arena, arg, len);
+        if (setenv(name, eq + 1, 1) == -1) {
+            mu_stderr_errno(errno, "export: %s", name);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+
+/* unset NAME...: remove environment variables */
+static int
+builtin_unset(struct cmd *cmd)
+{
+    int status = 0;
+    size_t i;
+
+    for (i = 1; i < cmd->num_args; i++) {
+        if (!is_var_name(cmd->args[i], strlen(cmd->args[i]))) {
+            mu_stderr("unset: `%s': not a valid identifier", cmd->args[i]);
+            status = 1;
+            continue;
+        }
+        unsetenv(cmd->args[i]);
+    }
+
+    return status;
+}
+
+
+/*
+ * hash [-r] [name ...]
+ *
+ * With no arguments, list the cached commands.  -r empties the cache; names
+ * are resolved and added to it.  -p shows the parse cache's counters.
+ */
+static int
+builtin_hash(struct cmd *cmd)
+{
+    struct path_entry *ent;
+    int status = 0;
+    size_t i;
+
+    if (cmd->num_args == 1) {
+        if (path_cache.num_entries == 0) {
+            puts("hash: hash table empty");
+            return 0;
+        }
+        puts("hits\tcommand");
+        for (i = 0; i < PATH_CACHE_NUM_BUCKETS; i++) {
+            list_for_each_entry(ent, &path_cache.buckets[i], list)
+                printf("%4lu\t%s\n", ent->hits, ent->path);
+        }
+        return 0;
+    }
+
+    for (i = 1; i < cmd->num_args; i++) {
+        if (strcmp(cmd->args[i], "-r") == 0) {
+            path_cache_clear();
+        } else if (strcmp(cmd->args[i], "-p") == 0) {
+            printf("parse cache: %zu lines, %zu/%ld bytes, %lu hits, "
+                    "%lu misses, %lu evictions\n", parse_cache.num_entries,
+                    parse_cache.size, parse_cache_max, parse_cache.hits,
+                    parse_cache.misses, parse_cache.evictions);
+        } else if (cmd->args[i][0] == '-') {
+            mu_stderr("hash: %s: invalid option", cmd->args[i]);
+            return 2;
+        } else {
+            ent = path_cache_lookup(cmd->args[i]);
+            if (ent == NULL) {
+                mu_stderr("hash: %s: not found", cmd->args[i]);
+                status = 1;
+            } else {
+                /* adding a name is not a use of it */
+                ent->hits--;
+            }
+        }
+    }
+
+    return status;
+}
+
+
+/* jobs: list background and stopped jobs */
+static int
+builtin_jobs(struct cmd *cmd)
+{
+    struct job *job, *tmp;
+
+    MU_UNUSED(cmd);
+
+    ev_run_once(0);
+    list_for_each_entry_safe(job, tmp, &jobs, list) {
+        if (!job->background)
+            continue;
+        job_print(job);
+        job->notified = true;
+        if (job->state == JOB_DONE)
+            job_release(job);
+    }
+
+    return 0;
+}
+
+
+/* fg [%job]: continue a job in the foreground and wait for it */
+static int
+builtin_fg(struct cmd *cmd)
+{
+    struct job *job;
+
+    if (!job_control) {
+        mu_stderr("fg: no job control");
+        return 1;
+    }
+
+    job = job_find(cmd->num_args > 1 ? cmd->args[1] : NULL);
+    if (job == NULL) {
+        mu_stderr("fg: %s: no such job", cmd->num_args > 1 ? cmd->args[1] : "current");
+        return 1;
+    }
+
+    puts(job->text);
+    fflush(stdout);
+
+    if (job->state == JOB_STOPPED) {
+        tcsetattr(tty_fd, TCSADRAIN, &job->tmodes);
+        job_continue(job);
+    }
+
+    return job_wait_fg(job);
+}
+
+
+/* bg [%job]: continue a stopped job in the background */
+static int
+builtin_bg(struct cmd *cmd)
+{
+    struct job *job;
+
+    if (!job_control) {
+        mu_stderr("bg: no job control");
+        return 1;
+    }
+
+    job = job_find(cmd->num_args > 1 ? cmd->args[1] : NULL);
+    if (job == NULL) {
+        mu_stderr("bg: %s: no such job", cmd->num_args > 1 ? cmd->args[1] : "current");
+        return 1;
+    }
+
+    if (job->state == JOB_STOPPED) {
+        job_continue(job);
+        job->seq = ++job_seq;
+    }
+    printf("[%d]+ %s &\n", job->id, job->text);
+
+    return 0;
+}
+
+
+/*
+ * wait [%job | pid ...]
+ *
+ * With no arguments, wait for every background job and return 0.
+ * Otherwise wait for each job or process in turn and return the status of
+ * the last one.
+ */
+static int
+builtin_wait(struct cmd *cmd)
+{
+    struct job *job, *tmp;
+    struct proc *proc;
+    int status = 0;
+    pid_t pid;
+    size_t i, j;
+
+    if (cmd->num_args == 1) {
+        list_for_each_entry_safe(job, tmp, &jobs, list) {
+            if (job->background && job->state != JOB_STOPPED)
+                (void)job_wait_bg(job);
+        }
+        return 0;
+    }
+
+    for (i = 1; i < cmd->num_args; i++) {
+        if (cmd->args[i][0] == '%') {
+            job = job_find(cmd->args[i]);
+            if (job == NULL) {
+                mu_stderr("wait: %s: no such job", cmd->args[i]);
+                status = 127;
+                continue;
+            }
+            status = job_wait_bg(job);
+            continue;
+        }
+
+        if (mu_str_to_int(cmd->args[i], 10, &pid) < 0) {
+            mu_stderr("wait: %s: not a pid or valid job spec", cmd->args[i]);
+            status = 2;
+            continue;
+        }
+
+        proc = NULL;
+        list_for_each_entry(job, &jobs, list) {
+            for (j = 0; j < job->num_procs; j++) {
+                if (job->background && job->procs[j].pid == pid)
+                    proc = &job->procs[j];
+            }
+        }
+        if (proc == NULL) {
+            mu_stderr("wait: pid %d is not a child of this shell", pid);
+            status = 127;
+            continue;
+        }
+
+        while (!proc->done && proc->job->state == JOB_RUNNING)
+            ev_run_once(-1);
+        status = proc->done ? proc_exit_status(proc) : 128 + SIGTSTP;
+        if (proc->job->state == JOB_DONE)
+            job_release(proc->job);
+    }
+
+    return status;
+}
+
+
+/*
+ * parallel [-j N] [-k] [--joblog FILE] [COMMAND [::: ARG ...]]
+ *
+ * Run many pipelines at once, at most N (default: the number of online
+ * CPUs) at a time.  The pipelines are either
+ *  - the ARGs themselves, with no COMMAND;
+ *  - COMMAND with each ARG substituted for {} (or appended), or
+ *  - read one per line from stdin, or, with a COMMAND and no :::, built from
+ *    ARGs read one per line from stdin.
+ *
+ * Each job's stdout is collected in memory and written out in one piece
+ * when the job finishes, so the outputs of different jobs never interleave;
+ * -k prints them in input order rather than as they finish.  --joblog
+ * writes a line per job with its sequence number, exit status, run time
+ * and command.  The exit status is the number of failed jobs, capped at 101.
+ */
+#define PAR_MAX_FAILED      101
+#define PAR_READ_SIZE       (64 * 1024)
+
+/* characters that never need quoting when COMMAND words are rejoined */
+#define PAR_SAFE_CHARS \
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_./{}=:,+@%-"
+
+struct par_output {
+    struct list_head list;
+    size_t seq;
+    char *buf;
+    size_t len;
+};
+
+struct par_slot {
+    struct ev_source out;   /* read end of the job's stdout; -1 at EOF */
+    struct job *job;        /* NULL while the slot is free */
+    struct mu_arena arena;  /* the job's command line and parsed pipeline */
+    char *text;
+    size_t seq;
+    uint64_t start_ns;
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct par {
+    struct par_slot *slots;
+    size_t num_slots;
+    bool keep_order;
+    FILE *joblog;
+
+    const char *template;   /* NULL: each input is a pipeline by itself */
+    char **args;            /* the ::: list, or NULL to read stdin */
+    size_t num_args;
+    size_t next_arg;
+    FILE *in;
+    char *line;
+    size_t line_cap;
+
+    size_t next_seq;        /* seq of the next job to start */
+    size_t flush_seq;       /* -k: seq of the next output to print */
+    struct list_head pending;   /* -k: finished outputs, by seq */
+    int num_failed;
+};
+
+
+static void
+par_out_cb(struct ev_source *src, uint32_t events)
+{
+    struct par_slot *slot = container_of(src, struct par_slot, out);
+    ssize_t n;
+
+    MU_UNUSED(events);
+
+    for (;;) {
+        if (slot->cap - slot->len < PAR_READ_SIZE) {
+            slot->cap = slot->cap ? 2 * slot->cap : 2 * PAR_READ_SIZE;
+            slot->buf = mu_realloc(slot->buf, slot->cap);
+        }
+
+        n = read(src->fd, slot->buf + slot->len, slot->cap - slot->len);
+        if (n > 0) {
+            slot->len += (size_t)n;
+        } else if (n == 0) {
+            close(src->fd);
+            src->fd = -1;
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            return;
+        } else {
+            mu_die_errno(errno, "parallel: read");
+        }
+    }
+}
+
+
+/* append `s` to `dst`, quoted so that the lexer gives it back as one word */
+static void
+par_append_quoted(struct mu_arena *arena, char **dst, size_t *len,
+        size_t *cap, const char *s)
+{
+    /* worst case: all quotes, each of which becomes '\'' */
+    size_t need = 4 * strlen(s) + 3;
+    const char *p;
+
+    if (*len + need > *cap) {
+        *dst = mu_arena_reallocarray(arena, *dst, *cap, 2 * (*len + need), 1);
+        *cap = 2 * (*len + need);
+    }
+
+    (*dst)[(*len)++] = '\'';
+    for (p = s; *p != '\0'; p++) {
+        if (*p == '\'') {
+            memcpy(*dst + *len, "'\\''", 4);
+            *len += 4;
+        } else {
+            (*dst)[(*len)++] = *p;
+        }
+    }
+    (*dst)[(*len)++] = '\'';
+    (*dst)[*len] = '\0';
+}
+
+
+/* the template with each {} replaced by `arg`, or with `arg` appended */
+static char *
+par_build(struct mu_arena *arena, const char *template, const char *arg)
+{
+    size_t cap = strlen(template) + 64;
+    size_t len = 0;
+    char *s = mu_arena_alloc(arena, cap);
+    const char *p = template, *q;
+    bool substituted = false;
+
+    for (;;) {
+        q = strstr(p, "{}");
+        if (q == NULL)
+            q = p + strlen(p);
+        if (len + (size_t)(q - p) + 2 > cap) {
+            s = mu_arena_reallocarray(arena, s, cap, 2 * (len + (size_t)(q - p) + 2), 1);
+            cap = 2 * (len + (size_t)(q - p) + 2);
+        }
+        memcpy(s + len, p, (size_t)(q - p));
+        len += (size_t)(q - p);
+        s[len] = '\0';
+        if (*q == '\0')
+            break;
+        par_append_quoted(arena, &s, &len, &cap, arg);
+        substituted = true;
+        p = q + 2;
+    }
+
+    if (!substituted) {
+        if (len + 2 > cap) {
+            s = mu_arena_reallocarray(arena, s, cap, len + 2, 1);
+            cap = len + 2;
+        }
+        s[len++] = ' ';
+        s[len] = '\0';
+        par_append_quoted(arena, &s, &len, &cap, arg);
+    }
+
+    return s;
+}
+
+
+/* the next job's command line, in `arena`, or NULL when there are no more */
+static char *
+par_next_input(struct par *par, struct mu_arena *arena)
+{
+    const char *input;
+
+    if (par->args != NULL) {
+        if (par->next_arg == par->num_args)
+            return NULL;
+        input = par->args[par->next_arg++];
+    } else {
+        do {
+            if (getline(&par->line, &par->line_cap, par->in) == -1)
+                return NULL;
+            mu_str_chomp(par->line);
+        } while (line_is_blank(par->line));
+        input = par->line;
+    }
+
+    if (par->template == NULL)
+        return mu_arena_strdup(arena, input);
+    return par_build(arena, par->template, input);
+}
+
+
+static struct job *pipeline_start(struct pipeline *pipeline);
+
+
+static void
+par_start(struct par *par, struct par_slot *slot, char *text)
+{
+    struct pipeline *pipeline;
+    int pfd[2];
+
+    slot->text = text;
+    slot->seq = par->next_seq++;
+    slot->start_ns = mu_now_ns();
+    slot->len = 0;
+
+    /* the lexer rewrites its input, and the log wants the original */
+    pipeline = pipeline_new(&slot->arena, mu_arena_strdup(&slot->arena, text));
+    if (pipeline == NULL || pipeline->num_cmds == 0) {
+        slot->job = NULL;
+        return;
+    }
+
+    if (pipe2(pfd, O_CLOEXEC) == -1)
+        mu_die_errno(errno, "pipe");
+    pipeline->out_fd = pfd[1];
+
+    slot->job = pipeline_start(pipeline);
+    close(pfd[1]);
+
+    if (fcntl(pfd[0], F_SETFL, O_NONBLOCK) == -1)
+        mu_die_errno(errno, "fcntl");
+    slot->out.fd = pfd[0];
+    slot->out.cb = par_out_cb;
+    ev_add(&slot->out, EPOLLIN);
+}
+
+
+static void
+par_flush_pending(struct par *par)
+{
+    struct par_output *out, *tmp;
+
+    list_for_each_entry_safe(out, tmp, &par->pending, list) {
+        if (out->seq != par->flush_seq)
+            break;
+        (void)mu_write_n(STDOUT_FILENO, out->buf, out->len, NULL);
+        par->flush_seq++;
+        list_del(&out->list);
+        free(out->buf);
+        free(out);
+    }
+}
+
+
+/* record a finished job (status -1: it did not parse) and free its slot */
+static void
+par_finish(struct par *par, struct par_slot *slot, int status)
+{
+    struct par_output *out, *pos;
+    double secs;
+
+    if (status == -1)
+        status = 2;
+    if (status != 0)
+        par->num_failed++;
+
+    if (par->joblog != NULL) {
+        secs = (double)(mu_now_ns() - slot->start_ns) / 1e9;
+        fprintf(par->joblog, "%zu\t%d\t%.3f\t%s\n", slot->seq + 1, status,
+                secs, slot->text);
+    }
+
+    if (!par->keep_order) {
+        (void)mu_write_n(STDOUT_FILENO, slot->buf, slot->len, NULL);
+    } else {
+        /* hand the buffer over to the pending list, in seq order */
+        out = mu_zalloc(sizeof(*out));
+        out->seq = slot->seq;
+        out->buf = slot->buf;
+        out->len = slot->len;
+        slot->buf = NULL;
+        slot->cap = 0;
+
+        list_for_each_entry_reverse(pos, &par->pending, list) {
+            if (pos->seq < out->seq)
+                break;
+        }
+        list_add(&out->list, &pos->list);
+        par_flush_pending(par);
+    }
+
+    slot->len = 0;
+    slot->job = NULL;
+    slot->text = NULL;
+}
+
+
+static int
+par_run(struct par *par)
+{
+    struct par_slot *slot;
+    bool exhausted = false;
+    size_t busy, i;
+    char *text;
+    int status;
+
+    fflush(stdout);
+
+    for (;;) {
+        busy = 0;
+        for (i = 0; i < par->num_slots; i++) {
+            slot = &par->slots[i];
+            while (slot->text == NULL && !exhausted) {
+                mu_arena_reset(&slot->arena);
+                text = par_next_input(par, &slot->arena);
+                if (text == NULL) {
+                    exhausted = true;
+                    break;
+                }
+                par_start(par, slot, text);
+                if (slot->job == NULL)
+                    par_finish(par, slot, -1);
+            }
+            if (slot->text != NULL)
+                busy++;
+        }
+
+        if (busy == 0)
+            break;
+
+        ev_run_once(-1);
+
+        for (i = 0; i < par->num_slots; i++) {
+            slot = &par->slots[i];
+            if (slot->job != NULL && slot->job->state == JOB_DONE &&
+                    slot->out.fd == -1) {
+                status = slot->job->status;
+                job_release(slot->job);
+                par_finish(par, slot, status);
+            }
+        }
+    }
+
+    return par->num_failed > PAR_MAX_FAILED ? PAR_MAX_FAILED : par->num_failed;
+}
+
+
+static int
+builtin_parallel(struct cmd *cmd)
+{
+    struct par par = { 0 };
+    const char *joblog = NULL;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int njobs = ncpu > 0 ? (unsigned int)ncpu : 1;
+    size_t i, j, cmd_start, len, cap, n;
+    char *template = NULL;
+    int status;
+
+    for (i = 1; i < cmd->num_args; i++) {
+        if (strcmp(cmd->args[i], "-k") == 0) {
+            par.keep_order = true;
+        } else if (strcmp(cmd->args[i], "-j") == 0 && i + 1 < cmd->num_args) {
+            if (mu_str_to_uint(cmd->args[++i], 10, &njobs) < 0 || njobs == 0)
+                goto bad_jobs;
+        } else if (strncmp(cmd->args[i], "-j", 2) == 0 && cmd->args[i][2]) {
+            if (mu_str_to_uint(cmd->args[i] + 2, 10, &njobs) < 0 || njobs == 0)
+                goto bad_jobs;
+        } else if (strcmp(cmd->args[i], "--joblog") == 0 &&
+                i + 1 < cmd->num_args) {
+            joblog = cmd->args[++i];
+        } else if (strcmp(cmd->args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (cmd->args[i][0] == '-' && strcmp(cmd->args[i], "-") != 0) {
+            mu_stderr("parallel: %s: invalid option", cmd->args[i]);
+            return 255;
+        } else {
+            break;
+        }
+    }
+
+    /*
+     * COMMAND words up to ':::'.  A lone word is taken as shell text; several
+     * words are joined back into a line, requoting any that need it.
+     */
+    cmd_start = i;
+    for (; i < cmd->num_args && strcmp(cmd->args[i], ":::") != 0; i++)
+        ;
+    if (i == cmd_start + 1) {
+        par.template = cmd->args[cmd_start];
+    } else if (i > cmd_start) {
+        cap = 64;
+        len = 0;
+        template = mu_arena_alloc(cmd->arena, cap);
+        template[0] = '\0';
+        for (j = cmd_start; j < i; j++) {
+            if (j > cmd_start)
+                template[len++] = ' ';
+            if (cmd->args[j][0] != '\0' &&
+                    strspn(cmd->args[j], PAR_SAFE_CHARS) == strlen(cmd->args[j])) {
+                n = strlen(cmd->args[j]);
+                if (len + n + 2 > cap) {
+                    template = mu_arena_reallocarray(cmd->arena, template,
+                            cap, 2 * (len + n + 2), 1);
+                    cap = 2 * (len + n + 2);
+                }
+                memcpy(template + len, cmd->args[j], n + 1);
+                len += n;
+            } else {
+                par_append_quoted(cmd->arena, &template, &len, &cap,
+                        cmd->args[j]);
+            }
+        }
+        par.template = template;
+    }
+    if (i < cmd->num_args) {
+        par.args = &cmd->args[i + 1];
+        par.num_args = cmd->num_args - i - 1;
+    }
+
+    if (par.args == NULL) {
+        if (cmd->in_file != NULL) {
+            par.in = fopen(cmd->in_file, "r");
+            if (par.in == NULL) {
+                mu_stderr_errno(errno, "parallel: can't open %s", cmd->in_file);
+                return 255;
+            }
+        } else {
+            /* an earlier run may have left it at EOF */
+            clearerr(stdin);
+            par.in = stdin;
+        }
+    }
+
+    if (joblog != NULL) {
+        par.joblog = fopen(joblog, "w");
+        if (par.joblog == NULL) {
+            mu_stderr_errno(errno, "parallel: can't open %s", joblog);
+            if (par.in != NULL && par.in != stdin)
+                fclose(par.in);
+            return 255;
+        }
+        fputs("Seq\tExitval\tJobRuntime\tCommand\n", par.joblog);
+    }
+
+    INIT_LIST_HEAD(&par.pending);
+    par.num_slots = njobs;
+    par.slots = mu_calloc(njobs, sizeof(struct par_slot));
+    for (i = 0; i < njobs; i++) {
+        par.slots[i].out.fd = -1;
+        mu_arena_init(&par.slots[i].arena, MU_ARENA_DEFAULT_CHUNK_SIZE);
+    }
+
+    status = par_run(&par);
+
+    for (i = 0; i < njobs; i++) {
+        mu_arena_destroy(&par.slots[i].arena);
+        free(par.slots[i].buf);
+    }
+    free(par.slots);
+    free(par.line);
+    if (par.in != NULL && par.in != stdin)
+        fclose(par.in);
+    if (par.joblog != NULL)
+        fclose(par.joblog);
+
+    return status;
+
+bad_jobs:
+    mu_stderr("parallel: invalid number of jobs");
+    return 255;
+}
+
+
+/* history [N]: list the last N history entries, or all of them */
+static int
+builtin_history(struct cmd *cmd)
+{
+    unsigned int count;
+    const char *e;
+    size_t i = 0, len;
+
+    if (cmd->num_args > 2) {
+        mu_stderr("history: too many arguments");
+        return 2;
+    }
+    hist_sync(&history);
+    if (cmd->num_args == 2) {
+        if (mu_str_to_uint(cmd->args[1], 10, &count) < 0) {
+            mu_stderr("history: %s: invalid number", cmd->args[1]);
+            return 2;
+        }
+        if (count < history.num)
+            i = history.num - count;
+    }
+
+    for (; i < history.num; i++) {
+        e = hist_get(&history, i, &len);
+        printf("%5zu  %.*s\n", i + 1, (int)len, e);
+    }
+
+    return 0;
+}
+
+
+/* set [-o|+o NAME[=VALUE]]...: change shell options, or list them */
+static int
+builtin_set(struct cmd *cmd)
+{
+    char value[64];
+    const char *arg;
+    size_t i;
+
+    if (cmd->num_args == 1 ||
+            (cmd->num_args == 2 && strcmp(cmd->args[1], "-o") == 0)) {
+        for (i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++) {
+            shell_options[i].get(value, sizeof(value));
+            printf("%-15s %s\n", shell_options[i].name, value);
+        }
+        return 0;
+    }
+
+    for (i = 1; i < cmd->num_args; i++) {
+        arg = cmd->args[i];
+        if (strcmp(arg, "-o") != 0 && strcmp(arg, "+o") != 0) {
+            mu_stderr("set: %s: invalid option", arg);
+            return 2;
+        }
+        if (++i == cmd->num_args) {
+            mu_stderr("set: %s: option name expected", arg);
+            return 2;
+        }
+        if (shell_option_set(cmd->args[i], arg[0] == '-') == -1)
+            return 2;
+    }
+
+    return 0;
+}
+
+
+static const struct builtin builtins[] = {
+    {"bg", builtin_bg, false},
+    {"cd", builtin_cd, false},
+    {"echo", builtin_echo, true},
+    {"exit", builtin_exit, false},
+    {"export", builtin_export, false},
+    {"false", builtin_false, true},
+    {"fg", builtin_fg, false},
+    {"hash", builtin_hash, false},
+    {"history", builtin_history, true},
+    {"jobs", builtin_jobs, false},
+    {"parallel", builtin_parallel, false},
+    {"pwd", builtin_pwd, true},
+    {"set", builtin_set, false},
+    {"true", builtin_true, true},
+    {"unset", builtin_unset, false},
+    {"wait", builtin_wait, false},
+};
+
+
+static const struct builtin *
+builtin_lookup(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * An fd to read a here-document or here-string from, close-on-exec.  One
+ * that fits in a pipe without blocking goes through a pipe.  A bigger one
+ * goes into a sealed memfd, which lives in memory like the pipe but can
+ * hold any size, and which the reader can seek or mmap.
+ */
+static int
+heredoc_open(const struct lex_heredoc *hd)
+{
+    const char *body = hd->body != NULL ? hd->body : "";
+    int pfd[2];
+    int fd, err;
+
+    if (hd->len <= PIPE_BUF) {
+        if (pipe2(pfd, O_CLOEXEC) == -1)
+            mu_die_errno(errno, "pipe");
+        err = mu_write_n(pfd[1], body, hd->len, NULL);
+        if (err < 0)
+            mu_die_errno(-err, "write");
+        close(pfd[1]);
+        return pfd[0];
+    }
+
+    fd = memfd_create("bsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+        mu_die_errno(errno, "memfd_create");
+    err = mu_write_n(fd, body, hd->len, NULL);
+    if (err < 0)
+        mu_die_errno(-err, "write");
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+                F_SEAL_SEAL) == -1)
+        mu_die_errno(errno, "fcntl(F_ADD_SEALS)");
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        mu_die_errno(errno, "lseek");
+
+    return fd;
+}
+
+
+/*
+ * Make `fd` one of the shell's own fds, `target`, for the length of a
+ * builtin; return a copy of the original to restore.  `fd` is closed.
+ */
+static int
+builtin_redirect_fd(int target, int fd)
+{
+    int saved;
+
+    saved = fcntl(target, F_DUPFD_CLOEXEC, 10);
+    if (saved == -1)
+        mu_die_errno(errno, "fcntl");
+    if (dup2(fd, target) == -1)
+        mu_die_errno(errno, "dup2");
+    close(fd);
+
+    return saved;
+}
+
+
+/*
+ * Redirect one of the shell's own fds to `file` for the length of a
+ * builtin; return a copy of the original to restore, or -1 on error.
+ */
+static int
+builtin_redirect(int target, const char *file, int flags)
+{
+    int fd;
+
+    fd = open(file, flags | O_CLOEXEC, 0664);
+    if (fd == -1) {
+        mu_stderr_errno(errno, "can't open %s", file);
+        return -1;
+    }
+
+    return builtin_redirect_fd(target, fd);
+}
+
+
+static void
+builtin_restore(int target, int saved)
+{
+    if (saved == -1)
+        return;
+    if (dup2(saved, target) == -1)
+        mu_die_errno(errno, "dup2");
+    close(saved);
+}
+
+
+/* run a builtin in the shell, with its redirects applied for the duration */
+static int
+builtin_run(const struct builtin *bi, struct cmd *cmd)
+{
+    int saved_in = -1, saved_out = -1;
+    int status = 1;
+
+    fflush(stdout);
+
+    if (cmd->in_file != NULL) {
+        saved_in = builtin_redirect(STDIN_FILENO, cmd->in_file, O_RDONLY);
+        if (saved_in == -1)
+            return 1;
+    } else if (cmd->in_doc != NULL) {
+        saved_in = builtin_redirect_fd(STDIN_FILENO,
+                heredoc_open(cmd->in_doc));
+    }
+    if (cmd->out_file != NULL) {
+        saved_out = builtin_redirect(STDOUT_FILENO, cmd->out_file,
+                O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC));
+        if (saved_out == -1)
+            goto out;
+    }
+
+    status = bi->fn(cmd);
+    fflush(stdout);
+
+out:
+    builtin_restore(STDOUT_FILENO, saved_out);
+    builtin_restore(STDIN_FILENO, saved_in);
+    return status;
+}
+
+
+/* `usage` += `after` - `before`, for the additive fields */
+static void
+rusage_add_delta(struct rusage *usage, const struct rusage *before,
+        const struct rusage *after)
+{
+    struct timeval tv;
+
+    timersub(&after->ru_utime, &before->ru_utime, &tv);
+    timeradd(&usage->ru_utime, &tv, &usage->ru_utime);
+    timersub(&after->ru_stime, &before->ru_stime, &tv);
+    timeradd(&usage->ru_stime, &tv, &usage->ru_stime);
+    usage->ru_nvcsw += after->ru_nvcsw - before->ru_nvcsw;
+    usage->ru_nivcsw += after->ru_nivcsw - before->ru_nivcsw;
+    usage->ru_minflt += after->ru_minflt - before->ru_minflt;
+    usage->ru_majflt += after->ru_majflt - before->ru_majflt;
+}
+
+
+/*
+ * `time` on a builtin: it runs in the shell, so report the shell's own usage
+ * over the call plus that of any children it reaped meanwhile (as with
+ * `parallel`).  The max RSS is the shell's peak so far.
+ */
+static int
+time_builtin(const struct builtin *bi, struct cmd *cmd)
+{
+    struct proc proc;
+    struct rusage self, children, after;
+    int status;
+
+    mu_memzero_p(&proc);
+    proc.pid = getpid();
+    mu_strlcpy(proc.name, cmd->args[0], sizeof(proc.name));
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    proc.start_ns = mu_now_ns();
+    status = builtin_run(bi, cmd);
+    proc.end_ns = mu_now_ns();
+
+    getrusage(RUSAGE_SELF, &after);
+    rusage_add_delta(&proc.rusage, &self, &after);
+    proc.rusage.ru_maxrss = after.ru_maxrss;
+    getrusage(RUSAGE_CHILDREN, &after);
+    rusage_add_delta(&proc.rusage, &children, &after);
+
+    time_report(proc.end_ns - proc.start_ns, &proc, 1);
+    return status;
+}
+
+
+/*
+ * Where a stage's stdin and stdout come from.  An fd of -1 means the stage
+ * inherits the shell's; a non-NULL file means the stage opens that file
+ * itself.  Pipe fds are always close-on-exec, so the stage never holds on to
+ * pipe ends other than its own stdin and stdout.
+ */
+struct stage_io {
+    int in_fd;
+    int out_fd;
+    const char *in_file;
+    const char *out_file;
+    bool append;
+    pid_t pgid;     /* process group to join: 0 for a new one, -1 for none */
+    const struct procsub *procsubs; /* their fds are passed on, too */
+    const struct stage_place *place;    /* or NULL */
+    const struct job_limit *limit;      /* ditto */
+};
+
+
+static int
+stage_out_flags(const struct stage_io *io)
+{
+    return O_WRONLY | O_CREAT | (io->append ? O_APPEND : O_TRUNC);
+}
+
+
+/*
+ * Set up a stage's process group, signals, stdin and stdout.  This runs in a
+ * forked child, or in the shell itself when it replaces itself with its
+ * final command.
+ */
+static void
+stage_setup(const struct stage_io *io)
+{
+    const struct procsub *ps;
+    sigset_t empty;
+    int sig;
+    int fd;
+
+    if (io->pgid != -1)
+        setpgid(0, io->pgid);
+
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&child_sigdefault, sig) == 1)
+            signal(sig, SIG_DFL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    for (ps = io->procsubs; ps != NULL; ps = ps->next)
+        fcntl(ps->fd, F_SETFD, 0);
+
+    if (io->place != NULL)
+        stage_place_apply(io->place);
+    if (io->limit != NULL)
+        job_limit_enter(io->limit);
+
+    if (io->in_file != NULL) {
+        fd = open(io->in_file, O_RDONLY);
+        if (fd == -1) {
+            mu_stderr_errno(errno, "can't open %s", io->in_file);
+            _exit(1);
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    } else if (io->in_fd != -1) {
+        dup2(io->in_fd, STDIN_FILENO);
+    }
+
+    if (io->out_file != NULL) {
+        fd = open(io->out_file, stage_out_flags(io), 0664);
+        if (fd == -1) {
+            mu_stderr_errno(errno, "can't open %s", io->out_file);
+            _exit(1);
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    } else if (io->out_fd != -1) {
+        dup2(io->out_fd, STDOUT_FILENO);
+    }
+}
+
+
+static void __attribute__((noreturn))
+stage_exec(const struct cmd *cmd, const struct stage_io *io)
+{
+    const struct path_entry *ent = cmd_path_lookup(cmd);
+
+    stage_setup(io);
+    trace_instant("exec", getpid(), mu_now_ns(), NULL);
+
+    if (ent != NULL) {
+        /*
+         * A #! script can't be run through a close-on-exec fd (the
+         * interpreter would find it closed), so fall back to the path.
+         */
+        if (ent->fd != -1)
+            fexecve(ent->fd, cmd->args, environ);
+        execv(ent->path, cmd->args);
+    } else {
+        execvp(cmd->args[0], cmd->args);
+    }
+    mu_stderr_errno(errno, "can't exec \"%s\"", cmd->args[0]);
+    _exit(127);
+}
+
+
+/*
+ * Launch a stage with fork(): the child sets up its own fds and execs.  The
+ * cost of fork() grows with the shell's page tables, so this is only the
+ * fallback launcher.
+ */
+static pid_t
+launch_fork(const struct cmd *cmd, const struct stage_io *io)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid == -1)
+        mu_die_errno(errno, "fork");
+
+    if (pid == 0)
+        stage_exec(cmd, io);
+
+    /* also in the parent, so that the group exists before the next stage */
+    if (io->pgid != -1)
+        setpgid(pid, io->pgid == 0 ? pid : io->pgid);
+
+    return pid;
+}
+
+
+/*
+ * Launch a stage with posix_spawn().  glibc implements it with
+ * clone(CLONE_VM|CLONE_VFORK), so the page tables are shared rather than
+ * copied and the launch cost does not depend on the shell's RSS.  The fd
+ * setup the fork launcher does in the child is expressed as file actions.
+ * posix_spawn() can't exec through an fd, so it uses the cached path.
+ *
+ * Return -1 if the stage could not be started.
+ */
+static pid_t
+launch_spawn(const struct cmd *cmd, const struct stage_io *io)
+{
+    const struct path_entry *ent = cmd_path_lookup(cmd);
+    const struct procsub *ps;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    pid_t pid;
+    int err;
+
+    err = posix_spawnattr_init(&attr);
+    if (err != 0)
+        mu_die_errno(err, "posix_spawnattr_init");
+
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &child_sigdefault);
+    if (io->pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, io->pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawn_file_actions_init(&fa);
+    if (err != 0)
+        mu_die_errno(err, "posix_spawn_file_actions_init");
+
+    if (io->in_file != NULL)
+        err = posix_spawn_file_actions_addopen(&fa, STDIN_FILENO,
+                io->in_file, O_RDONLY, 0);
+    else if (io->in_fd != -1)
+        err = posix_spawn_file_actions_adddup2(&fa, io->in_fd, STDIN_FILENO);
+    if (err != 0)
+        mu_die_errno(err, "posix_spawn_file_actions");
+
+    if (io->out_file != NULL)
+        err = posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO,
+                io->out_file, stage_out_flags(io), 0664);
+    else if (io->out_fd != -1)
+        err = posix_spawn_file_actions_adddup2(&fa, io->out_fd, STDOUT_FILENO);
+    if (err != 0)
+        mu_die_errno(err, "posix_spawn_file_actions");
+
+    /* a dup2() onto itself just clears close-on-exec */
+    for (ps = io->procsubs; ps != NULL; ps = ps->next) {
+        err = posix_spawn_file_actions_adddup2(&fa, ps->fd, ps->fd);
+        if (err != 0)
+            mu_die_errno(err, "posix_spawn_file_actions");
+    }
+
+    if (ent != NULL)
+        err = posix_spawn(&pid, ent->path, &fa, &attr, cmd->args, environ);
+    else
+        err = posix_spawnp(&pid, cmd->args[0], &fa, &attr, cmd->args, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    /*
+     * The error is the same whether a redirect or the exec failed, so that
+     * case is left to the fork launcher, which tells them apart (and exits
+     * 1 for a redirect, as a shell should).
+     */
+    if (err != 0 && (io->in_file != NULL || io->out_file != NULL))
+        return launch_fork(cmd, io);
+    if (err != 0) {
+        mu_stderr_errno(err, "can't exec \"%s\"", cmd->args[0]);
+        return -1;
+    }
+
+    return pid;
+}
+
+
+/*
+ * A builtin that is part of a larger pipeline, or runs in the background,
+ * runs in a forked copy of the shell; there is nothing to exec.
+ */
+static pid_t
+launch_builtin(const struct builtin *bi, struct cmd *cmd,
+        const struct stage_io *io)
+{
+    sigset_t mask;
+    pid_t pid;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid == -1)
+        mu_die_errno(errno, "fork");
+
+    if (pid == 0) {
+        subshell = true;
+        jobs_reset();
+        stage_setup(io);
+        /* it may still wait for children of its own (parallel) */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        /* anything buffered is the shell's input, not this stage's */
+        if (io->in_fd != -1 || io->in_file != NULL)
+            __fpurge(stdin);
+        shell_exit(bi->fn(cmd));
+    }
+
+    if (io->pgid != -1)
+        setpgid(pid, io->pgid == 0 ? pid : io->pgid);
+
+    return pid;
+}
+
+
+static pid_t
+launch(struct cmd *cmd, const struct stage_io *io)
+{
+    const struct builtin *bi = builtin_lookup(cmd->args[0]);
+
+    if (bi != NULL)
+        return launch_builtin(bi, cmd, io);
+
+    /*
+     * Only the stage itself can be placed, or join its job's cgroup, before
+     * it can start threads or processes that would escape.
+     */
+    if ((io->place != NULL && stage_place_applies(io->place)) ||
+            io->limit != NULL)
+        return launch_fork(cmd, io);
+
+    switch (launcher) {
+    case LAUNCHER_SPAWN:
+        return launch_spawn(cmd, io);
+    case LAUNCHER_FORK:
+        return launch_fork(cmd, io);
+    default:
+        mu_panic("unknown launcher %d", (int)launcher);
+    }
+}
+
+
+/* the cmd has started: the shell's copies of its pipe ends go */
+static void
+procsub_close(struct cmd *cmd)
+{
+    struct procsub *ps;
+
+    for (ps = cmd->procsubs; ps != NULL; ps = ps->next) {
+        if (ps->fd != -1) {
+            close(ps->fd);
+            ps->fd = -1;
+        }
+    }
+}
+
+
+static void procsub_launch(struct cmd *cmd, struct job *job);
+
+
+/*
+ * Start the stages of a pipeline that haven't been started yet, as procs of
+ * `job`.  Until the pipeline is `complete`, every stage parsed so far is
+ * followed by a pipe.
+ */
+static void
+pipeline_launch_stages(struct pipeline *pipeline, struct job *job,
+        bool complete)
+{
+    struct cmd * cmd;
+    struct stage_io io;
+    struct stage_place place;
+    size_t cmd_idx = 0;
+    uint64_t start_ns;
+    char args[64];
+    long size = PIPE_SIZE_DEFAULT;
+    int err;
+    int pfd[2];
+    int doc_fd;
+    bool last;
+
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        if (cmd_idx < pipeline->num_launched) {
+            cmd_idx++;
+            continue;
+        }
+        last = complete && (cmd_idx == pipeline->num_cmds - 1);
+        /* the stages of a process substitution count as its cmd's */
+        if (job->launch_flow == PROC_STAGE)
+            job->launch_stage = cmd_idx;
+
+        /* first, so that they don't inherit this stage's pipes */
+        procsub_launch(cmd, job);
+
+        /* a redirect takes precedence over the pipe */
+        doc_fd = cmd->in_doc != NULL ? heredoc_open(cmd->in_doc) : -1;
+        io.in_fd = doc_fd != -1 ? doc_fd : pipeline->launch_rfd;
+        io.in_file = cmd->in_file;
+        io.out_fd = last ? pipeline->out_fd : -1;
+        io.out_file = cmd->out_file;
+        io.append = cmd->append;
+        io.pgid = job_control ? job->pgid : -1;
+        io.procsubs = cmd->procsubs;
+        io.place = stage_place_get(pipeline, cmd, complete, &place);
+        io.limit = job->limited ? &job->limit : NULL;
+
+        /*
+         * Without job control, background jobs must not read the terminal.
+         * (A pipeline started before its `&` was read misses this.)
+         */
+        if (cmd_idx == 0 && pipeline->background && !job_control &&
+                io.in_file == NULL && doc_fd == -1)
+            io.in_file = "/dev/null";
+
+        if (!last) {
+            start_ns = mu_now_ns();
+            err = pipe2(pfd, O_CLOEXEC);
+            if (err == -1)
+                mu_die_errno(errno, "pipe");
+            io.out_fd = pfd[1];
+
+            size = cmd->pipe_size != PIPE_SIZE_UNSET ? cmd->pipe_size : pipe_size;
+            if (size > 0)
+                pipe_resize(pfd[1], size);
+            trace_span("pipe", trace_pid, start_ns, mu_now_ns(), NULL);
+        }
+
+        start_ns = mu_now_ns();
+        cmd->pid = launch(cmd, &io);
+        if (job_control && job->pgid == 0 && cmd->pid > 0)
+            job->pgid = cmd->pid;
+        if (trace_fd != -1) {
+            mu_snprintf(args, sizeof(args), "\"pid\":%" MU_PRI_pid, cmd->pid);
+            trace_span(launcher == LAUNCHER_SPAWN ? "spawn" : "fork",
+                    trace_pid, start_ns, mu_now_ns(), args);
+            if (cmd->pid > 0)
+                trace_thread_name(cmd->pid, cmd->args[0]);
+        }
+        job_add_proc(job, cmd->pid, cmd->args[0], start_ns);
+        if (io.place != NULL && io.place->timeout_ns > 0)
+            proc_timeout_start(&job->procs[job->num_procs - 1],
+                    io.place->timeout_ns);
+
+        /* parent */
+        if (doc_fd != -1)
+            close(doc_fd);
+        procsub_close(cmd);
+        if (pipeline->launch_rfd != -1 && pipeline->launch_watch &&
+                io.in_fd == pipeline->launch_rfd && io.in_file == NULL)
+            pipe_watch(&job->procs[job->num_procs - 1], pipeline->launch_rfd);
+        else if (pipeline->launch_rfd != -1)
+            close(pipeline->launch_rfd);
+        pipeline->launch_rfd = -1;
+
+        if (!last) {
+            close(pfd[1]);
+            pipeline->launch_rfd = pfd[0];
+            /* only a foreground job keeps the shell in the event loop */
+            pipeline->launch_watch = (size == PIPE_SIZE_AUTO &&
+                    !pipeline->background);
+        }
+
+        cmd_idx++;
+        pipeline->num_launched++;
+    }
+}
+
+
+/*
+ * Start the stages of a pipeline that haven't been started yet, and return
+ * its job, which is sealed once the pipeline is `complete`.
+ */
+static struct job *
+pipeline_launch(struct pipeline *pipeline, bool complete)
+{
+    struct job *job = pipeline->job;
+
+    if (job == NULL)
+        job = pipeline->job = job_new(pipeline);
+
+    pipeline_launch_stages(pipeline, job, complete);
+
+    if (complete) {
+        if (pipeline->launch_rfd != -1) {
+            /* a pipeline that ended in a syntax error */
+            close(pipeline->launch_rfd);
+            pipeline->launch_rfd = -1;
+        }
+        job_set_text(job, pipeline);
+        job_seal(job);
+    }
+
+    return job;
+}
+
+
+/*
+ * Start the process substitutions in the args of `cmd`, as procs of `job`,
+ * and point their args at the cmd's ends of their pipes.
+ */
+static void
+procsub_launch(struct cmd *cmd, struct job *job)
+{
+    enum proc_flow saved_flow = job->launch_flow;
+    struct procsub *ps;
+    char path[32];
+    int pfd[2];
+
+    for (ps = cmd->procsubs; ps != NULL; ps = ps->next) {
+        if (pipe2(pfd, O_CLOEXEC) == -1)
+            mu_die_errno(errno, "pipe");
+        if (ps->out) {
+            ps->pipeline->launch_rfd = pfd[0];
+            ps->fd = pfd[1];
+        } else {
+            ps->pipeline->out_fd = pfd[1];
+            ps->fd = pfd[0];
+        }
+
+        ps->pipeline->job = job;
+        if (saved_flow == PROC_STAGE)
+            job->launch_flow = ps->out ? PROC_PSUB_OUT : PROC_PSUB_IN;
+        pipeline_launch_stages(ps->pipeline, job, true);
+        job->launch_flow = saved_flow;
+        if (!ps->out)
+            close(pfd[1]);
+
+        mu_snprintf(path, sizeof(path), "/dev/fd/%d", ps->fd);
+        cmd->args[ps->arg_idx] = mu_arena_strdup(cmd->arena, path);
+    }
+}
+
+
+static struct job *
+pipeline_start(struct pipeline *pipeline)
+{
+    return pipeline_launch(pipeline, true);
+}
+
+
+/*
+ * Run a pipeline and return its exit status.
+ *
+ * If `exec_in_place` is set and the pipeline is a single external command,
+ * the shell execs it directly instead of launching it and waiting; this is
+ * how a script or -c string runs its final command.
+ */
+static int
+pipeline_eval(struct pipeline * pipeline, bool exec_in_place){
+    struct cmd * cmd;
+    const struct builtin *bi;
+    struct stage_io io;
+    struct job *job;
+
+    if (debug) {
+        pipeline_print(pipeline);
+        fflush(stdout);
+    }
+
+    if (noexec)
+        return 0;
+
+    if (pipeline->num_cmds == 0)
+        return last_status;
+
+    /* stages that were started while the pipeline was being read */
+    if (pipeline->job == NULL)
+        path_cache_validate();
+
+    if (pipeline->num_cmds == 1 && pipeline->job == NULL) {
+        cmd = list_first_entry(&pipeline->head, struct cmd, list);
+        bi = builtin_lookup(cmd->args[0]);
+        /*
+         * Process substitutions are reaped with a job, a placed or limited
+         * builtin must not move the shell, and one with a timeout must not
+         * kill it.
+         */
+        if (bi != NULL && !pipeline->background && cmd->procsubs == NULL &&
+                cmd->place == NULL && pipeline->limit == NULL &&
+                pipeline->timeout_ns == 0) {
+            if (pipeline->timed)
+                return time_builtin(bi, cmd);
+            return builtin_run(bi, cmd);
+        }
+
+        if (exec_in_place && !pipeline->background && !pipeline->timed &&
+                pipeline->limit == NULL && pipeline->timeout_ns == 0 &&
+                (cmd->place == NULL || cmd->place->timeout_ns == 0) &&
+                cmd->procsubs == NULL) {
+            io.in_fd = cmd->in_doc != NULL ? heredoc_open(cmd->in_doc) : -1;
+            io.in_file = cmd->in_file;
+            io.out_fd = -1;
+            io.out_file = cmd->out_file;
+            io.append = cmd->append;
+            io.pgid = -1;
+            io.procsubs = NULL;
+            io.place = cmd->place;
+            io.limit = NULL;
+            fflush(NULL);
+            stage_exec(cmd, &io);
+        }
+    }
+
+    job = pipeline_launch(pipeline, true);
+
+    if (pipeline->background) {
+        job->background = true;
+        job->seq = ++job_seq;
+        last_bg_pid = job->procs[job->num_procs - 1].pid;
+        if (job_control)
+            printf("[%d] %" MU_PRI_pid "\n", job->id, last_bg_pid);
+        return 0;
+    }
+
+    return job_wait_fg(job);
+}
+
+
+/*
+ * Run the command of a $(...) and return its output, in the arena `ctx`.
+ * The output comes back through a pipe and is read in big chunks into one
+ * growing buffer.  A lone builtin that only prints, like `echo`, doesn't
+ * fork: its stdout is a memory stream for the duration.
+ *
+ * The command runs in the shell's process group, like the shell itself, and
+ * sets $? as usual.
+ */
+#define CMDSUB_CHUNK_SIZE (64 * 1024)
+
+static const char *
+cmdsub_run(void *ctx, char *text, size_t *len)
+{
+    struct mu_arena *arena = ctx;
+    struct pipeline *pipeline;
+    const struct builtin *bi;
+    struct cmd *cmd;
+    struct job *job;
+    FILE *saved, *fp;
+    char *buf = NULL, *out;
+    size_t size = 0, cap = 0, new_cap;
+    bool saved_job_control;
+    ssize_t n;
+    int pfd[2];
+
+    *len = 0;
+    if (noexec)
+        return "";
+
+    pipeline = pipeline_new(arena, text);
+    if (pipeline == NULL) {
+        last_status = 2;
+        return "";
+    }
+    if (pipeline->num_cmds == 0)
+        return "";
+
+    cmd = list_first_entry(&pipeline->head, struct cmd, list);
+    bi = builtin_lookup(cmd->args[0]);
+    if (pipeline->num_cmds == 1 && bi != NULL && bi->pure &&
+            !pipeline->background && !pipeline->timed &&
+            pipeline->limit == NULL && pipeline->timeout_ns == 0 &&
+            cmd->place == NULL && cmd->in_file == NULL && cmd->in_doc == NULL &&
+            cmd->out_file == NULL && cmd->procsubs == NULL) {
+        fflush(stdout);
+        fp = open_memstream(&buf, &size);
+        if (fp == NULL)
+            mu_die_errno(errno, "open_memstream");
+        saved = stdout;
+        stdout = fp;
+        last_status = bi->fn(cmd);
+        stdout = saved;
+        if (fclose(fp) == EOF)
+            mu_die_errno(errno, "fclose");
+
+        out = mu_arena_alloc(arena, size + 1);
+        memcpy(out, buf, size);
+        out[size] = '\0';
+        free(buf);
+        *len = size;
+        return out;
+    }
+
+    if (pipe2(pfd, O_CLOEXEC) == -1)
+        mu_die_errno(errno, "pipe");
+    pipeline->out_fd = pfd[1];
+    pipeline->background = false;
+
+    path_cache_validate();
+    saved_job_control = job_control;
+    job_control = false;
+    job = pipeline_start(pipeline);
+    job_control = saved_job_control;
+    close(pfd[1]);
+
+    for (;;) {
+        /* doubling, so a big output is copied a bounded number of times */
+        if (cap - size < CMDSUB_CHUNK_SIZE) {
+            new_cap = cap == 0 ? CMDSUB_CHUNK_SIZE : 2 * cap;
+            buf = mu_arena_reallocarray(arena, buf, cap, new_cap, 1);
+            cap = new_cap;
+        }
+        n = read(pfd[0], buf + size, cap - size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            mu_die_errno(errno, "read");
+        if (n == 0)
+            break;
+        size += (size_t)n;
+    }
+    close(pfd[0]);
+
+    last_status = job_wait_bg(job);
+
+    *len = size;
+    return buf;
+}
+
+
+/*
+ * Fill the empty `pipeline` from the entry for `text`, if there is one, and
+ * return whether there was.
+ */
+static bool
+parse_cache_get(struct pipeline *pipeline, const char *text, size_t len)
+{
+    struct parse_entry *ent;
+    struct list_head *bucket;
+    struct cmd *cmd;
+    uint64_t hash;
+    size_t i = 0;
+
+    hash = mu_hash_fnv1a(text, len);
+    bucket = &parse_cache.buckets[hash % PARSE_CACHE_NUM_BUCKETS];
+    list_for_each_entry(ent, bucket, list) {
+        if (ent->hash == hash && ent->text_len == len &&
+                memcmp(ent->text, text, len) == 0)
+            goto found;
+    }
+    parse_cache.misses++;
+    return false;
+
+found:
+    parse_cache.hits++;
+    list_move(&ent->lru, &parse_cache.lru);
+
+    flat_read(ent->flat, pipeline);
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        cmd->path = ent->paths[i].ent;
+        cmd->path_gen = ent->paths[i].gen;
+        i++;
+    }
+
+    return true;
+}
+
+
+/* remember the pipeline that `text` parsed into */
+static void
+parse_cache_put(const struct pipeline *pipeline, const char *text, size_t len)
+{
+    struct parse_entry *ent;
+    struct parse_path *path;
+    const struct cmd *cmd;
+    size_t flat_len, size;
+
+    flat_len = flat_size(pipeline);
+    if (flat_len == 0)
+        return;
+    size = sizeof(*ent) + pipeline->num_cmds * sizeof(*path) + flat_len +
+            len;
+    if (size > (size_t)parse_cache_max)
+        return;
+    parse_cache_trim(size);
+
+    ent = mu_zalloc(size);
+    ent->hash = mu_hash_fnv1a(text, len);
+    ent->size = size;
+    ent->paths = (struct parse_path *)(ent + 1);
+    ent->flat = (struct flat_pipeline *)(ent->paths + pipeline->num_cmds);
+    flat_write(pipeline, ent->flat);
+    ent->text = memcpy((char *)ent->flat + flat_len, text, len);
+    ent->text_len = len;
+
+    path = ent->paths;
+    list_for_each_entry(cmd, &pipeline->head, list) {
+        if (builtin_lookup(cmd->args[0]) == NULL) {
+            path->ent = path_cache_lookup(cmd->args[0]);
+            path->gen = path_cache.generation;
+            /* resolving a name is not a use of it */
+            if (path->ent != NULL)
+                path->ent->hits--;
+        }
+        path++;
+    }
+
+    list_add(&ent->list,
+            &parse_cache.buckets[ent->hash % PARSE_CACHE_NUM_BUCKETS]);
+    list_add(&ent->lru, &parse_cache.lru);
+    parse_cache.num_entries++;
+    parse_cache.size += size;
+}
+
+
+/*
+ * Input is read in chunks and split into commands by a scanner that tracks
+ * quoting, so a command can be any length and can span lines: a
+ * backslash-newline, or a pipe at the end of a line, continues it.  The
+ * scanner also finds where each stage of a pipeline ends, so when the rest
+ * of a long pipeline has yet to be read, the stages before it are parsed
+ * and started already.
+ *
+ * A here-document's body is part of the command that introduces it, so a
+ * pipeline with one is not started until its bodies have been read.
+ *
+ * Scripts and -c strings are read ahead past blank lines and comments, so
+ * that the shell knows when it has reached its final command.  Interactive
+ * input can't be read ahead.
+ */
+#define INPUT_CHUNK_SIZE (64 * 1024)
+#define INPUT_PROMPT "> "
+#define INPUT_PROMPT2 "... "
+
+enum input_state {
+    INPUT_PLAIN,
+    INPUT_SQUOTE,
+    INPUT_DQUOTE,
+    INPUT_COMMENT,
+    INPUT_HEREDOC,
+};
+
+enum input_scan {
+    INPUT_MORE,         /* the command goes on past what has been read */
+    INPUT_STAGE,        /* a stage ends, just after a pipe operator */
+    INPUT_END,          /* the command ends, at a newline */
+};
+
+struct input_doc {
+    char *delim;
+    bool strip_tabs;
+};
+
+struct input {
+    int fd;                 /* -1 once the input is exhausted */
+    bool lookahead;
+    bool interactive;       /* prompt for continuation lines */
+    bool edit;              /* read lines through the line editor */
+
+    char *buf;              /* nul-terminated */
+    size_t len;
+    size_t cap;
+
+    size_t start;           /* where the unparsed part of the command starts */
+    size_t scan;            /* how far the scanner has got */
+    size_t stage_end;       /* end of the last whole stage scanned, or 0 */
+    enum input_state state;
+    bool after_pipe;        /* nothing but blanks since a pipe */
+    int paren_depth;        /* inside process or command substitutions */
+
+    struct input_doc *docs; /* here-documents of the command */
+    size_t num_docs;
+    size_t cap_docs;
+    size_t doc_idx;         /* the one whose body is being read */
+
+    /* a compiled script, read instead of the text: see image_open() */
+    char *image;
+    size_t image_len;
+    size_t image_pos;       /* of the next record */
+    bool image_mapped;      /* else malloc'd */
+};
+
+
+static void
+input_init(struct input *in, int fd, const char *text)
+{
+    mu_memzero_p(in);
+    in->fd = fd;
+    if (text != NULL) {
+        in->len = strlen(text);
+        in->cap = in->len + 1;
+        in->buf = mu_strdup(text);
+    } else {
+        in->cap = INPUT_CHUNK_SIZE;
+        in->buf = mu_mallocarray(in->cap, 1);
+        in->buf[0] = '\0';
+    }
+}
+
+
+/* read another chunk; return false at end of input */
+static bool
+input_fill(struct input *in)
+{
+    const char *prompt;
+    ssize_t n;
+
+    if (in->fd == -1)
+        return false;
+    prompt = in->len > in->start ? INPUT_PROMPT2 : INPUT_PROMPT;
+
+    /* drop what has been parsed */
+    if (in->start > 0) {
+        memmove(in->buf, in->buf + in->start, in->len - in->start + 1);
+        in->len -= in->start;
+        in->scan -= in->start;
+        in->stage_end -= in->stage_end > 0 ? in->start : 0;
+        in->start = 0;
+    }
+    if (in->cap - in->len < INPUT_CHUNK_SIZE / 2) {
+        in->cap = 2 * in->cap > in->len + INPUT_CHUNK_SIZE ?
+                2 * in->cap : in->len + INPUT_CHUNK_SIZE;
+        in->buf = mu_realloc(in->buf, in->cap);
+    }
+
+    if (in->edit) {
+        n = edit_line(&editor, prompt);
+        if (n > 0 && in->cap - in->len <= (size_t)n) {
+            in->cap = in->len + (size_t)n + INPUT_CHUNK_SIZE;
+            in->buf = mu_realloc(in->buf, in->cap);
+        }
+        if (n > 0)
+            memcpy(in->buf + in->len, editor.buf, (size_t)n);
+    } else {
+        timer_wait_readable(in->fd);
+        do {
+            n = read(in->fd, in->buf + in->len, in->cap - in->len - 1);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1)
+            mu_stderr_errno(errno, "read");
+    }
+    if (n <= 0) {
+        if (in->fd != STDIN_FILENO)
+            close(in->fd);
+        in->fd = -1;
+        return false;
+    }
+
+    in->len += (size_t)n;
+    in->buf[in->len] = '\0';
+    return true;
+}
+
+
+static void
+input_docs_clear(struct input *in)
+{
+    size_t i;
+
+    for (i = 0; i < in->num_docs; i++)
+        free(in->docs[i].delim);
+    in->num_docs = 0;
+    in->doc_idx = 0;
+}
+
+
+/*
+ * `p` is just after a `<<`: note the here-document's delimiter, so that its
+ * body can be found after the line.  Return false if the delimiter word
+ * runs past what has been read; otherwise set *end to where it ends.
+ */
+static bool
+input_doc_add(struct input *in, size_t p, size_t *end)
+{
+    struct input_doc doc = { 0 };
+    char *buf = in->buf;
+    size_t n = 0;
+    char quote = '\0';
+    bool quoted = false;
+
+    if (buf[p] == '-') {
+        doc.strip_tabs = true;
+        p++;
+    }
+    p += strspn(buf + p, " \t");
+
+    /* the delimiter is unquoted, but nothing in it is expanded */
+    doc.delim = mu_mallocarray(in->len - p + 1, 1);
+    for (; p < in->len; p++) {
+        if (quote != '\0') {
+            if (buf[p] == quote)
+                quote = '\0';
+            else
+                doc.delim[n++] = buf[p];
+        } else if (buf[p] == '\'' || buf[p] == '"') {
+            quote = buf[p];
+            quoted = true;
+        } else if (buf[p] == '\\') {
+            if (p + 1 == in->len)
+                break;
+            doc.delim[n++] = buf[++p];
+            quoted = true;
+        } else if (strchr(" \t\n|&<>", buf[p]) != NULL) {
+            break;
+        } else {
+            doc.delim[n++] = buf[p];
+        }
+    }
+    if (p == in->len || quote != '\0' || buf[p] == '\\') {
+        free(doc.delim);
+        return false;
+    }
+    *end = p;
+
+    /* no word: a syntax error, for the parser to report */
+    if (n == 0 && !quoted) {
+        free(doc.delim);
+        return true;
+    }
+
+    doc.delim[n] = '\0';
+    if (in->num_docs == in->cap_docs) {
+        in->cap_docs = in->cap_docs > 0 ? 2 * in->cap_docs : 4;
+        in->docs = mu_reallocarray(in->docs, in->cap_docs, sizeof(doc));
+    }
+    in->docs[in->num_docs++] = doc;
+    return true;
+}
+
+
+/*
+ * Is the line at `p`, which ends at `nl`, the delimiter of the here-document
+ * being read?
+ */
+static bool
+input_doc_end(const struct input *in, size_t p, size_t nl)
+{
+    const struct input_doc *doc = &in->docs[in->doc_idx];
+
+    if (doc->strip_tabs)
+        p += strspn(in->buf + p, "\t");
+    return nl - p == strlen(doc->delim) &&
+            memcmp(in->buf + p, doc->delim, nl - p) == 0;
+}
+
+
+/* can a '#' at `p` start a comment? */
+static bool
+input_word_start(const struct input *in, size_t p)
+{
+    return p == in->start || strchr(" \t\n|&<>", in->buf[p - 1]) != NULL;
+}
+
+
+/*
+ * Scan on from in->scan.  On INPUT_STAGE and INPUT_END, *end is where the
+ * stage or command ends.
+ */
+static enum input_scan
+input_scan(struct input *in, size_t *end)
+{
+    char *buf = in->buf;
+    size_t len = in->len;
+    size_t p = in->scan;
+    char *q;
+
+    while (p < len) {
+        switch (in->state) {
+        case INPUT_SQUOTE:
+            q = memchr(buf + p, '\'', len - p);
+            p = q != NULL ? (size_t)(q - buf) + 1 : len;
+            if (q != NULL)
+                in->state = INPUT_PLAIN;
+            break;
+
+        case INPUT_DQUOTE:
+            p += strcspn(buf + p, "\"\\");
+            if (p >= len)
+                break;
+            if (buf[p] == '\0') {
+                p++;
+            } else if (buf[p] == '"') {
+                in->state = INPUT_PLAIN;
+                p++;
+            } else {
+                if (p + 1 == len)
+                    goto more;
+                p += 2;
+            }
+            break;
+
+        case INPUT_COMMENT:
+            q = memchr(buf + p, '\n', len - p);
+            p = q != NULL ? (size_t)(q - buf) : len;
+            if (q != NULL)
+                in->state = INPUT_PLAIN;
+            break;
+
+        case INPUT_HEREDOC:
+            /* whole lines, up to the delimiter of each document in turn */
+            q = memchr(buf + p, '\n', len - p);
+            if (q == NULL)
+                goto more;
+            if (input_doc_end(in, p, (size_t)(q - buf)))
+                in->doc_idx++;
+            p = (size_t)(q - buf) + 1;
+            if (in->doc_idx == in->num_docs) {
+                in->state = INPUT_PLAIN;
+                *end = p - 1;
+                in->scan = p;
+                return INPUT_END;
+            }
+            break;
+
+        case INPUT_PLAIN:
+            if (in->after_pipe) {
+                /* a pipe at the end of a line continues the command */
+                if (buf[p] == ' ' || buf[p] == '\t' || buf[p] == '\n') {
+                    p++;
+                    break;
+                }
+                if (buf[p] == '\\' && p + 1 == len)
+                    goto more;
+                if (buf[p] == '\\' && buf[p + 1] == '\n') {
+                    p += 2;
+                    break;
+                }
+                in->after_pipe = false;
+            }
+
+            p += strcspn(buf + p, "|'\"\\\n#<>()");
+            if (p >= len)
+                break;
+
+            switch (buf[p]) {
+            case '\'':
+                in->state = INPUT_SQUOTE;
+                p++;
+                break;
+            case '"':
+                in->state = INPUT_DQUOTE;
+                p++;
+                break;
+            case '\\':
+                if (p + 1 == len)
+                    goto more;
+                p += 2;
+                break;
+            case '#':
+                if (input_word_start(in, p))
+                    in->state = INPUT_COMMENT;
+                p++;
+                break;
+            case '(':
+                /*
+                 * a process or command substitution can hold pipes and
+                 * newlines
+                 */
+                if (in->paren_depth > 0 || (p > in->start &&
+                            (buf[p - 1] == '<' || buf[p - 1] == '>' ||
+                             buf[p - 1] == '$')))
+                    in->paren_depth++;
+                p++;
+                break;
+            case ')':
+                if (in->paren_depth > 0)
+                    in->paren_depth--;
+                p++;
+                break;
+            case '>':
+                p++;
+                break;
+            case '|':
+                if (in->paren_depth > 0) {
+                    p++;
+                    break;
+                }
+                /* the size in `|[SIZE]` belongs to the pipe */
+                if (p + 1 == len)
+                    goto more;
+                if (buf[p + 1] == '[') {
+                    for (q = buf + p + 2; q < buf + len &&
+                            isalnum((unsigned char)*q); q++)
+                        ;
+                    if (q == buf + len)
+                        goto more;
+                    if (*q == ']' && lex_pipe_arg_ok(buf + p + 2,
+                                (size_t)(q - buf) - p - 2))
+                        p = (size_t)(q - buf);
+                }
+                p++;
+                in->after_pipe = true;
+                in->scan = *end = p;
+                return INPUT_STAGE;
+            case '<':
+                if (p + 1 == len || (buf[p + 1] == '<' && p + 2 == len))
+                    goto more;
+                if (buf[p + 1] == '(') {
+                    p++;
+                    break;
+                }
+                if (buf[p + 1] != '<' || buf[p + 2] == '<') {
+                    p += buf[p + 1] == '<' ? 3 : 1;
+                    break;
+                }
+                if (!input_doc_add(in, p + 2, &p))
+                    goto more;
+                break;
+            case '\n':
+                if (in->paren_depth > 0) {
+                    p++;
+                    break;
+                }
+                if (in->doc_idx < in->num_docs) {
+                    in->state = INPUT_HEREDOC;
+                    p++;
+                    break;
+                }
+                *end = p;
+                in->scan = p + 1;
+                return INPUT_END;
+            default:
+                /* a nul byte in the input */
+                p++;
+                break;
+            }
+            break;
+        }
+    }
+
+more:
+    in->scan = p;
+    return INPUT_MORE;
+}
+
+
+/* get ready to scan a command */
+static void
+input_begin(struct input *in)
+{
+    in->state = INPUT_PLAIN;
+    in->after_pipe = false;
+    in->paren_depth = 0;
+    in->stage_end = 0;
+    input_docs_clear(in);
+}
+
+
+/* skip blank lines and comments; return true if there is no other command */
+static bool
+input_at_end(struct input *in)
+{
+    size_t p;
+    char *nl;
+
+    for (;;) {
+        p = in->start + strspn(in->buf + in->start, " \t\n");
+        if (p < in->len && in->buf[p] != '#') {
+            in->start = in->scan = p;
+            return false;
+        }
+        if (p < in->len && (nl = strchr(in->buf + p, '\n')) != NULL) {
+            in->start = in->scan = (size_t)(nl - in->buf) + 1;
+            continue;
+        }
+        if (p == in->len)
+            in->start = in->scan = p;
+        if (!input_fill(in))
+            return true;
+    }
+}
+
 
-#include "list.h"
-#include "mu.h"
+/*
+ * Copy in->buf[in->start, end) to the arena, and parse it.  A whole command
+ * is looked up in the parse cache first.
+ */
+static int
+input_parse(struct input *in, struct pipeline *pipeline, size_t end,
+        bool final)
+{
+    const char *orig = in->buf + in->start;
+    size_t len = end - in->start;
+    bool cache = final && pipeline->num_cmds == 0 &&
+            parse_cache_text_ok(orig, len);
+    bool hit = false;
+    uint64_t start_ns = mu_now_ns();
+    char args[TRACE_ARGS_SIZE];
+    char *text;
+    int ret;
 
+    in->start = end;
 
-#define CMD_INITIAL_CAP_ARGS 8
+    if (cache && parse_cache_get(pipeline, orig, len)) {
+        hit = true;
+        ret = 0;
+        goto out;
+    }
 
-#define USAGE \
-    "Usage: bsh [-h]\n" \
-    "\n" \
-    "optional arguments\n" \
-    "   -h, --help\n" \
-    "       Show usage statement and exit."
+    text = mu_arena_strndup(pipeline->arena, orig, len);
+    ret = pipeline_parse(pipeline, text, final);
+    if (cache && ret == 0)
+        parse_cache_put(pipeline, orig, len);
 
-struct cmd {
-    struct list_head list;
+out:
+    if (trace_fd != -1) {
+        /* the lexer rewrote its copy of the text, but not the original */
+        mu_strlcpy(args, "\"text\":\"", sizeof(args));
+        trace_json_str(args + strlen(args), sizeof(args) - strlen(args) - 16,
+                mu_arena_strndup(pipeline->arena, orig,
+                    MU_MIN(len, (size_t)TRACE_STR_MAX)));
+        mu_strlcat(args, hit ? "\",\"cached\":true" : "\"", sizeof(args));
+        trace_span("parse", trace_pid, start_ns, mu_now_ns(), args);
+    }
+    return ret;
+}
 
-    char **args;
-    size_t num_args;
-    size_t cap_args;
 
-    pid_t pid;
+/*
+ * A pipeline with a syntax error after some of its stages were started: let
+ * them run down (the last one loses its reader) and reap them.
+ */
+static void
+pipeline_abort(struct pipeline *pipeline)
+{
+    if (pipeline->job == NULL)
+        return;
+
+    if (pipeline->launch_rfd != -1) {
+        close(pipeline->launch_rfd);
+        pipeline->launch_rfd = -1;
+    }
+    job_set_text(pipeline->job, pipeline);
+    job_seal(pipeline->job);
+    (void)job_wait_fg(pipeline->job);
+}
+
+
+/*
+ * Compiled scripts.  The first time a script is run, it is read whole, split
+ * into commands, and each command is parsed ahead of time and laid out flat;
+ * the resulting image is saved in $XDG_CACHE_HOME/bsh (or ~/.cache/bsh),
+ * under a hash of the script's path.  Later runs mmap the image, as long as
+ * the script's inode, size and mtime still match, and copy each pipeline
+ * straight out of it: the script is neither read nor parsed again.
+ *
+ * A command whose words depend on when it runs (one with a '$'), or that
+ * can't be laid out flat or doesn't parse, is kept as text instead, and is
+ * parsed when its turn comes, as usual.
+ *
+ * The image is a header, the script's path, and one record per command, each
+ * 8-byte aligned so that it can be used in place.
+ */
+#define IMAGE_MAGIC "bshimg01"  /* change the digits with the layout */
+#define IMAGE_ALIGN 8
+
+struct image_header {
+    char magic[8];
+    uint64_t size;          /* of the image */
+    uint64_t src_dev;
+    uint64_t src_ino;
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint32_t path_len;      /* the path follows, nul-terminated */
+    uint32_t num_recs;
 };
 
-struct pipeline {
-    struct list_head head;  /* cmds */
-    size_t num_cmds;
-    char *in_file;
-    char *out_file;
-    bool append;
+enum image_rec_type {
+    IMAGE_FLAT,             /* a flat pipeline follows */
+    IMAGE_TEXT,             /* the command's text follows, nul-terminated */
 };
 
+struct image_rec {
+    uint32_t size;          /* of the record, padding included */
+    uint32_t type;
+};
 
-static struct cmd *
-cmd_new(void)
-{
-    MU_NEW(cmd, cmd);
-    size_t i;
+struct image_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
 
-    cmd->cap_args = CMD_INITIAL_CAP_ARGS;
-    cmd->args = mu_mallocarray(cmd->cap_args, sizeof(char *));
 
-    for (i = 0; i < cmd->cap_args; i++)
-        cmd->args[i] = NULL;
+/* append `n` zeroed bytes, padded for alignment; return where they start */
+static void *
+image_append(struct image_buf *img, size_t n)
+{
+    size_t off = img->len;
+
+    n = (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+    if (img->cap - img->len < n) {
+        img->cap = 2 * img->cap > img->len + n ?
+                2 * img->cap : img->len + n + INPUT_CHUNK_SIZE;
+        img->data = mu_realloc(img->data, img->cap);
+    }
+    mu_memzero(img->data + off, n);
+    img->len += n;
 
-    return cmd;
+    return img->data + off;
 }
 
 
+/* append a record for the command `text` */
 static void
-cmd_push_arg(struct cmd *cmd, const char *arg)
+image_add_cmd(struct image_buf *img, struct mu_arena *arena, const char *text,
+        size_t len)
 {
-    if (cmd->num_args == cmd->cap_args) {
-        cmd->args = mu_reallocarray(cmd->args, cmd->cap_args * 2, sizeof(char *));
-        cmd->cap_args *= 2;
+    struct pipeline *pipeline = NULL;
+    struct image_rec *rec;
+    size_t flat_len = 0, off = img->len;
+
+    /* without a '$', a command parses the same way every time */
+    if (memchr(text, '$', len) == NULL) {
+        pipeline = pipeline_new(arena, mu_arena_strndup(arena, text, len));
+        if (pipeline != NULL)
+            flat_len = flat_size(pipeline);
     }
 
-    cmd->args[cmd->num_args] = mu_strdup(arg);
-    cmd->num_args += 1;
+    if (flat_len > 0) {
+        rec = image_append(img, sizeof(*rec) + flat_len);
+        rec->type = IMAGE_FLAT;
+        flat_write(pipeline, (struct flat_pipeline *)(rec + 1));
+    } else {
+        rec = image_append(img, sizeof(*rec) + len + 1);
+        rec->type = IMAGE_TEXT;
+        memcpy(rec + 1, text, len);
+    }
+    rec->size = (uint32_t)(img->len - off);
 }
 
 
+/*
+ * Compile the whole script in in->buf.  Syntax errors are left for when the
+ * commands run, so the parser is kept quiet meanwhile.
+ */
 static void
-cmd_pop_arg(struct cmd *cmd)
+image_compile(struct input *in, struct image_buf *img, const char *path,
+        const struct stat *st)
+{
+    struct image_header *hdr;
+    struct mu_arena arena;
+    enum input_scan scan;
+    FILE *saved, *null;
+    size_t path_len = strlen(path);
+    size_t end, num_recs = 0;
+
+    hdr = image_append(img, sizeof(*hdr));
+    memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->src_dev = st->st_dev;
+    hdr->src_ino = st->st_ino;
+    hdr->src_size = (uint64_t)st->st_size;
+    hdr->src_mtime_sec = st->st_mtim.tv_sec;
+    hdr->src_mtime_nsec = st->st_mtim.tv_nsec;
+    hdr->path_len = (uint32_t)path_len;
+    /* hdr moves as the image grows */
+    memcpy(image_append(img, path_len + 1), path, path_len);
+
+    null = fopen("/dev/null", "w");
+    if (null == NULL)
+        mu_die_errno(errno, "can't open /dev/null");
+    saved = stderr;
+    stderr = null;
+    mu_arena_init(&arena, MU_ARENA_DEFAULT_CHUNK_SIZE);
+
+    while (!input_at_end(in)) {
+        input_begin(in);
+        do {
+            scan = input_scan(in, &end);
+        } while (scan == INPUT_STAGE);
+        if (scan == INPUT_MORE)
+            end = in->scan = in->len;
+
+        image_add_cmd(img, &arena, in->buf + in->start, end - in->start);
+        in->start = in->scan;
+        num_recs++;
+        mu_arena_reset(&arena);
+    }
+
+    mu_arena_destroy(&arena);
+    stderr = saved;
+    fclose(null);
+
+    hdr = (struct image_header *)img->data;
+    hdr->size = img->len;
+    hdr->num_recs = (uint32_t)num_recs;
+}
+
+
+/* $XDG_CACHE_HOME/bsh or ~/.cache/bsh, created if need be */
+static bool
+image_dir(char *dir, size_t size)
 {
-    assert(cmd->num_args > 0);
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
 
-    free(cmd->args[cmd->num_args - 1]);
-    cmd->args[cmd->num_args - 1] = NULL;
+    if (base != NULL && base[0] == '/') {
+        if (mkdir(base, 0700) == -1 && errno != EEXIST)
+            return false;
+        n = snprintf(dir, size, "%s/bsh", base);
+    } else if (home != NULL && home[0] == '/') {
+        n = snprintf(dir, size, "%s/.cache", home);
+        if (n < 0 || (size_t)n >= size ||
+                (mkdir(dir, 0700) == -1 && errno != EEXIST))
+            return false;
+        n = snprintf(dir, size, "%s/.cache/bsh", home);
+    } else {
+        return false;
+    }
 
-    cmd->num_args--;
+    return n >= 0 && (size_t)n < size &&
+            (mkdir(dir, 0700) == 0 || errno == EEXIST);
 }
 
 
-static void
-cmd_free(struct cmd *cmd)
+/*
+ * mmap the image at `path` if it is one of the script at `src`, as it is
+ * now; return false if not
+ */
+static bool
+image_load(struct input *in, const char *path, const char *src,
+        const struct stat *src_st)
 {
-    size_t i;
+    const struct image_header *hdr;
+    const struct image_rec *rec;
+    struct stat st;
+    size_t pos;
+    uint32_t i;
+    void *map;
+    int fd;
 
-    for (i = 0; i < cmd->num_args; i++)
-        free(cmd->args[i]);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    hdr = map;
+    if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->size != (uint64_t)st.st_size ||
+            hdr->src_dev != src_st->st_dev ||
+            hdr->src_ino != src_st->st_ino ||
+            hdr->src_size != (uint64_t)src_st->st_size ||
+            hdr->src_mtime_sec != src_st->st_mtim.tv_sec ||
+            hdr->src_mtime_nsec != src_st->st_mtim.tv_nsec ||
+            hdr->path_len != strlen(src) ||
+            sizeof(*hdr) + hdr->path_len >= hdr->size ||
+            strcmp((const char *)(hdr + 1), src) != 0)
+        goto stale;
+
+    /* the records must tile the rest of the image exactly */
+    pos = sizeof(*hdr) + ((hdr->path_len + IMAGE_ALIGN) &
+            ~(size_t)(IMAGE_ALIGN - 1));
+    for (i = 0; i < hdr->num_recs && pos < hdr->size; i++) {
+        rec = (const struct image_rec *)((const char *)map + pos);
+        if (rec->size < sizeof(*rec) || rec->size % IMAGE_ALIGN != 0 ||
+                rec->size > hdr->size - pos)
+            goto stale;
+        pos += rec->size;
+    }
+    if (i != hdr->num_recs || pos != hdr->size)
+        goto stale;
+
+    in->image = map;
+    in->image_len = hdr->size;
+    in->image_pos = sizeof(*hdr) + ((hdr->path_len + IMAGE_ALIGN) &
+            ~(size_t)(IMAGE_ALIGN - 1));
+    in->image_mapped = true;
+    return true;
 
-    free(cmd->args);
-    free(cmd);
+stale:
+    munmap(map, (size_t)st.st_size);
+    return false;
 }
 
 
+/* write the image to `path` atomically; failing quietly is fine */
 static void
-cmd_print(const struct cmd *cmd)
+image_save(const struct image_buf *img, const char *path)
 {
-    size_t i;
+    char tmp[PATH_MAX];
+    int fd;
 
-    printf("cmd {num_args:%zu, cap_args:%zu}:\n",
-            cmd->num_args, cmd->cap_args);
-    for (i = 0; i < cmd->num_args; i++)
-        printf("\t[%zu] = \"%s\"\n", i, cmd->args[i]);
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+        return;
+    fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    if (mu_write_n(fd, img->data, img->len, NULL) < 0 ||
+            close(fd) == -1 || rename(tmp, path) == -1)
+        unlink(tmp);
+}
+
+
+/*
+ * Have the script open on in->fd, whose path is `script`, run from its
+ * image: the cached one if it is current, or a new one, which is saved.
+ * Return false, leaving the script to be read as text, if there is nowhere
+ * to keep the image.
+ */
+static bool
+image_open(struct input *in, const char *script)
+{
+    char src[PATH_MAX], dir[PATH_MAX], path[PATH_MAX];
+    struct image_buf img = { 0 };
+    struct stat st;
+
+    if (fstat(in->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            realpath(script, src) == NULL || !image_dir(dir, sizeof(dir)))
+        return false;
+    if (snprintf(path, sizeof(path), "%s/%016" PRIx64 ".img", dir,
+                mu_hash_str(src)) >= (int)sizeof(path))
+        return false;
+
+    if (image_load(in, path, src, &st)) {
+        close(in->fd);
+        in->fd = -1;
+        return true;
+    }
+
+    while (input_fill(in))
+        ;
+    image_compile(in, &img, src, &st);
+    image_save(&img, path);
+
+    in->image = img.data;
+    in->image_len = img.len;
+    in->image_pos = sizeof(struct image_header) +
+            ((strlen(src) + IMAGE_ALIGN) & ~(size_t)(IMAGE_ALIGN - 1));
+    return true;
 }
 
 
+/* input_read() for a compiled script */
 static struct pipeline *
-pipeline_new(char *line)
+image_read(struct input *in, struct mu_arena *arena, bool *last, bool *err)
 {
-    MU_NEW(pipeline, pipeline);
-    struct cmd *cmd = NULL;
-    char *s1, *s2, *command, *arg;
-    char *saveptr1, *saveptr2;
-    int i;
-    bool file_set = false;
+    const struct image_rec *rec;
+    struct pipeline *pipeline;
 
-    INIT_LIST_HEAD(&pipeline->head);
+    *last = false;
+    *err = false;
 
-    for (i = 0, s1 = line; ; i++, s1 = NULL) {
-        /* break into commands */
-        command = strtok_r(s1, "|", &saveptr1);
-        if (command == NULL)
-            break;
+    if (in->image_pos == in->image_len)
+        return NULL;
+    rec = (const struct image_rec *)(in->image + in->image_pos);
+    in->image_pos += rec->size;
 
-        cmd = cmd_new();
+    if (rec->type == IMAGE_FLAT) {
+        pipeline = pipeline_begin(arena);
+        flat_read((const struct flat_pipeline *)(rec + 1), pipeline);
+    } else {
+        pipeline = pipeline_new(arena,
+                mu_arena_strdup(arena, (const char *)(rec + 1)));
+        if (pipeline == NULL) {
+            *err = true;
+            return NULL;
+        }
+    }
 
-        /* parse the args of a single command */
-        for (s2 = command; ; s2 = NULL) {
-            file_set = false;
-            arg = strtok_r(s2, " \t", &saveptr2);
-            if (arg == NULL)
-                break;
-            if (strchr(arg, '<') != NULL){
-                pipeline->in_file = arg+1;
-                file_set = true;
-            }
-            else if (strchr(arg, '>') != NULL){
-                if(strchr(arg+1, '>') != NULL){
-                    pipeline->append = true;
-                    pipeline->out_file = arg+2;
-                }
-                else{
-                    pipeline->append = false;
-                    pipeline->out_file = arg+1;
-                }
-                file_set = true; 
-            }
-            if(!file_set){ 
-                cmd_push_arg(cmd, arg);
+    *last = (in->image_pos == in->image_len);
+    return pipeline;
+}
+
+
+/*
+ * Read the next command into a pipeline in `arena`.  Return NULL at end of
+ * input, or with *err set on a syntax error.  With lookahead, *last is set if
+ * no command follows.
+ */
+static struct pipeline *
+input_read(struct input *in, struct mu_arena *arena, bool *last, bool *err)
+{
+    struct pipeline *pipeline;
+    enum input_scan scan;
+    bool failed = false;
+    size_t end;
+
+    if (in->image != NULL)
+        return image_read(in, arena, last, err);
+
+    *last = false;
+    *err = false;
+
+    if (in->lookahead && input_at_end(in))
+        return NULL;
+    if (in->start == in->len && !input_fill(in))
+        return NULL;
+
+    pipeline = pipeline_begin(arena);
+    input_begin(in);
+
+    for (;;) {
+        scan = input_scan(in, &end);
+        if (scan == INPUT_STAGE) {
+            /* stages after a here-document wait for its body */
+            if (in->num_docs == 0)
+                in->stage_end = end;
+            continue;
+        }
+        if (scan == INPUT_END) {
+            failed = failed || input_parse(in, pipeline, end, true) == -1;
+            in->start = in->scan;
+            break;
+        }
+
+        /*
+         * Start the stages that have been read while waiting for the rest.
+         * Not for a user who is still typing, though.
+         */
+        if (in->stage_end > in->start && !failed && in->fd != -1 &&
+                !in->interactive) {
+            failed = input_parse(in, pipeline, in->stage_end, false) == -1;
+            if (!failed && !noexec) {
+                if (pipeline->job == NULL)
+                    path_cache_validate();
+                pipeline_launch(pipeline, false);
             }
-        }   
-        list_add_tail(&cmd->list, &pipeline->head);
-        pipeline->num_cmds += 1;
+        }
+        in->start = failed ? in->scan : in->start;
+
+        if (in->interactive && !in->edit && in->len > in->start) {
+            fputs(INPUT_PROMPT2, stdout);
+            fflush(stdout);
+        }
+        if (!input_fill(in)) {
+            failed = failed || input_parse(in, pipeline, in->len, true) == -1;
+            in->start = in->scan = in->len;
+            break;
+        }
+    }
+
+    if (failed) {
+        pipeline_abort(pipeline);
+        *err = true;
+        return NULL;
     }
-    /* TODO: parse I/O redirects */
 
+    if (in->lookahead)
+        *last = input_at_end(in);
     return pipeline;
 }
 
 
 static void
-pipeline_free(struct pipeline *pipeline)
+input_free(struct input *in)
+{
+    if (in->fd != -1 && in->fd != STDIN_FILENO)
+        close(in->fd);
+    free(in->buf);
+    input_docs_clear(in);
+    free(in->docs);
+    if (in->image_mapped)
+        munmap(in->image, in->image_len);
+    else
+        free(in->image);
+}
+
+
+/* read and run commands until the input runs out */
+static void
+repl(struct input *in, bool interactive)
 {
-    struct cmd *cmd, *tmp;
+    struct pipeline *pipeline;
+    struct mu_arena arena;
+    bool last, err;
+
+    mu_arena_init(&arena, MU_ARENA_DEFAULT_CHUNK_SIZE);
+
+    while (1) {
+        jobs_notify(interactive);
+        if (interactive && !in->edit) {
+            fputs(INPUT_PROMPT, stdout);
+            fflush(stdout);
+        }
+        pipeline = input_read(in, &arena, &last, &err);
+        if (pipeline != NULL)
+            last_status = pipeline_eval(pipeline, last);
+        else if (err)
+            last_status = 2;
+        else
+            break;
 
-    list_for_each_entry_safe(cmd, tmp, &pipeline->head, list) {
-        list_del(&cmd->list);
-        cmd_free(cmd);
+        mu_arena_reset(&arena);
     }
 
-    free(pipeline);
+    mu_arena_destroy(&arena);
 }
 
 
-static void
-pipeline_print(const struct pipeline *pipeline)
+/*
+ * Server mode.  `bsh --serve SOCKET` runs the commands of each request (see
+ * serve.h) in a worker process of its own, with the fds that came with the
+ * request as its stdin, stdout and stderr, and answers with their exit
+ * status.  Workers are forked from the server, so they start out with its
+ * PATH lookups and parse cache, which it fills by parsing (but not running)
+ * each request it passes on.  The next worker is always forked ahead of
+ * time -- the zygote -- so that a request doesn't wait for a fork: it is
+ * passed on to the zygote, which becomes its worker.
+ */
+struct serve_conn {
+    struct list_head list;
+    struct ev_source ev;        /* the connection */
+    struct ev_source worker;    /* pidfd of the worker of its request, or -1 */
+    pid_t pid;
+};
+
+static struct ev_source serve_listen_src = { .fd = -1 };
+static LIST_HEAD(serve_conns);
+
+/* waiting for a request on `fd` */
+static pid_t zygote_pid = -1;
+static int zygote_fd = -1;
+
+static char serve_text[SERVE_MAX_TEXT + 1];
+
+
+/*
+ * Receive a request on `fd` into serve_text.  Return 1 if one came, 0 at
+ * end of file, and -1 if it was not a request.
+ */
+static int
+serve_recv(int fd, size_t *len, int fds[SERVE_NUM_FDS])
 {
-    struct cmd *cmd;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SERVE_NUM_FDS * sizeof(int))];
+    } ctl;
+    struct iovec iov = { .iov_base = serve_text, .iov_len = SERVE_MAX_TEXT };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *cmsg;
+    size_t i, num_fds = 0;
+    ssize_t n;
 
-    list_for_each_entry(cmd, &pipeline->head, list) {
-        cmd_print(cmd);
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return (int)n;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), MU_MIN(num_fds, (size_t)SERVE_NUM_FDS) *
+                sizeof(int));
+        if (num_fds > SERVE_NUM_FDS) {
+            for (i = SERVE_NUM_FDS; i < num_fds; i++)
+                close(((int *)CMSG_DATA(cmsg))[i]);
+        }
+        break;
+    }
+
+    if (num_fds != SERVE_NUM_FDS || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for (i = 0; i < MU_MIN(num_fds, (size_t)SERVE_NUM_FDS); i++)
+            close(fds[i]);
+        return -1;
     }
+
+    *len = (size_t)n;
+    serve_text[n] = '\0';
+    return 1;
 }
 
+
+/* pass a request on; return -1 if it could not be sent */
 static int
-pipeline_wait_all(struct pipeline * pipeline){
-    struct cmd * cmd;
-    pid_t pid;
-    int wstatus;
-    int exit_status = 0;
+serve_send(int fd, size_t len, const int fds[SERVE_NUM_FDS])
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SERVE_NUM_FDS * sizeof(int))];
+    } ctl;
+    struct iovec iov = { .iov_base = serve_text, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
 
-    list_for_each_entry(cmd, &pipeline->head, list){
-        assert(cmd->pid);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SERVE_NUM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, SERVE_NUM_FDS * sizeof(int));
 
-        pid = waitpid(cmd->pid, &wstatus, 0);
-        if (pid == -1){
-            mu_die_errno(errno, "waitpid");
-        }
-        if (WIFEXITED(wstatus)){
-            exit_status = WEXITSTATUS(wstatus);
-        }
-        else if (WIFSIGNALED(wstatus)){
-            exit_status = 128 + WTERMSIG(wstatus);
-        }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+
+/* in the zygote: wait for a request, and run it */
+static void __attribute__((noreturn))
+zygote_run(int fd)
+{
+    struct serve_conn *conn;
+    struct input in;
+    int fds[SERVE_NUM_FDS];
+    size_t len;
+    int i, n;
+
+    /* let go of what is the server's, and start an event loop of its own */
+    close(serve_listen_src.fd);
+    list_for_each_entry(conn, &serve_conns, list) {
+        close(conn->ev.fd);
+        if (conn->worker.fd != -1)
+            close(conn->worker.fd);
+    }
+    close(sigchld_src.fd);
+    close(ev_epfd);
+    jobs_init(false);
+    subshell = true;
+
+    n = serve_recv(fd, &len, fds);
+    if (n <= 0)
+        _exit(n == 0 ? 0 : 2);
+    close(fd);
+
+    for (i = 0; i < SERVE_NUM_FDS; i++) {
+        if (dup2(fds[i], i) == -1)
+            _exit(126);
+        close(fds[i]);
     }
-    return exit_status;
+
+    input_init(&in, -1, serve_text);
+    in.lookahead = true;
+    repl(&in, false);
+    shell_exit(last_status);
 }
 
+
 static void
-pipeline_eval(struct pipeline * pipeline){
-    struct cmd * cmd;
-    pid_t pid;
-    int exit_status;
-    int cmd_idx = 0;
-    int err;
-    int pfd[2];
-    bool created_pipe = false;
-    int rfd, prev_rfd, wfd = -1;
-    FILE * fp;
+zygote_spawn(void)
+{
+    int sv[2];
 
-    pipeline_print(pipeline);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        mu_die_errno(errno, "socketpair");
 
-    //pipeline_print(pipeline);
+    fflush(NULL);
+    zygote_pid = fork();
+    if (zygote_pid == -1)
+        mu_die_errno(errno, "fork");
+    if (zygote_pid == 0) {
+        close(sv[0]);
+        zygote_run(sv[1]);
+    }
 
-    list_for_each_entry(cmd, &pipeline->head, list) {
-        created_pipe = false;
-        if ((pipeline->num_cmds > 1) && (cmd_idx != pipeline->num_cmds - 1)){
-            if(!created_pipe){
-                err = pipe(pfd);
-                if (err == -1)
-                    mu_die_errno(errno, "pipe");
-                created_pipe = true;
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+
+/*
+ * A connection is only closed while its request has no worker, but a worker
+ * that is still running is not left with a pidfd pointing into a freed conn.
+ */
+static void
+serve_conn_close(struct serve_conn *conn)
+{
+    if (conn->worker.fd != -1) {
+        close(conn->worker.fd);
+        kill(conn->pid, SIGKILL);
+        (void)waitpid(conn->pid, NULL, 0);
+    }
+    list_del(&conn->list);
+    close(conn->ev.fd);
+    free(conn);
+}
+
+
+/* a worker is done: answer its request */
+static void
+serve_worker_cb(struct ev_source *src, uint32_t events)
+{
+    struct serve_conn *conn = container_of(src, struct serve_conn, worker);
+    struct serve_reply reply;
+    int wstatus;
+
+    MU_UNUSED(events);
+
+    if (waitpid(conn->pid, &wstatus, 0) == -1)
+        mu_die_errno(errno, "waitpid");
+    close(src->fd);
+    src->fd = -1;
+
+    reply.status = wstatus_to_exit_status(wstatus);
+    if (send(conn->ev.fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+        serve_conn_close(conn);
+    else
+        ev_add(&conn->ev, EPOLLIN);
+}
+
+
+/*
+ * Parse the request in serve_text here too, without running it, so that the
+ * zygotes forked from now on have its lines in their parse cache and its
+ * commands in their path cache.  Syntax errors are the worker's to report.
+ */
+static void
+serve_warm(void)
+{
+    struct pipeline *pipeline;
+    struct mu_arena arena;
+    struct input in;
+    struct cmd *cmd;
+    struct path_entry *ent;
+    FILE *saved, *null;
+    bool last, err, saved_noexec = noexec;
+
+    null = fopen("/dev/null", "w");
+    if (null == NULL)
+        return;
+    saved = stderr;
+    stderr = null;
+    /* and $(...) is not run */
+    noexec = true;
+    mu_arena_init(&arena, MU_ARENA_DEFAULT_CHUNK_SIZE);
+    input_init(&in, -1, serve_text);
+    in.lookahead = true;
+
+    path_cache_validate();
+    for (;;) {
+        pipeline = input_read(&in, &arena, &last, &err);
+        if (pipeline == NULL && !err)
+            break;
+        /* lines with expansions aren't cached, but their commands are */
+        if (pipeline != NULL) {
+            list_for_each_entry(cmd, &pipeline->head, list) {
+                if (cmd->path != NULL || cmd->num_args == 0 ||
+                        builtin_lookup(cmd->args[0]) != NULL)
+                    continue;
+                ent = path_cache_lookup(cmd->args[0]);
+                /* resolving a name is not a use of it */
+                if (ent != NULL)
+                    ent->hits--;
             }
         }
+        mu_arena_reset(&arena);
+    }
 
-        //printf("New Child Made for :");
-        //cmd_print(cmd);
+    input_free(&in);
+    mu_arena_destroy(&arena);
+    noexec = saved_noexec;
+    stderr = saved;
+    fclose(null);
+}
 
-        pid = fork();
-        if (pid == -1){
-            mu_die_errno(errno, "fork");
-        }
 
-        //printf("PID : %d \n", pid);
+/* a request: hand it to the zygote, and fork the next one */
+static void
+serve_conn_cb(struct ev_source *src, uint32_t events)
+{
+    struct serve_conn *conn = container_of(src, struct serve_conn, ev);
+    int fds[SERVE_NUM_FDS];
+    size_t len;
+    int i, err;
 
-        if (pid == 0){ /* child */
-            /* adjust stdin*/
-            //printf("CREATED_PIPE: %d\n", created_pipe);
-            if (created_pipe){
-                err = close(pfd[0]);
-            }
+    MU_UNUSED(events);
 
-            if(cmd_idx == 0){
-                if (pipeline->in_file != NULL){
-                    //printf("INFILE : %s \n", pipeline->in_file);
-                    rfd = open(pipeline->in_file, O_RDONLY);
-                    if (rfd == -1)
-                        mu_die_errno(errno, "can't open %s", pipeline->in_file);
-                } else{
-                    //printf("STDIN_FILENO \n");
-                    rfd = STDIN_FILENO;
-                }
-            } else{
-                //printf("prev_rfd \n");
-                rfd = prev_rfd;
-            }
+    if (serve_recv(src->fd, &len, fds) <= 0) {
+        serve_conn_close(conn);
+        return;
+    }
 
-            if (rfd != STDIN_FILENO){
-                dup2(rfd, STDIN_FILENO);
-                close(rfd);
-            }
+    err = serve_send(zygote_fd, len, fds);
+    for (i = 0; i < SERVE_NUM_FDS; i++)
+        close(fds[i]);
+    close(zygote_fd);
+    conn->pid = zygote_pid;
+    serve_warm();
+    zygote_spawn();
 
-            /* adjust stdout*/
-            if(cmd_idx == (pipeline->num_cmds - 1)){
-                if (pipeline->out_file != NULL) {
-                    //printf("OUTFILE : %s", pipeline->out_file);
-                    if(pipeline->append){
-                        fp = fopen(pipeline->out_file, "a");
-                        if(fp == NULL){
-                            mu_die_errno(errno, "can't open %s", pipeline->out_file);
-                        }
-                        wfd = fileno(fp);
-                    }
-                    else{   
-                        wfd = open(pipeline->out_file, O_WRONLY|O_CREAT|O_TRUNC, 0664);
-                        if (wfd == -1)
-                            mu_die_errno(errno, "can't open %s", pipeline->out_file);
-                    }
-                } else {
-                    //printf("STDOUT_FILENO \n");
-                    wfd = STDOUT_FILENO;
-                }
-            } else{
-                //printf("pfd[1] \n");
-                wfd = pfd[1];
-            }
+    /* the zygote is gone; its exit status is the answer */
+    if (err == -1)
+        kill(conn->pid, SIGKILL);
 
-            if(wfd != STDOUT_FILENO){
-                dup2(wfd, STDOUT_FILENO);
-                close(wfd);
-            }
+    conn->worker.fd = (int)syscall(SYS_pidfd_open, conn->pid, 0);
+    if (conn->worker.fd == -1)
+        mu_die_errno(errno, "pidfd_open");
+    if (fcntl(conn->worker.fd, F_SETFD, FD_CLOEXEC) == -1)
+        mu_die_errno(errno, "fcntl");
+    ev_add(&conn->worker, EPOLLIN);
 
-            execvp(cmd->args[0], cmd->args);
-            mu_die_errno(errno, "can't exec \" %s \"", cmd->args[0]);
-        }
+    /*
+     * One request at a time.  The connection is out of the event loop until
+     * the answer is sent: even with no events asked for, epoll would still
+     * report a client that hangs up meanwhile.
+     */
+    ev_del(&conn->ev);
+}
 
-        //printf("Parent\n");
-        /* parent*/
-        cmd->pid = pid;
 
-        if(cmd_idx != 0){
-            err = close(prev_rfd);
-        }
+static void
+serve_accept_cb(struct ev_source *src, uint32_t events)
+{
+    struct serve_conn *conn;
+    int fd;
 
-        if(created_pipe){
-            err = close(pfd[1]);
-            prev_rfd = pfd[0];
-        }
+    MU_UNUSED(events);
 
-        cmd_idx++;
+    fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+            mu_stderr_errno(errno, "accept");
+        return;
     }
 
-    exit_status = pipeline_wait_all(pipeline);
-    (void)exit_status;
-    if(fp != NULL)
-        close(fp);
+    conn = mu_zalloc(sizeof(*conn));
+    conn->ev.fd = fd;
+    conn->ev.cb = serve_conn_cb;
+    conn->worker.fd = -1;
+    conn->worker.cb = serve_worker_cb;
+    list_add_tail(&conn->list, &serve_conns);
+    ev_add(&conn->ev, EPOLLIN);
+}
+
+
+static void __attribute__((noreturn))
+serve(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        mu_die("socket path too long: %s", path);
+    mu_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
 
-    return;
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        mu_die_errno(errno, "socket");
+    if (unlink(path) == -1 && errno != ENOENT)
+        mu_die_errno(errno, "can't remove %s", path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        mu_die_errno(errno, "can't bind %s", path);
+    if (listen(fd, SOMAXCONN) == -1)
+        mu_die_errno(errno, "listen");
+
+    serve_listen_src.fd = fd;
+    serve_listen_src.cb = serve_accept_cb;
+    ev_add(&serve_listen_src, EPOLLIN);
+
+    zygote_spawn();
+    for (;;)
+        ev_run_once(-1);
 }
 
 
@@ -347,17 +7566,28 @@ usage(int status)
 int
 main(int argc, char *argv[])
 {
-    ssize_t len_ret = 0;
-    size_t len = 0;
-    char *line = NULL;
-    struct pipeline *pipeline = NULL;
-    struct cmd *cmd, *tmp;
-    FILE * fp;
+    struct input in = { 0 };
+    const char *command = NULL;
+    const char *serve_path = NULL;
+    bool interactive = false;
 
-    int opt, nargs;
-    const char *short_opts = ":h";
+    bool hash_fds = false;
+    bool script_cache = true;
+    int opt;
+    /* '+': options end at the script name; the rest are its arguments */
+    const char *short_opts = "+:hc:dnl:o:";
     struct option long_opts[] = {
             {"help", no_argument, NULL, 'h'},
+            {"command", required_argument, NULL, 'c'},
+            {"debug", no_argument, NULL, 'd'},
+            {"noexec", no_argument, NULL, 'n'},
+            {"launcher", required_argument, NULL, 'l'},
+            {"option", required_argument, NULL, 'o'},
+            {"colocate", no_argument, NULL, 'P'},
+            {"hash-fds", no_argument, NULL, 'F'},
+            {"no-cache", no_argument, NULL, 'C'},
+            {"serve", required_argument, NULL, 'S'},
+            {"trace", required_argument, NULL, 'T'},
             {NULL, 0, NULL, 0}
     };
     while (1) {
@@ -368,6 +7598,42 @@ main(int argc, char *argv[])
             case 'h':
                 usage(0);
                 break;
+            case 'c':
+                command = optarg;
+                break;
+            case 'd':
+                debug = true;
+                break;
+            case 'n':
+                noexec = true;
+                break;
+            case 'l':
+                if (strcmp(optarg, "spawn") == 0)
+                    launcher = LAUNCHER_SPAWN;
+                else if (strcmp(optarg, "fork") == 0)
+                    launcher = LAUNCHER_FORK;
+                else
+                    mu_die("unknown launcher \"%s\"", optarg);
+                break;
+            case 'o':
+                if (shell_option_set(optarg, true) == -1)
+                    exit(2);
+                break;
+            case 'P':
+                colocate = true;
+                break;
+            case 'F':
+                hash_fds = true;
+                break;
+            case 'C':
+                script_cache = false;
+                break;
+            case 'S':
+                serve_path = optarg;
+                break;
+            case 'T':
+                trace_open(optarg);
+                break;
             case '?':
                 mu_die("unknown option '%c' (decimal: %d)", optopt, optopt);
             case ':':
@@ -377,25 +7643,46 @@ main(int argc, char *argv[])
         }
     }
 
-  
-
-    /* REPL */
-    while (1) {
-        if (isatty(fileno(stdin)))
-            printf("> ");
-        len_ret = getline(&line, &len, stdin);
-        if (len_ret == -1)
-            goto out;
-        
-        mu_str_chomp(line);
-        pipeline = pipeline_new(line);
+    if (serve_path != NULL) {
+        params_set(1, argv);
+    } else if (command != NULL) {
+        /* bsh -c COMMAND [NAME [ARG...]]: NAME becomes $0 */
+        if (command[0] == '\0')
+            return 0;
+        input_init(&in, -1, command);
+        in.lookahead = true;
+        if (optind < argc)
+            params_set(argc - optind, &argv[optind]);
+        else
+            params_set(1, argv);
+    } else if (optind < argc) {
+        /* bsh SCRIPT [ARG...] */
+        input_init(&in, open(argv[optind], O_RDONLY | O_CLOEXEC), NULL);
+        if (in.fd == -1)
+            mu_die_errno(errno, "can't open %s", argv[optind]);
+        in.lookahead = true;
+        if (script_cache)
+            (void)image_open(&in, argv[optind]);
+        params_set(argc - optind, &argv[optind]);
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        input_init(&in, STDIN_FILENO, NULL);
+        in.interactive = interactive;
+        in.edit = interactive && isatty(STDOUT_FILENO);
+        if (in.edit)
+            history_open();
+        params_set(1, argv);
+    }
 
-        pipeline_eval(pipeline);
+    path_cache_init(hash_fds);
+    parse_cache_init();
+    jobs_init(interactive);
 
-        pipeline_free(pipeline);
-    }
+    if (serve_path != NULL)
+        serve(serve_path);
 
-out:
-    free(line);
-    return 0;
-}
\ No newline at end of file
+    repl(&in, interactive);
+    input_free(&in);
+    trace_close();
+    return last_status;
+}
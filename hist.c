@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "mu.h"
+
+#define HIST_INITIAL_CAP 1024
+
+/*
+ * Signatures.  Every entry is taken to start with two newlines, which no
+ * entry contains, so its first bytes make trigrams of their own and a
+ * prefix query can ask for them.  Each trigram sets one of the 64 bits.
+ */
+#define HIST_MARK '\n'
+
+
+static inline uint64_t
+hist_trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+    uint32_t t = (uint32_t)a | (uint32_t)b << 8 | (uint32_t)c << 16;
+
+    return UINT64_C(1) << ((t * 2654435761u) >> 26);
+}
+
+
+/*
+ * The trigrams of s; with `start`, those of s at the start of an entry,
+ * otherwise only those wholly inside s.
+ */
+static uint64_t
+hist_sig(const char *s, size_t len, bool start)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    unsigned char a = HIST_MARK, b = HIST_MARK;
+    uint64_t sig = 0;
+    size_t i = 0;
+
+    if (!start) {
+        if (len < 3)
+            return 0;
+        a = u[0];
+        b = u[1];
+        i = 2;
+    }
+    for (; i < len; i++) {
+        sig |= hist_trigram(a, b, u[i]);
+        a = b;
+        b = u[i];
+    }
+
+    return sig;
+}
+
+
+static void
+hist_reset(struct hist *h)
+{
+    h->num = 0;
+    h->off[0] = 0;
+}
+
+
+int
+hist_open(struct hist *h, const char *path)
+{
+    mu_memzero_p(h);
+    h->cap = HIST_INITIAL_CAP;
+    h->off = mu_mallocarray(h->cap + 1, sizeof(*h->off));
+    h->sig = mu_mallocarray(h->cap, sizeof(*h->sig));
+    hist_reset(h);
+
+    h->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (h->fd == -1)
+        return -errno;
+
+    hist_sync(h);
+    return 0;
+}
+
+
+void
+hist_close(struct hist *h)
+{
+    if (h->map != NULL)
+        munmap((void *)h->map, h->map_len);
+    if (h->fd != -1)
+        close(h->fd);
+    free(h->off);
+    free(h->sig);
+    mu_memzero_p(h);
+    h->fd = -1;
+}
+
+
+/* map the first `size` bytes of the file, however much was mapped before */
+static int
+hist_map(struct hist *h, size_t size)
+{
+    void *map;
+
+    if (size == h->map_len)
+        return 0;
+
+    if (size == 0) {
+        munmap((void *)h->map, h->map_len);
+        map = NULL;
+    } else if (h->map == NULL) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, h->fd, 0);
+    } else {
+        map = mremap((void *)h->map, h->map_len, size, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED)
+        return -errno;
+
+    h->map = map;
+    h->map_len = size;
+    return 0;
+}
+
+
+/*
+ * Index the lines appended to the file since the last call.  A line that
+ * is still being written (no newline yet) waits for the next call.  If the
+ * file has shrunk, someone else has rewritten it, and the index starts over.
+ */
+void
+hist_sync(struct hist *h)
+{
+    struct stat st;
+    const char *p, *end, *nl;
+
+    if (h->fd == -1 || fstat(h->fd, &st) == -1)
+        return;
+
+    if ((uint64_t)st.st_size < h->off[h->num])
+        hist_reset(h);
+    if (hist_map(h, (size_t)st.st_size) < 0)
+        return;
+
+    p = h->map + h->off[h->num];
+    end = h->map + h->map_len;
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        if (h->num == h->cap) {
+            h->cap *= 2;
+            h->off = mu_reallocarray(h->off, h->cap + 1, sizeof(*h->off));
+            h->sig = mu_reallocarray(h->sig, h->cap, sizeof(*h->sig));
+        }
+        h->sig[h->num] = hist_sig(p, (size_t)(nl - p), true);
+        h->num++;
+        h->off[h->num] = (uint64_t)(nl + 1 - h->map);
+        p = nl + 1;
+    }
+}
+
+
+const char *
+hist_get(const struct hist *h, size_t i, size_t *len)
+{
+    *len = h->off[i + 1] - h->off[i] - 1;
+    return h->map + h->off[i];
+}
+
+
+/*
+ * Append a line (without its newline) to the file.  A line that repeats
+ * the newest entry, from whichever shell, is not added again.
+ */
+int
+hist_add(struct hist *h, const char *line, size_t len)
+{
+    struct iovec iov[2] = {
+        { .iov_base = (void *)line, .iov_len = len },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    const char *last;
+    size_t last_len;
+    ssize_t n;
+
+    if (h->fd == -1)
+        return -EBADF;
+    if (len == 0 || memchr(line, '\n', len) != NULL)
+        return -EINVAL;
+
+    hist_sync(h);
+    if (h->num > 0) {
+        last = hist_get(h, h->num - 1, &last_len);
+        if (last_len == len && memcmp(last, line, len) == 0)
+            return 0;
+    }
+
+    /* one write, so that it can't be split by another shell's */
+    do {
+        n = writev(h->fd, iov, 2);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        return -errno;
+
+    hist_sync(h);
+    return 0;
+}
+
+
+static bool
+hist_match(const struct hist *h, size_t i, const char *s, size_t len,
+        uint64_t want, int flags)
+{
+    const char *e;
+    size_t n;
+
+    if ((h->sig[i] & want) != want)
+        return false;
+
+    e = hist_get(h, i, &n);
+    if (flags & HIST_PREFIX)
+        return n >= len && memcmp(e, s, len) == 0;
+    return memmem(e, n, s, len) != NULL;
+}
+
+
+/*
+ * The index of the newest entry before `from` (or, with HIST_FORWARD, the
+ * oldest entry after it) that starts with or contains s, or -1.
+ */
+long
+hist_search(const struct hist *h, const char *s, size_t len, size_t from,
+        int flags)
+{
+    uint64_t want = hist_sig(s, len, flags & HIST_PREFIX);
+    size_t i;
+
+    if (flags & HIST_FORWARD) {
+        for (i = from + 1; i < h->num; i++) {
+            if (hist_match(h, i, s, len, want, flags))
+                return (long)i;
+        }
+    } else {
+        for (i = from < h->num ? from : h->num; i-- > 0; ) {
+            if (hist_match(h, i, s, len, want, flags))
+                return (long)i;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,48 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Command history, kept in a plain file of one entry per line that any
+ * number of shells share.
+ *
+ * The file is only ever appended to: hist_add() writes an entry with one
+ * write() on an O_APPEND descriptor, so concurrent shells interleave whole
+ * lines and nothing is ever rewritten.  Entries are read straight out of a
+ * shared mapping of the file.  hist_sync() picks up whatever has been
+ * appended since the last call, by this shell or any other, growing the
+ * mapping and indexing just the new lines.
+ *
+ * For each entry the index keeps its offset and a 64-bit signature of the
+ * trigrams it contains, so a search tests one word per entry and only
+ * compares the text of the entries whose signature covers the query's.
+ */
+
+struct hist {
+    int fd;             /* -1: no history file */
+    const char *map;    /* the first map_len bytes of the file */
+    size_t map_len;
+    uint64_t *off;      /* entry i is off[i]..off[i + 1] - 1, without its
+                           newline; off[num] is the end of the last one */
+    uint64_t *sig;      /* entry i's trigram signature */
+    size_t num;
+    size_t cap;
+};
+
+/* hist_search() flags */
+#define HIST_PREFIX     (1 << 0)    /* the entry starts with the query,
+                                       rather than contains it */
+#define HIST_FORWARD    (1 << 1)    /* search newer entries, not older */
+
+int hist_open(struct hist *h, const char *path);
+void hist_close(struct hist *h);
+void hist_sync(struct hist *h);
+int hist_add(struct hist *h, const char *line, size_t len);
+const char * hist_get(const struct hist *h, size_t i, size_t *len);
+long hist_search(const struct hist *h, const char *s, size_t len,
+        size_t from, int flags);
+
+#endif /* _HIST_H_ */
@@ -0,0 +1,921 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#   define LEX_HAVE_X86 1
+#   include <immintrin.h>
+#endif
+
+#include "lex.h"
+#include "mu.h"
+
+
+/*
+ * Bytes that end a run of plain word characters.  The terminating nul is
+ * always one of them, so every scanner stops at the end of the line.
+ */
+static const char lex_specials[] = " \t\n|&<>'\"\\$";
+
+static bool lex_special[256] = {
+    ['\0'] = true,
+    [' '] = true, ['\t'] = true, ['\n'] = true,
+    ['|'] = true, ['&'] = true, ['<'] = true, ['>'] = true,
+    ['\''] = true, ['"'] = true, ['\\'] = true,
+    ['$'] = true,
+};
+
+/*
+ * A block scanner returns a bitmask of the special bytes in the 64-byte
+ * aligned block at `blk`.  The lexer keeps the mask of the block it is in,
+ * so a line of short words costs one vector pass per 64 bytes rather than
+ * one per word.
+ */
+typedef uint64_t (*lex_block_fn)(const char *blk);
+
+#define LEX_BLOCK_SIZE 64
+
+
+static char *
+lex_scan_scalar(char *p)
+{
+    while (!lex_special[(uint8_t)*p])
+        p++;
+    return p;
+}
+
+
+#ifdef LEX_HAVE_X86
+/*
+ * The block scanners use aligned loads, which never cross a page boundary,
+ * so they may look at bytes before the start of the line or past its nul
+ * without faulting.  Those bits are never consulted.
+ */
+
+static inline uint64_t
+lex_mask_sse2(const char *p)
+{
+    __m128i v = _mm_load_si128((const __m128i *)p);
+    __m128i m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+    size_t i;
+
+    for (i = 0; i < sizeof(lex_specials) - 1; i++)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(lex_specials[i])));
+
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(m);
+}
+
+
+static uint64_t
+lex_block_sse2(const char *blk)
+{
+    return lex_mask_sse2(blk) |
+        lex_mask_sse2(blk + 16) << 16 |
+        lex_mask_sse2(blk + 32) << 32 |
+        lex_mask_sse2(blk + 48) << 48;
+}
+
+
+__attribute__((target("avx2")))
+static inline uint64_t
+lex_mask_avx2(const char *p)
+{
+    __m256i v = _mm256_load_si256((const __m256i *)p);
+    __m256i m = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+    size_t i;
+
+    for (i = 0; i < sizeof(lex_specials) - 1; i++)
+        m = _mm256_or_si256(m,
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(lex_specials[i])));
+
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(m);
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t
+lex_block_avx2(const char *blk)
+{
+    return lex_mask_avx2(blk) | lex_mask_avx2(blk + 32) << 32;
+}
+#endif /* LEX_HAVE_X86 */
+
+
+static lex_block_fn lex_block;    /* NULL for the scalar scanner */
+static enum lex_scanner lex_scanner = LEX_SCAN_AUTO;
+
+
+/*
+ * Select the scanner.  Return 0 on success, or -1 if the CPU (or the build)
+ * does not support the requested one.
+ */
+int
+lex_set_scanner(enum lex_scanner scanner)
+{
+#ifdef LEX_HAVE_X86
+    __builtin_cpu_init();
+#endif
+
+    if (scanner == LEX_SCAN_AUTO) {
+#ifdef LEX_HAVE_X86
+        if (__builtin_cpu_supports("avx2"))
+            return lex_set_scanner(LEX_SCAN_AVX2);
+        return lex_set_scanner(LEX_SCAN_SSE2);
+#else
+        return lex_set_scanner(LEX_SCAN_SCALAR);
+#endif
+    }
+
+    switch (scanner) {
+    case LEX_SCAN_SCALAR:
+        lex_block = NULL;
+        break;
+#ifdef LEX_HAVE_X86
+    case LEX_SCAN_SSE2:
+        lex_block = lex_block_sse2;
+        break;
+    case LEX_SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return -1;
+        lex_block = lex_block_avx2;
+        break;
+#endif
+    default:
+        return -1;
+    }
+
+    lex_scanner = scanner;
+    return 0;
+}
+
+
+const char *
+lex_scanner_name(void)
+{
+    switch (lex_scanner) {
+    case LEX_SCAN_SCALAR:   return "scalar";
+    case LEX_SCAN_SSE2:     return "sse2";
+    case LEX_SCAN_AVX2:     return "avx2";
+    default:                return "auto";
+    }
+}
+
+
+const char *
+lex_type_str(enum lex_type type)
+{
+    switch (type) {
+    case LEX_WORD:          return "word";
+    case LEX_PIPE:          return "|";
+    case LEX_AMP:           return "&";
+    case LEX_REDIR_IN:      return "<";
+    case LEX_REDIR_OUT:     return ">";
+    case LEX_REDIR_APPEND:  return ">>";
+    case LEX_HEREDOC:       return "<<";
+    case LEX_HEREDOC_STRIP: return "<<-";
+    case LEX_HERESTRING:    return "<<<";
+    case LEX_PROCSUB_IN:    return "<(";
+    case LEX_PROCSUB_OUT:   return ">(";
+    case LEX_END:           return "newline";
+    default:                return "?";
+    }
+}
+
+
+void
+lex_init(struct lexer *lx, char *line)
+{
+    if (lex_scanner == LEX_SCAN_AUTO)
+        lex_set_scanner(LEX_SCAN_AUTO);
+
+    lx->p = line;
+    lx->blk = NULL;
+    lx->blk_mask = 0;
+    lx->pending = LEX_NONE;
+    lx->op_arg = NULL;
+    lx->err = NULL;
+    lx->heredocs = NULL;
+    lx->heredocs_tail = &lx->heredocs;
+    lx->heredoc_word = false;
+    lx->after_nl = false;
+    lx->arena = NULL;
+    lx->var = NULL;
+    lx->var_ctx = NULL;
+    lx->cmd = NULL;
+    lx->fields = NULL;
+    lx->fields_tail = &lx->fields;
+}
+
+
+/*
+ * Enable variable expansion: `var` is called with each variable name (not
+ * nul-terminated) and returns its value, or NULL if it is unset.  Words that
+ * grow are copied into `arena`.
+ */
+void
+lex_set_expand(struct lexer *lx, struct mu_arena *arena, lex_var_fn var,
+        void *ctx)
+{
+    lx->arena = arena;
+    lx->var = var;
+    lx->var_ctx = ctx;
+}
+
+
+/*
+ * Enable command substitution: `cmd` is called with the nul-terminated text
+ * inside each $(...) and the context given to lex_set_expand(), and returns
+ * the command's output, setting *len.
+ */
+void
+lex_set_cmdsub(struct lexer *lx, lex_cmd_fn cmd)
+{
+    lx->cmd = cmd;
+}
+
+
+/*
+ * Return the first special byte at or after `p`.
+ *
+ * The cached block mask stays valid while the word is rewritten in place,
+ * because the lexer only ever writes behind its read position.
+ */
+static inline char *
+lex_scan(struct lexer *lx, char *p)
+{
+    uint64_t mask;
+
+    if (lex_block == NULL)
+        return lex_scan_scalar(p);
+
+    for (;;) {
+        if (lx->blk != NULL && p >= lx->blk && p < lx->blk + LEX_BLOCK_SIZE) {
+            mask = lx->blk_mask & (~(uint64_t)0 << (p - lx->blk));
+            if (mask != 0)
+                return lx->blk + __builtin_ctzll(mask);
+            p = lx->blk + LEX_BLOCK_SIZE;
+        }
+        lx->blk = (char *)((uintptr_t)p & ~(uintptr_t)(LEX_BLOCK_SIZE - 1));
+        lx->blk_mask = lex_block(lx->blk);
+    }
+}
+
+
+static bool
+lex_is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+
+/*
+ * `p` is just inside the '(' of a process substitution: return its closing
+ * ')', skipping nested parentheses and quoted text, or NULL.
+ */
+static char *
+lex_close_paren(char *p)
+{
+    int depth = 1;
+
+    for (; *p != '\0'; p++) {
+        switch (*p) {
+        case '\\':
+            if (p[1] != '\0')
+                p++;
+            break;
+        case '\'':
+            p = strchr(p + 1, '\'');
+            if (p == NULL)
+                return NULL;
+            break;
+        case '"':
+            /* a backslash escapes the next byte, `"` included */
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0')
+                    return NULL;
+                if (*p == '\\' && p[1] != '\0')
+                    p++;
+            }
+            break;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (--depth == 0)
+                return p;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Whether the `len` bytes after `|[` and before a `]` make the ARG of a
+ * `|[ARG]`: a pipe size (digits, with an optional suffix) or a word for one.
+ * Anything else, like `cmd |[ test ]`, is a plain pipe into `[`.
+ */
+bool
+lex_pipe_arg_ok(const char *arg, size_t len)
+{
+    size_t i;
+
+    if (len == 0)
+        return false;
+    for (i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)arg[i]))
+            return false;
+    }
+
+    return isdigit((unsigned char)arg[0]) ||
+            (len == 4 && memcmp(arg, "auto", 4) == 0) ||
+            (len == 7 && memcmp(arg, "default", 7) == 0);
+}
+
+
+/*
+ * If *pp is at an operator, consume it and return its type; otherwise return
+ * LEX_NONE.  A pipe may carry an argument, `|[ARG]`, and a process
+ * substitution, `<(ARG)` or `>(ARG)`, holds a command; ARG is nul-terminated
+ * in place and left in lx->op_arg.
+ */
+static enum lex_type
+lex_operator(struct lexer *lx, char **pp)
+{
+    char *p = *pp;
+    char *end;
+
+    lx->op_arg = NULL;
+
+    if ((*p == '<' || *p == '>') && p[1] == '(') {
+        end = lex_close_paren(p + 2);
+        if (end == NULL) {
+            lx->err = *p == '<' ? "missing ')' after '<('" :
+                    "missing ')' after '>('";
+            *pp = p + strlen(p);
+            return LEX_ERROR;
+        }
+        *end = '\0';
+        lx->op_arg = p + 2;
+        *pp = end + 1;
+        return *p == '<' ? LEX_PROCSUB_IN : LEX_PROCSUB_OUT;
+    }
+
+    switch (*p) {
+    case '|':
+        end = p[1] == '[' ? strchr(p + 2, ']') : NULL;
+        if (end != NULL && lex_pipe_arg_ok(p + 2, (size_t)(end - p - 2))) {
+            *end = '\0';
+            lx->op_arg = p + 2;
+            *pp = end + 1;
+            return LEX_PIPE;
+        }
+        *pp = p + 1;
+        return LEX_PIPE;
+    case '&':
+        *pp = p + 1;
+        return LEX_AMP;
+    case '<':
+        if (p[1] == '<' && p[2] == '<') {
+            *pp = p + 3;
+            return LEX_HERESTRING;
+        }
+        if (p[1] == '<' && p[2] == '-') {
+            *pp = p + 3;
+            return LEX_HEREDOC_STRIP;
+        }
+        if (p[1] == '<') {
+            *pp = p + 2;
+            return LEX_HEREDOC;
+        }
+        *pp = p + 1;
+        return LEX_REDIR_IN;
+    case '>':
+        if (p[1] == '>') {
+            *pp = p + 2;
+            return LEX_REDIR_APPEND;
+        }
+        *pp = p + 1;
+        return LEX_REDIR_OUT;
+    default:
+        return LEX_NONE;
+    }
+}
+
+
+/*
+ * Where a word is being rebuilt.  A word starts out being rewritten in place
+ * in the line buffer; that is always possible because removing quotes and
+ * backslashes only shrinks it.  Expanding a variable can grow it, so the
+ * first expansion moves the word into a buffer in lx->arena.
+ */
+struct lex_out {
+    char *start;
+    char *w;            /* write cursor */
+    char *cap_end;      /* end of the arena buffer; NULL while in place */
+    bool quoted;        /* since the start of the field */
+};
+
+/* a field of a word that was split, waiting to be returned */
+struct lex_field {
+    char *s;
+    size_t len;
+    struct lex_field *next;
+};
+
+
+static void
+lex_reserve(struct lexer *lx, struct lex_out *o, size_t n)
+{
+    size_t len = (size_t)(o->w - o->start);
+    size_t cap, new_cap;
+
+    if (o->cap_end == NULL) {
+        new_cap = 2 * (len + n + 1);
+        o->start = memcpy(mu_arena_alloc(lx->arena, new_cap), o->start, len);
+    } else {
+        cap = (size_t)(o->cap_end - o->start);
+        if (cap - len > n)
+            return;
+        new_cap = 2 * (len + n + 1);
+        o->start = mu_arena_reallocarray(lx->arena, o->start, cap, new_cap, 1);
+    }
+
+    o->w = o->start + len;
+    o->cap_end = o->start + new_cap;
+}
+
+
+/*
+ * Append `n` bytes from `s`.  In place, `s` is always at or ahead of the
+ * write cursor.
+ */
+static inline void
+lex_put(struct lexer *lx, struct lex_out *o, const char *s, size_t n)
+{
+    if (o->cap_end != NULL)
+        lex_reserve(lx, o, n);
+    if (o->w != s)
+        memmove(o->w, s, n);
+    o->w += n;
+}
+
+
+static bool
+lex_is_name_start(char c)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+static bool
+lex_is_name_char(char c)
+{
+    return lex_is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+
+/* end the current field of a word being split, and start another */
+static void
+lex_field_end(struct lexer *lx, struct lex_out *o)
+{
+    struct lex_field *f;
+
+    lex_reserve(lx, o, 1);
+    *o->w = '\0';
+
+    f = mu_arena_alloc(lx->arena, sizeof(*f));
+    f->s = o->start;
+    f->len = (size_t)(o->w - o->start);
+    f->next = NULL;
+    *lx->fields_tail = f;
+    lx->fields_tail = &f->next;
+
+    o->start = o->w = mu_arena_alloc(lx->arena, 32);
+    o->cap_end = o->start + 32;
+    o->quoted = false;
+}
+
+
+/*
+ * Append the output of a command substitution, split into fields at blanks
+ * unless it is quoted.
+ */
+static void
+lex_put_output(struct lexer *lx, struct lex_out *o, const char *s, size_t len,
+        bool split)
+{
+    size_t i = 0, n;
+
+    if (!split) {
+        lex_reserve(lx, o, len);
+        lex_put(lx, o, s, len);
+        return;
+    }
+
+    while (i < len) {
+        if (lex_is_blank(s[i])) {
+            if (o->w > o->start || o->quoted)
+                lex_field_end(lx, o);
+            i++;
+            continue;
+        }
+        for (n = 1; i + n < len && !lex_is_blank(s[i + n]); n++)
+            ;
+        lex_reserve(lx, o, n);
+        lex_put(lx, o, s + i, n);
+        i += n;
+    }
+}
+
+
+/*
+ * *rp is at a '$'.  Expand $NAME, ${NAME}, $0-$9, $#, $?, $$ or $! through
+ * the lexer's variable callback, or $(COMMAND) through its command callback,
+ * and advance *rp past it.  A '$' that starts none of these is kept
+ * literally.  Unless `split` is false (in quotes), the output of a command is
+ * split into fields.  Return 1 if something was expanded, 0 if the '$' was
+ * literal, and -1 on a syntax error.
+ */
+static int
+lex_dollar(struct lexer *lx, struct lex_out *o, char **rp, bool split)
+{
+    char *r = *rp;
+    const char *name = r + 1;
+    const char *value;
+    size_t len = 0;
+    char *end;
+
+    if (lx->var == NULL) {
+        lex_put(lx, o, r, 1);
+        *rp = r + 1;
+        return 0;
+    }
+
+    if (*name == '(' && lx->cmd != NULL) {
+        end = lex_close_paren(r + 2);
+        if (end == NULL) {
+            lx->err = "missing ')' after '$('";
+            return -1;
+        }
+        *end = '\0';
+        *rp = end + 1;
+
+        /* trailing newlines are dropped */
+        value = lx->cmd(lx->var_ctx, r + 2, &len);
+        while (len > 0 && value[len - 1] == '\n')
+            len--;
+        lex_put_output(lx, o, value, len, split);
+        return 1;
+    }
+
+    if (*name == '{') {
+        name++;
+        end = strchr(name, '}');
+        if (end == NULL) {
+            lx->err = "unterminated ${";
+            return -1;
+        }
+        len = (size_t)(end - name);
+        *rp = end + 1;
+    } else if (lex_is_name_start(*name)) {
+        for (len = 1; lex_is_name_char(name[len]); len++)
+            ;
+        *rp = (char *)name + len;
+    } else if ((*name >= '0' && *name <= '9') || *name == '#' ||
+            *name == '?' || *name == '$' || *name == '!') {
+        len = 1;
+        *rp = (char *)name + 1;
+    } else {
+        lex_put(lx, o, r, 1);
+        *rp = r + 1;
+        return 0;
+    }
+
+    if (len == 0) {
+        lx->err = "bad substitution";
+        return -1;
+    }
+
+    value = lx->var(lx->var_ctx, name, len);
+    if (value == NULL)
+        value = "";
+
+    /* the value must not be written over the rest of the line */
+    lex_reserve(lx, o, strlen(value));
+    lex_put(lx, o, value, strlen(value));
+
+    return 1;
+}
+
+
+/*
+ * Scan one word starting at lx->p, removing quotes and backslashes and
+ * expanding variables as it goes.  In place, the write cursor never passes
+ * the read cursor `r`, and runs of plain bytes are only moved once a quote
+ * or backslash has shifted them.
+ *
+ * Variables are not field-split, but the output of an unquoted command
+ * substitution is, and the fields are queued in lx->fields.  A word that is
+ * nothing but unquoted expansions of empty variables disappears, and
+ * LEX_NONE is returned for it.
+ */
+static enum lex_type
+lex_word(struct lexer *lx, struct lex_token *tok)
+{
+    struct lex_out o = { .start = lx->p, .w = lx->p, .cap_end = NULL };
+    struct lex_field *f;
+    char *r = lx->p;
+    char *q;
+    bool expanded = false;
+    int ret;
+
+    for (;;) {
+        q = lex_scan(lx, r);
+        lex_put(lx, &o, r, (size_t)(q - r));
+        r = q;
+
+        switch (*r) {
+        case '\'':
+            /* everything up to the closing quote is literal */
+            q = strchr(r + 1, '\'');
+            if (q == NULL) {
+                lx->err = "unterminated single quote";
+                return LEX_ERROR;
+            }
+            lex_put(lx, &o, r + 1, (size_t)(q - r - 1));
+            r = q + 1;
+            o.quoted = true;
+            break;
+
+        case '"':
+            /*
+             * A backslash only escapes \, " and $ inside double quotes (and
+             * joins lines, as everywhere)
+             */
+            for (r++; *r != '"'; ) {
+                if (*r == '\0') {
+                    lx->err = "unterminated double quote";
+                    return LEX_ERROR;
+                }
+                if (*r == '$') {
+                    if (lex_dollar(lx, &o, &r, false) < 0)
+                        return LEX_ERROR;
+                    continue;
+                }
+                if (*r == '\\' && r[1] == '\n') {
+                    r += 2;
+                    continue;
+                }
+                if (*r == '\\' && (r[1] == '"' || r[1] == '\\' || r[1] == '$'))
+                    r++;
+                lex_put(lx, &o, r, 1);
+                r++;
+            }
+            r++;
+            o.quoted = true;
+            break;
+
+        case '\\':
+            if (r[1] == '\0') {
+                r++;
+                break;
+            }
+            /* a backslash-newline joins the lines */
+            if (r[1] != '\n') {
+                lex_put(lx, &o, r + 1, 1);
+                o.quoted = true;
+            }
+            r += 2;
+            break;
+
+        case '$':
+            ret = lex_dollar(lx, &o, &r, true);
+            if (ret < 0)
+                return LEX_ERROR;
+            if (ret > 0)
+                expanded = true;
+            break;
+
+        default:
+            goto done;
+        }
+    }
+
+done:
+    /*
+     * Consume whatever ended the word before writing the nul, which may land
+     * on it.
+     */
+    if (lex_is_blank(*r)) {
+        lx->after_nl = (*r == '\n');
+        r++;
+    } else {
+        lx->pending = lex_operator(lx, &r);
+    }
+
+    if (o.cap_end != NULL)
+        lex_reserve(lx, &o, 0);
+    *o.w = '\0';
+    lx->p = r;
+
+    /* a word that was split comes back one field at a time */
+    if (lx->fields != NULL) {
+        if (o.w > o.start || o.quoted)
+            lex_field_end(lx, &o);
+        f = lx->fields;
+        lx->fields = f->next;
+        if (lx->fields == NULL)
+            lx->fields_tail = &lx->fields;
+        tok->s = f->s;
+        tok->len = f->len;
+        return LEX_WORD;
+    }
+
+    if (o.w == o.start && expanded && !o.quoted)
+        return LEX_NONE;
+
+    tok->s = o.start;
+    tok->len = (size_t)(o.w - o.start);
+    tok->quoted = o.quoted;
+    return LEX_WORD;
+}
+
+
+/* queue a here-document whose body starts after the current line */
+void
+lex_heredoc(struct lexer *lx, struct lex_heredoc *hd)
+{
+    hd->body = NULL;
+    hd->len = 0;
+    hd->next = NULL;
+    *lx->heredocs_tail = hd;
+    lx->heredocs_tail = &hd->next;
+}
+
+
+/*
+ * Read the body of `hd`, which starts at `p`, up to the delimiter line.
+ * The body is rebuilt in place like a word: tabs are stripped and, unless
+ * the delimiter was quoted, $ expansions are done and a backslash escapes
+ * $, `, \ and newline.  Return where the next line starts, or NULL on a
+ * syntax error.  Without a delimiter line, the body runs to the end.
+ */
+static char *
+lex_heredoc_body(struct lexer *lx, struct lex_heredoc *hd, char *p)
+{
+    struct lex_out o = { .start = p, .w = p, .cap_end = NULL };
+    size_t delim_len = strlen(hd->delim);
+    char *end, *q;
+
+    while (*p != '\0') {
+        if (hd->strip_tabs)
+            p += strspn(p, "\t");
+        end = p + strcspn(p, "\n");
+        if ((size_t)(end - p) == delim_len &&
+                memcmp(p, hd->delim, delim_len) == 0) {
+            p = *end == '\n' ? end + 1 : end;
+            break;
+        }
+        if (*end == '\n')
+            end++;
+
+        if (!hd->expand) {
+            lex_put(lx, &o, p, (size_t)(end - p));
+            p = end;
+            continue;
+        }
+        while (p < end) {
+            if (*p == '$') {
+                if (lex_dollar(lx, &o, &p, false) < 0)
+                    return NULL;
+            } else if (*p == '\\' && p + 1 < end && (p[1] == '$' ||
+                        p[1] == '`' || p[1] == '\\' || p[1] == '\n')) {
+                if (p[1] != '\n')
+                    lex_put(lx, &o, p + 1, 1);
+                p += 2;
+            } else {
+                for (q = p + 1; q < end && *q != '$' && *q != '\\'; q++)
+                    ;
+                lex_put(lx, &o, p, (size_t)(q - p));
+                p = q;
+            }
+        }
+    }
+
+    /* in place, the body ends before the delimiter line, behind `p` */
+    if (o.cap_end != NULL)
+        lex_reserve(lx, &o, 0);
+    *o.w = '\0';
+    hd->body = o.start;
+    hd->len = (size_t)(o.w - o.start);
+
+    return p;
+}
+
+
+/* at the start of a line: read the bodies of the here-documents queued */
+static bool
+lex_heredocs(struct lexer *lx)
+{
+    struct lex_heredoc *hd;
+    char *p;
+
+    while ((hd = lx->heredocs) != NULL) {
+        lx->heredocs = hd->next;
+        p = lex_heredoc_body(lx, hd, lx->p);
+        if (p == NULL)
+            return false;
+        lx->p = p;
+    }
+    lx->heredocs_tail = &lx->heredocs;
+
+    return true;
+}
+
+
+enum lex_type
+lex_next(struct lexer *lx, struct lex_token *tok)
+{
+    lex_var_fn var = lx->var;
+    struct lex_field *f;
+
+    tok->s = NULL;
+    tok->len = 0;
+    tok->quoted = false;
+
+    do {
+        /* the rest of a word that was split */
+        if (lx->fields != NULL) {
+            f = lx->fields;
+            lx->fields = f->next;
+            if (lx->fields == NULL)
+                lx->fields_tail = &lx->fields;
+            tok->s = f->s;
+            tok->len = f->len;
+            tok->type = LEX_WORD;
+            break;
+        }
+
+        if (lx->pending != LEX_NONE) {
+            tok->type = lx->pending;
+            lx->pending = LEX_NONE;
+            break;
+        }
+
+        for (;;) {
+            if (lx->after_nl && lx->heredocs != NULL && !lex_heredocs(lx))
+                goto error;
+            lx->after_nl = false;
+
+            if (*lx->p == '\n') {
+                lx->p++;
+                lx->after_nl = true;
+            } else if (lex_is_blank(*lx->p)) {
+                lx->p++;
+            } else if (lx->p[0] == '\\' && lx->p[1] == '\n') {
+                lx->p += 2;
+            } else {
+                break;
+            }
+        }
+
+        /* a '#' that starts a word comments out the rest of the line */
+        if (*lx->p == '#') {
+            lx->p += strcspn(lx->p, "\n");
+            tok->type = LEX_NONE;
+        } else if (*lx->p == '\0') {
+            /* here-documents cut short by the end of the input are empty */
+            if (lx->heredocs != NULL && !lex_heredocs(lx))
+                goto error;
+            tok->type = LEX_END;
+        } else {
+            tok->type = lex_operator(lx, &lx->p);
+            if (tok->type == LEX_NONE) {
+                /* a here-document delimiter is not expanded */
+                if (lx->heredoc_word)
+                    lx->var = NULL;
+                tok->type = lex_word(lx, tok);
+                lx->var = var;
+            }
+        }
+    } while (tok->type == LEX_NONE);
+
+    lx->heredoc_word = (tok->type == LEX_HEREDOC ||
+            tok->type == LEX_HEREDOC_STRIP);
+
+    if ((tok->type == LEX_PIPE || tok->type == LEX_PROCSUB_IN ||
+                tok->type == LEX_PROCSUB_OUT) && lx->op_arg != NULL) {
+        tok->s = lx->op_arg;
+        tok->len = strlen(lx->op_arg);
+    }
+
+    return tok->type;
+
+error:
+    lx->p += strlen(lx->p);
+    tok->type = LEX_ERROR;
+    return tok->type;
+}
@@ -0,0 +1,116 @@
+#ifndef _LEX_H_
+#define _LEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single-pass, zero-copy tokenizer for a command line.
+ *
+ * Words are unquoted in place: each LEX_WORD token points into the line
+ * buffer, which the lexer rewrites and nul-terminates as it goes, so no
+ * argument is ever copied.  The line must be nul-terminated and must stay
+ * alive (and unmodified by anyone else) for as long as the tokens are used.
+ * Only words that grow through variable expansion or command substitution
+ * are built elsewhere.
+ *
+ * The line may hold several physical lines: newlines are blanks, a
+ * backslash-newline is removed, and a '#' that starts a word comments out
+ * the rest of its line.  The bodies of here-documents follow the line that
+ * introduces them, as usual.
+ */
+
+enum lex_type {
+    LEX_NONE = 0,
+    LEX_WORD,
+    LEX_PIPE,           /* | */
+    LEX_AMP,            /* & */
+    LEX_REDIR_IN,       /* < */
+    LEX_REDIR_OUT,      /* > */
+    LEX_REDIR_APPEND,   /* >> */
+    LEX_HEREDOC,        /* << */
+    LEX_HEREDOC_STRIP,  /* <<- */
+    LEX_HERESTRING,     /* <<< */
+    LEX_PROCSUB_IN,     /* <(...) */
+    LEX_PROCSUB_OUT,    /* >(...) */
+    LEX_END,
+    LEX_ERROR,
+};
+
+struct lex_token {
+    enum lex_type type;
+    char *s;            /* LEX_WORD: the unquoted word; LEX_PIPE: ARG of
+                           `|[ARG]`, or NULL; LEX_PROCSUB_*: the command
+                           inside the parentheses, still to be lexed */
+    size_t len;
+    bool quoted;        /* LEX_WORD: some of it was quoted or escaped */
+};
+
+/*
+ * A here-document.  When the parser gets the delimiter word after `<<`, it
+ * queues one of these with lex_heredoc(), and the lexer fills in the body
+ * when it reaches the end of the line.  The body is nul-terminated, and
+ * unless the delimiter was quoted, its variables are expanded.
+ */
+struct lex_heredoc {
+    const char *delim;
+    bool strip_tabs;    /* <<-: leading tabs are removed from each line */
+    bool expand;
+    char *body;         /* NULL until the lexer has read it */
+    size_t len;
+    struct lex_heredoc *next;
+};
+
+struct mu_arena;
+struct lex_field;
+
+typedef const char * (*lex_var_fn)(void *ctx, const char *name, size_t len);
+typedef const char * (*lex_cmd_fn)(void *ctx, char *text, size_t *len);
+
+struct lexer {
+    char *p;            /* next byte to scan */
+    char *blk;          /* 64-byte block the scanner last looked at */
+    uint64_t blk_mask;  /* its special bytes, one bit per byte */
+    enum lex_type pending;  /* operator that ended the previous word */
+    char *op_arg;           /* its `|[ARG]` or `<(ARG)`, if any */
+    const char *err;    /* reason for the last LEX_ERROR */
+
+    struct lex_heredoc *heredocs;   /* waiting for their bodies */
+    struct lex_heredoc **heredocs_tail;
+    bool heredoc_word;  /* the next word is a here-document delimiter */
+    bool after_nl;      /* the last word ended at a newline */
+
+    struct mu_arena *arena; /* for words that grow through expansion */
+    lex_var_fn var;         /* NULL: '$' is an ordinary character */
+    void *var_ctx;
+    lex_cmd_fn cmd;         /* NULL: no $(...) */
+    struct lex_field *fields;   /* split from the last word, still to return */
+    struct lex_field **fields_tail;
+};
+
+/*
+ * How the lexer finds the next byte that needs attention (whitespace, an
+ * operator, a quote, a backslash, a '$' or the terminating nul).  LEX_SCAN_AUTO
+ * picks the widest one the CPU supports; the others exist for benchmarking.
+ */
+enum lex_scanner {
+    LEX_SCAN_AUTO = 0,
+    LEX_SCAN_SCALAR,
+    LEX_SCAN_SSE2,
+    LEX_SCAN_AVX2,
+};
+
+int lex_set_scanner(enum lex_scanner scanner);
+const char * lex_scanner_name(void);
+
+void lex_init(struct lexer *lx, char *line);
+void lex_set_expand(struct lexer *lx, struct mu_arena *arena, lex_var_fn var,
+        void *ctx);
+void lex_set_cmdsub(struct lexer *lx, lex_cmd_fn cmd);
+void lex_heredoc(struct lexer *lx, struct lex_heredoc *hd);
+enum lex_type lex_next(struct lexer *lx, struct lex_token *tok);
+bool lex_pipe_arg_ok(const char *arg, size_t len);
+const char * lex_type_str(enum lex_type type);
+
+#endif /* _LEX_H_ */
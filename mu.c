@@ -84,6 +84,181 @@ mu_strdup(const char *s)
 }
 
 
+struct mu_arena_chunk {
+    struct mu_arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+#define MU_ARENA_ALIGN  _Alignof(max_align_t)
+
+
+static struct mu_arena_chunk *
+mu_arena_chunk_new(size_t size)
+{
+    struct mu_arena_chunk *chunk;
+
+    chunk = mu_mallocarray(1, sizeof(*chunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+
+void
+mu_arena_init(struct mu_arena *arena, size_t chunk_size)
+{
+    arena->chunk = NULL;
+    arena->chunk_size = chunk_size;
+    arena->total = 0;
+}
+
+
+/*
+ * Release every allocation made from the arena.  If the arena grew past a
+ * single chunk, the chunks are replaced by one chunk big enough for all of
+ * them, so that the next round of the same size fits without allocating.
+ */
+void
+mu_arena_reset(struct mu_arena *arena)
+{
+    size_t total = arena->total;
+
+    if (arena->chunk == NULL)
+        return;
+
+    if (arena->chunk->next == NULL) {
+        arena->chunk->used = 0;
+        return;
+    }
+
+    mu_arena_destroy(arena);
+    arena->chunk = mu_arena_chunk_new(total);
+    arena->total = total;
+}
+
+
+void
+mu_arena_destroy(struct mu_arena *arena)
+{
+    struct mu_arena_chunk *chunk, *next;
+
+    for (chunk = arena->chunk; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    arena->chunk = NULL;
+    arena->total = 0;
+}
+
+
+void *
+mu_arena_alloc(struct mu_arena *arena, size_t n)
+{
+    struct mu_arena_chunk *chunk = arena->chunk;
+    size_t size;
+    void *p;
+
+    if (n > SIZE_MAX - MU_ARENA_ALIGN)
+        mu_panic("integer overflow: arena allocation of %zu bytes", n);
+    n = (n + MU_ARENA_ALIGN - 1) & ~(MU_ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < n) {
+        size = n > arena->chunk_size ? n : arena->chunk_size;
+        chunk = mu_arena_chunk_new(size);
+        chunk->next = arena->chunk;
+        arena->chunk = chunk;
+        arena->total += size;
+    }
+
+    p = (uint8_t *)chunk->data + chunk->used;
+    chunk->used += n;
+
+    return p;
+}
+
+
+void *
+mu_arena_zalloc(struct mu_arena *arena, size_t n)
+{
+    void *p = mu_arena_alloc(arena, n);
+
+    mu_memzero(p, n);
+    return p;
+}
+
+
+void *
+mu_arena_mallocarray(struct mu_arena *arena, size_t nmemb, size_t size)
+{
+    size_t n = 0;
+
+    if (__builtin_umull_overflow(nmemb, size, &n))
+        mu_panic("integer overflow: %zu * %zu", nmemb, size);
+
+    return mu_arena_alloc(arena, n);
+}
+
+
+/*
+ * Grow an array of `old_nmemb` elements to `nmemb` elements.  If `ptr` is
+ * the most recent allocation and the chunk has room, it is grown in place;
+ * otherwise the contents are copied to a new allocation (the old one is only
+ * reclaimed by mu_arena_reset()).
+ */
+void *
+mu_arena_reallocarray(struct mu_arena *arena, void *ptr,
+        size_t old_nmemb, size_t nmemb, size_t size)
+{
+    struct mu_arena_chunk *chunk = arena->chunk;
+    size_t old_n, n = 0;
+    void *p;
+
+    if (__builtin_umull_overflow(nmemb, size, &n))
+        mu_panic("integer overflow: %zu * %zu", nmemb, size);
+    old_n = (old_nmemb * size + MU_ARENA_ALIGN - 1) & ~(MU_ARENA_ALIGN - 1);
+
+    if (ptr != NULL && chunk != NULL &&
+            (uint8_t *)ptr + old_n == (uint8_t *)chunk->data + chunk->used) {
+        n = (n + MU_ARENA_ALIGN - 1) & ~(MU_ARENA_ALIGN - 1);
+        if (n <= old_n || n - old_n <= chunk->size - chunk->used) {
+            chunk->used = chunk->used - old_n + n;
+            return ptr;
+        }
+    }
+
+    p = mu_arena_alloc(arena, n);
+    if (ptr != NULL)
+        memcpy(p, ptr, MU_MIN(old_nmemb, nmemb) * size);
+
+    return p;
+}
+
+
+char *
+mu_arena_strndup(struct mu_arena *arena, const char *s, size_t n)
+{
+    char *p;
+
+    p = mu_arena_alloc(arena, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+
+    return p;
+}
+
+
+char *
+mu_arena_strdup(struct mu_arena *arena, const char *s)
+{
+    return mu_arena_strndup(arena, s, strlen(s));
+}
+
+
 /* 
  * On success, return 0 and set val to the parsed value.
  * On failure, return a negative errno value.
@@ -460,3 +635,46 @@ mu_timestamp_utc(void *buf, size_t buf_size)
     return mu_strlcpy(buf, stamp, buf_size);
 }
 
+
+
+/*
+ * Nanoseconds on the monotonic clock: for measuring intervals, not for
+ * telling the time.
+ */
+uint64_t
+mu_now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        mu_panic("clock_gettime");
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * 64-bit FNV-1a hash of `len` bytes.  Not cryptographic; meant for hash
+ * tables and cache keys.
+ */
+uint64_t
+mu_hash_fnv1a(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+
+uint64_t
+mu_hash_str(const char *s)
+{
+    return mu_hash_fnv1a(s, strlen(s));
+}
@@ -1,6 +1,8 @@
 #ifndef _MU_H_
 #define _MU_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -80,6 +82,36 @@ char * mu_strdup(const char *s);
 #define MU_NEW(type, varname) \
     struct type *varname = mu_zalloc(sizeof(*varname))
 
+/*
+ * Arena (bump) allocator.  Allocations are carved out of large chunks and
+ * are never freed individually; mu_arena_reset() releases everything at once
+ * and keeps the memory for reuse, so a workload that allocates about the same
+ * amount each round settles into doing no malloc/free at all.
+ */
+struct mu_arena_chunk;
+
+struct mu_arena {
+    struct mu_arena_chunk *chunk;   /* current chunk; older ones chain off it */
+    size_t chunk_size;              /* minimum size of a new chunk */
+    size_t total;                   /* sum of all chunk sizes */
+};
+
+#define MU_ARENA_DEFAULT_CHUNK_SIZE (16 * 1024)
+
+void mu_arena_init(struct mu_arena *arena, size_t chunk_size);
+void mu_arena_reset(struct mu_arena *arena);
+void mu_arena_destroy(struct mu_arena *arena);
+void * mu_arena_alloc(struct mu_arena *arena, size_t n);
+void * mu_arena_zalloc(struct mu_arena *arena, size_t n);
+void * mu_arena_mallocarray(struct mu_arena *arena, size_t nmemb, size_t size);
+void * mu_arena_reallocarray(struct mu_arena *arena, void *ptr,
+        size_t old_nmemb, size_t nmemb, size_t size);
+char * mu_arena_strdup(struct mu_arena *arena, const char *s);
+char * mu_arena_strndup(struct mu_arena *arena, const char *s, size_t n);
+
+#define MU_ARENA_NEW(arena, type, varname) \
+    struct type *varname = mu_arena_zalloc(arena, sizeof(*varname))
+
 int mu_str_to_long(const char *s, int base, long *val);
 int mu_str_to_int(const char *s, int base, int *val);
 int mu_str_to_uint(const char *s, int base, unsigned int *val);
@@ -95,5 +127,9 @@ int mu_write_n(int fd, const void *data, size_t count, size_t *total);
 int mu_pwrite_n(int fd, const void *data, size_t count, off_t offset, size_t *total);
 
 size_t mu_timestamp_utc(void *buf, size_t buf_size);
+uint64_t mu_now_ns(void);
+
+uint64_t mu_hash_fnv1a(const void *data, size_t len);
+uint64_t mu_hash_str(const char *s);
 
 #endif /* _MU_H_ */
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include <stdint.h>
+
+/*
+ * The protocol of `bsh --serve SOCKET`, a SOCK_SEQPACKET UNIX socket.
+ *
+ * A request is one message: the command text (any number of lines, not
+ * nul-terminated), with SCM_RIGHTS carrying exactly three fds, which become
+ * the commands' stdin, stdout and stderr.  Once the commands have run, the
+ * server answers with one struct serve_reply.  A connection can carry any
+ * number of requests, one at a time.
+ */
+#define SERVE_MAX_TEXT (64 * 1024)
+#define SERVE_NUM_FDS 3
+
+struct serve_reply {
+    int32_t status;         /* exit status, as $? would have it */
+};
+
+#endif /* _SERVE_H_ */
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Process and command substitution: each case runs a line with `bsh -c`
+# and compares its output with what it should print.
+#
+# Usage: tests/subst.sh [BSH]
+
+bsh=${1:-./bsh}
+fail=0
+
+check() {
+    out=$("$bsh" -c "$1" 2>&1)
+    if [ "$out" != "$2" ]; then
+        printf 'FAIL: %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$out"
+        fail=1
+    fi
+}
+
+check 'cat <(echo "x\")y")'        'x")y'
+check 'cat <(echo "a)b" '\''c)d'\'')'  'a)b c)d'
+check 'cat <(echo a\)b)'            'a)b'
+check 'echo $(echo "a\"b")'         'a"b'
+check 'echo $(echo "a)b")'          'a)b'
+check 'echo $(echo '\''a")b'\'')'   'a")b'
+
+exit $fail